@@ -0,0 +1,159 @@
+/*
+ * Times the dict key hash against the FNV-1a hash from bstraux, on
+ * the header names and values in a Mongrel2 request dump and on
+ * random keys of typical header lengths.
+ *
+ * Usage: hash_keys [dump]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bstring.h"
+#include "bstring/bstraux.h"
+#include "strhash.h"
+
+/*
+ * A power of two, so the key for each step is found with a mask.
+ */
+#define NKEYS 1024
+#define HASHES 20000000L
+#define RUNS 3
+
+static struct tagbstring keys[NKEYS];
+static char store[NKEYS][128];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Reads the names and values of the headers in the dump at \a path
+ * into keys, repeating them until it is full. Returns the number of
+ * strings in the dump.
+ */
+static int read_keys(const char * path) {
+    static char dump[1 << 16];
+    int found = 0;
+    int n = 0;
+
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    size_t len = fread(dump, 1, sizeof(dump), f);
+    fclose(f);
+
+    while (n < NKEYS) {
+        const char * p = dump;
+        const char * pe = dump + len;
+        int start = n;
+
+        while (p < pe && n < NKEYS) {
+            int spaces = 0;
+
+            // Skip the UUID, CONN_ID and PATH, and the headers' length
+            while (p < pe && spaces < 3) {
+                if (*p++ == ' ')
+                    spaces++;
+            }
+            while (p < pe && *p != ':')
+                p++;
+            p++;
+
+            // Each "LEN:DATA," of the headers, up to its '}'
+            while (p < pe && *p != '}' && n < NKEYS) {
+                size_t slen = 0;
+                while (p < pe && *p >= '0' && *p <= '9')
+                    slen = slen * 10 + (*p++ - '0');
+                p++;
+                if (slen >= sizeof(store[0]))
+                    slen = sizeof(store[0]) - 1;
+                memcpy(store[n], p, slen);
+                blk2tbstr(keys[n], store[n], slen);
+                n++;
+                p += slen + 1;
+            }
+
+            while (p < pe && *p != '\n')
+                p++;
+            p++;
+        }
+
+        if (n == start)
+            return 0;
+        if (!found)
+            found = n;
+    }
+
+    return found;
+}
+
+static void random_keys(int len) {
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < NKEYS; i++) {
+        for (j = 0; j < len; j++)
+            store[i][j] = 'a' + rand() % 26;
+        blk2tbstr(keys[i], store[i], len);
+    }
+}
+
+static void run(const char * name) {
+    double fnv = 0, hash = 0, caseless = 0;
+    unsigned long sink = 0;
+    int run = 0;
+    long n = 0;
+
+    for (run = 0; run < RUNS; run++) {
+        double start = now_ns();
+        for (n = 0; n < HASHES; n++)
+            sink += bstr_hash_fun(&keys[n & (NKEYS - 1)]);
+        double t = (now_ns() - start) / HASHES;
+        if (run == 0 || t < fnv) fnv = t;
+
+        start = now_ns();
+        for (n = 0; n < HASHES; n++)
+            sink += strhash(keys[n & (NKEYS - 1)].data, keys[n & (NKEYS - 1)].slen);
+        t = (now_ns() - start) / HASHES;
+        if (run == 0 || t < hash) hash = t;
+
+        start = now_ns();
+        for (n = 0; n < HASHES; n++)
+            sink += strhash_caseless(keys[n & (NKEYS - 1)].data, keys[n & (NKEYS - 1)].slen);
+        t = (now_ns() - start) / HASHES;
+        if (run == 0 || t < caseless) caseless = t;
+    }
+
+    // The sum is printed so the loops can't be optimized away
+    printf("%-14s fnv %6.2f  strhash %6.2f  caseless %6.2f ns/key  (%lu)\n",
+            name, fnv, hash, caseless, sink & 1);
+}
+
+int main(int argc, char ** argv) {
+    const char * path = argc > 1 ? argv[1] : "data/headers.tns";
+    int lens[] = { 4, 8, 12, 16, 24, 32, 64 };
+    char name[32];
+    size_t i = 0;
+
+    strhash_init();
+
+    int found = read_keys(path);
+    if (!found) {
+        fprintf(stderr, "No headers in %s\n", path);
+        return 1;
+    }
+    snprintf(name, sizeof(name), "%d from dump", found);
+    run(name);
+
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        random_keys(lens[i]);
+        snprintf(name, sizeof(name), "%d bytes", lens[i]);
+        run(name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Times parsing the headers of the Mongrel2 requests in a dump, the
+ * way a handler does for each request it receives.
+ *
+ * The dump holds one request per line, as Mongrel2 sends them:
+ *
+ *     UUID CONN_ID PATH LEN:HEADERS,LEN:BODY,
+ *
+ * Only functions the library has always had are used, so this also
+ * builds against older sources to compare with them:
+ *
+ *     make -C bench SRC_DIR=/path/to/old/src
+ *
+ * Usage: tns_headers [dump] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bstring.h"
+#include "variant.h"
+
+#define MAX_REQUESTS 256
+#define RUNS 5
+
+typedef struct headers {
+    const char * data;
+    size_t len;
+} headers_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char * read_file(const char * path, size_t * len) {
+    FILE * f = fopen(path, "rb");
+    char * data = NULL;
+
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(*len + 1);
+    if (data && fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(f);
+    return data;
+}
+
+/*
+ * Finds the headers TNetstring of each request in the dump.
+ */
+static int find_headers(const char * p, const char * pe, headers_t * out, int max) {
+    int n = 0;
+
+    while (p < pe && n < max) {
+        int spaces = 0;
+        size_t len = 0;
+
+        // UUID, CONN_ID and PATH
+        while (p < pe && spaces < 3) {
+            if (*p++ == ' ')
+                spaces++;
+        }
+
+        out[n].data = p;
+        while (p < pe && *p >= '0' && *p <= '9')
+            len = len * 10 + (*p++ - '0');
+        if (p >= pe || *p != ':' || (size_t)(pe - p) < len + 2)
+            return -1;
+
+        p += 1 + len + 1;
+        out[n].len = p - out[n].data;
+        n++;
+
+        // The body, then the end of the line
+        while (p < pe && *p != '\n')
+            p++;
+        p++;
+    }
+
+    return n;
+}
+
+int main(int argc, char ** argv) {
+    const char * path = argc > 1 ? argv[1] : "data/headers.tns";
+    long iterations = argc > 2 ? atol(argv[2]) : 100000;
+    headers_t headers[MAX_REQUESTS];
+    struct tagbstring method_key = bsStatic("METHOD");
+    size_t total_len = 0;
+    double best = 0;
+    size_t len = 0;
+    int run = 0;
+    int i = 0;
+
+    char * dump = read_file(path, &len);
+    if (!dump) {
+        fprintf(stderr, "Can't read %s\n", path);
+        return 1;
+    }
+
+    int n = find_headers(dump, dump + len, headers, MAX_REQUESTS);
+    if (n <= 0) {
+        fprintf(stderr, "No requests in %s\n", path);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++)
+        total_len += headers[i].len;
+
+    for (run = 0; run < RUNS; run++) {
+        double start = now_ns();
+        long iter = 0;
+
+        for (iter = 0; iter < iterations; iter++) {
+            for (i = 0; i < n; i++) {
+                variant_t * val = m2_parse_tns(headers[i].data, headers[i].len, NULL);
+                if (!val || !m2_variant_dict_get(val, &method_key)) {
+                    fprintf(stderr, "Error parsing request %d\n", i);
+                    return 1;
+                }
+                m2_variant_destroy(val);
+            }
+        }
+
+        double ns = (now_ns() - start) / ((double)iterations * n);
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+
+    printf("%d requests, %zu header bytes: %.0f ns/request, %.0f MB/s\n",
+            n, total_len, best, total_len / (best * n) * 1e3);
+
+    free(dump);
+    return 0;
+}
@@ -60,7 +60,7 @@ void darray_clear(darray_t *array)
     if(array->element_size > 0) {
         for(i = 0; i < array->max; i++) {
             if(array->contents[i] != NULL) {
-                free(array->contents[i]);
+                darray_free(array->contents[i]);
             }
         }
     }
@@ -68,8 +68,11 @@ void darray_clear(darray_t *array)
 
 static inline int darray_resize(darray_t *array, size_t newsize)
 {
+    void **contents = h_realloc(array->contents, newsize * sizeof(void *));
+    if(contents == NULL) return -1;
+
     array->max = newsize;
-    array->contents = h_realloc(array->contents, array->max * sizeof(void *));
+    array->contents = contents;
     return 0;
 }
 
@@ -77,7 +80,9 @@ int darray_expand(darray_t *array)
 {
     size_t old_max = array->max;
 
-    memset(array->contents + old_max, 0, array->expand_rate + 1);
+    if(darray_resize(array, array->max + array->expand_rate) != 0) return -1;
+
+    memset(array->contents + old_max, 0, array->expand_rate * sizeof(void *));
     return 0;
 
 }
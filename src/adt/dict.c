@@ -273,11 +273,13 @@ static void safe_traverse(dict_t *dict, void (*func)(dnode_t *, void *))
             if (current->left != nil) {
                 next = current->left;
             } else 
+            /* FALLTHROUGH */
         case from_left:
             if (current->right != nil) {
                 came_from = from_parent;
                 next = current->right;
             } else 
+            /* FALLTHROUGH */
         case from_right:
             {
                 came_from = (current == current->parent->left) 
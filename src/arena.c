@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "mem/halloc.h"
+#include "err.h"
+
+#include "arena.h"
+
+#define ARENA_DEFAULT_SIZE 4096
+#define ARENA_MAX_CHUNK (1 << 20)
+
+/*
+ * Every allocation is rounded up to this, which suits pointers,
+ * longs and doubles.
+ */
+#define ARENA_ALIGN 8
+
+/*
+ * Allocations bigger than this fraction of a chunk get a chunk of
+ * their own, so they don't waste the rest of the current one.
+ */
+#define ARENA_LARGE_DIVISOR 4
+
+typedef struct arena_chunk {
+    struct arena_chunk * next;
+    size_t size;
+} arena_chunk_t;
+
+/*
+ * The chunk header is padded so the data after it stays aligned.
+ */
+#define CHUNK_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena {
+    /// The free space in the current chunk
+    char * ptr;
+    char * end;
+    /// The current chunk first, then the older ones
+    arena_chunk_t * chunks;
+    /// The size of the next chunk
+    size_t chunk_size;
+    /// A moving average of the space used between resets
+    size_t average;
+};
+
+m2_arena_t * m2_arena_new(size_t size) {
+    m2_arena_t * arena = h_malloc(sizeof(*arena));
+    check_mem(arena);
+
+    memset(arena, 0, sizeof(*arena));
+    arena->chunk_size = size ? size : ARENA_DEFAULT_SIZE;
+
+    return arena;
+
+error:
+    return NULL;
+}
+
+void m2_arena_destroy(m2_arena_t * arena) {
+    if (arena) {
+        h_free(arena);
+    }
+}
+
+static arena_chunk_t * chunk_new(m2_arena_t * arena, size_t size) {
+    arena_chunk_t * chunk = h_malloc(CHUNK_HEADER + size);
+    check_mem(chunk);
+    hattach(chunk, arena);
+
+    chunk->size = size;
+
+    return chunk;
+
+error:
+    return NULL;
+}
+
+static void * arena_alloc_slow(m2_arena_t * arena, size_t size) {
+    char * data = NULL;
+
+    if (size > arena->chunk_size / ARENA_LARGE_DIVISOR) {
+        arena_chunk_t * chunk = chunk_new(arena, size);
+        check(chunk, "Error growing arena");
+
+        // Keep using the current chunk for small allocations
+        if (arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = NULL;
+            arena->chunks = chunk;
+            arena->ptr = arena->end = (char *)chunk + CHUNK_HEADER + size;
+        }
+
+        return (char *)chunk + CHUNK_HEADER;
+    }
+
+    arena_chunk_t * chunk = chunk_new(arena, arena->chunk_size);
+    check(chunk, "Error growing arena");
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    data = (char *)chunk + CHUNK_HEADER;
+    arena->ptr = data + size;
+    arena->end = data + chunk->size;
+
+    // Each chunk added before a reset is bigger than the last, so
+    // a use that outgrows the arena needs few of them.
+    if (arena->chunk_size < ARENA_MAX_CHUNK)
+        arena->chunk_size *= 2;
+
+    return data;
+
+error:
+    return NULL;
+}
+
+void * m2_arena_alloc(m2_arena_t * arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if ((size_t)(arena->end - arena->ptr) >= size) {
+        void * data = arena->ptr;
+        arena->ptr += size;
+        return data;
+    }
+
+    return arena_alloc_slow(arena, size);
+}
+
+void * m2_arena_realloc(m2_arena_t * arena, void * ptr, size_t old_size, size_t size) {
+    arena_chunk_t * prev = NULL;
+    arena_chunk_t * chunk = NULL;
+    char * data = ptr;
+
+    if (!ptr)
+        return m2_arena_alloc(arena, size);
+
+    old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    int top = data + old_size == arena->ptr;
+
+    if (top && (size_t)(arena->end - data) >= size) {
+        // The last allocation from the current chunk can change size
+        // where it is
+        arena->ptr = data + size;
+        return data;
+    }
+
+    if (arena->chunks) {
+        // Large allocations are the whole of their chunk, and the
+        // latest one follows the current chunk, unless it is the
+        // only chunk.
+        prev = arena->chunks;
+        chunk = prev->next;
+        if (!chunk || (char *)chunk + CHUNK_HEADER != data) {
+            prev = NULL;
+            chunk = arena->chunks;
+        }
+
+        if ((char *)chunk + CHUNK_HEADER == data && chunk->size == old_size) {
+            chunk = h_realloc(chunk, CHUNK_HEADER + size);
+            check_mem(chunk);
+
+            chunk->size = size;
+            if (prev) {
+                prev->next = chunk;
+            } else {
+                arena->chunks = chunk;
+                arena->ptr = arena->end = (char *)chunk + CHUNK_HEADER + size;
+            }
+
+            return (char *)chunk + CHUNK_HEADER;
+        }
+    }
+
+    if (size <= old_size)
+        return ptr;
+
+    data = m2_arena_alloc(arena, size);
+    check_mem(data);
+    memcpy(data, ptr, old_size);
+
+    // Give the old space back if nothing has been allocated after it
+    if (top && arena->ptr == (char *)ptr + old_size)
+        arena->ptr = ptr;
+
+    return data;
+
+error:
+    return NULL;
+}
+
+/*
+ * Counts the bytes handed out from \a arena. Unlike m2_arena_used()
+ * this leaves m2_errno() alone, so resetting an arena on an error path
+ * keeps the error.
+ */
+static size_t arena_used(const m2_arena_t * arena) {
+    size_t used = 0;
+    arena_chunk_t * chunk = NULL;
+
+    for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+        used += chunk->size;
+    }
+
+    return used - (arena->end - arena->ptr);
+}
+
+size_t m2_arena_used(const m2_arena_t * arena) {
+    check(arena, "Invalid arena");
+
+    return arena_used(arena);
+
+error:
+    return 0;
+}
+
+/*
+ * Rounds \a n up to a power of two, between the default chunk size
+ * and ARENA_MAX_CHUNK.
+ */
+static size_t chunk_size_for(size_t n) {
+    size_t size = ARENA_DEFAULT_SIZE;
+
+    while (size < n && size < ARENA_MAX_CHUNK) {
+        size *= 2;
+    }
+
+    return size;
+}
+
+void m2_arena_reset(m2_arena_t * arena) {
+    arena_chunk_t * keep = NULL;
+    arena_chunk_t * chunk = NULL;
+    arena_chunk_t * next = NULL;
+
+    if (!arena || !arena->chunks) return;
+
+    size_t used = arena_used(arena);
+    arena->average = arena->average ? (arena->average * 3 + used) / 4 : used;
+
+    // Size the next chunk so a typical use fits in it, but let a
+    // single large use raise it straight away.
+    size_t size = chunk_size_for(used > arena->average ? used : arena->average);
+
+    // Keep a chunk that is big enough without being far too big
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+
+        if (!keep && chunk->size >= size && chunk->size <= size * 4) {
+            keep = chunk;
+        } else {
+            h_free(chunk);
+        }
+    }
+
+    arena->chunks = keep;
+    arena->chunk_size = size;
+
+    if (keep) {
+        keep->next = NULL;
+        arena->ptr = (char *)keep + CHUNK_HEADER;
+        arena->end = arena->ptr + keep->size;
+    } else {
+        arena->ptr = arena->end = NULL;
+    }
+}
@@ -0,0 +1,66 @@
+/**
+ * @file arena.h
+ *
+ * Bump-pointer arenas for short-lived allocations.
+ *
+ * Everything allocated from an arena is freed at once, when the
+ * arena is reset or destroyed. Each request has one, which holds
+ * the variants parsed from it.
+ */
+#ifndef _ARENA_H_DEF
+#define _ARENA_H_DEF
+
+#include <stddef.h>
+
+typedef struct arena m2_arena_t;
+
+/**
+ * Creates an empty arena. Nothing is allocated until the arena is
+ * first used.
+ *
+ * @param size      The size of the first chunk, or 0 for a default.
+ *                  Later chunk sizes follow how much each use of
+ *                  the arena needed.
+ *
+ * @returns A new arena, or NULL on error.
+ */
+m2_arena_t * m2_arena_new(size_t size);
+
+/**
+ * Frees an arena and everything allocated from it.
+ */
+void m2_arena_destroy(m2_arena_t * arena);
+
+/**
+ * Allocates \a size bytes, aligned for any of the library's types.
+ *
+ * @returns The memory, or NULL on error.
+ */
+void * m2_arena_alloc(m2_arena_t * arena, size_t size);
+
+/**
+ * Changes the size of the allocation at \a ptr, which was
+ * \a old_size bytes, keeping its contents.
+ *
+ * The latest allocation grows or shrinks in place when there is
+ * room, so arrays that are filled one item at a time don't leave
+ * their old copies behind. Other allocations only move to a new
+ * place when they grow.
+ *
+ * @returns The memory, or NULL on error, in which case \a ptr is
+ *          unchanged.
+ */
+void * m2_arena_realloc(m2_arena_t * arena, void * ptr, size_t old_size, size_t size);
+
+/**
+ * Frees everything allocated from the arena, keeping a chunk sized
+ * for recent uses.
+ */
+void m2_arena_reset(m2_arena_t * arena);
+
+/**
+ * Gets the number of bytes of chunk space used since the last reset.
+ */
+size_t m2_arena_used(const m2_arena_t * arena);
+
+#endif//_ARENA_H_DEF
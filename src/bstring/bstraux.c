@@ -1145,10 +1145,12 @@ uint32_t bstr_hash_fun(const void *kv)
 {
     bstring key = (bstring)kv;
     const unsigned char *str = (const unsigned char *)bdata(key);
+    const unsigned char *end = str + blength(key);
 
     uint32_t acc = FNV_OFFSET_BASIS;
 
-    while(*str) {
+    // Keys may not be NUL-terminated, so go by the length
+    while(str < end) {
         acc ^= *str;
         acc *= FNV_PRIME;
         str++;
@@ -38,7 +38,7 @@ extern void m2_perror();
 extern void m2_set_errstr(char * message, ...) __attribute__((format(printf, 1, 2)));
 extern void m2_set_errno(int n);
 
-#define check(A,M,...) if (!(A)) { m2_set_errno(-1); m2_set_errstr((M), ##__VA_ARGS__); assert(!(A)); goto error; } else { m2_set_errno(0); }
+#define check(A,M,...) if (!(A)) { m2_set_errno(-1); m2_set_errstr((M), ##__VA_ARGS__); goto error; } else { m2_set_errno(0); }
 #define check_mem(A) check(A, "Out of memory")
 
 #endif//_ERR_H_DEF
@@ -0,0 +1,304 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mem/halloc.h"
+#include "err.h"
+#include "strhash.h"
+#include "flatmap.h"
+
+#define FLATMAP_MIN_SIZE 8
+
+/*
+ * Tags are compared this many at a time, and the tag array is padded
+ * to a multiple of it.
+ */
+#define FLATMAP_GROUP 16
+
+/*
+ * The index is kept at most half full.
+ */
+#define FLATMAP_MIN_SLOTS 64
+
+static inline uint32_t flatmap_hash(const char * key, size_t len) {
+    return (uint32_t)strhash(key, len);
+}
+
+static inline uint8_t flatmap_tag(uint32_t hash) {
+    return hash >> 24;
+}
+
+/*
+ * Compares the FLATMAP_GROUP tags at \a tags with \a tag. Returns a
+ * mask with FLATMAP_MATCH_BITS bits per tag, the lowest of which is
+ * set for each tag that matches.
+ */
+#if defined(__SSE2__)
+
+#define FLATMAP_MATCH_SHIFT 0
+
+static inline uint64_t flatmap_match(const uint8_t * tags, uint8_t tag) {
+    __m128i v = _mm_loadu_si128((const __m128i *)tags);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(tag)));
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+// NEON has no movemask, so each comparison is narrowed to four bits
+#define FLATMAP_MATCH_SHIFT 2
+
+static inline uint64_t flatmap_match(const uint8_t * tags, uint8_t tag) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8(tags), vdupq_n_u8(tag));
+    uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrow), 0) & 0x1111111111111111ULL;
+}
+
+#else
+
+#define FLATMAP_MATCH_SHIFT 0
+
+static inline uint64_t flatmap_match(const uint8_t * tags, uint8_t tag) {
+    uint64_t mask = 0;
+    int i = 0;
+
+    for (i = 0; i < FLATMAP_GROUP; i++) {
+        mask |= (uint64_t)(tags[i] == tag) << i;
+    }
+
+    return mask;
+}
+
+#endif
+
+static inline int flatmap_key_equals(const flatmap_entry_t * e, uint32_t hash,
+        const char * key, size_t len) {
+    return e->hash == hash && (size_t)e->key.slen == len
+        && memcmp(e->key.data, key, len) == 0;
+}
+
+static flatmap_entry_t * flatmap_lookup(const flatmap_t * map, const char * key,
+        size_t len, uint32_t hash) {
+
+    uint32_t base = 0;
+
+    if (!map->mask) {
+        uint8_t tag = flatmap_tag(hash);
+
+        for (base = 0; base < map->count; base += FLATMAP_GROUP) {
+            uint64_t match = flatmap_match(map->tags + base, tag);
+
+            // Ignore the padding after the last entry
+            if (map->count - base < FLATMAP_GROUP)
+                match &= (1ULL << ((map->count - base) << FLATMAP_MATCH_SHIFT)) - 1;
+
+            while (match) {
+                uint32_t i = base + (__builtin_ctzll(match) >> FLATMAP_MATCH_SHIFT);
+                if (flatmap_key_equals(&map->entries[i], hash, key, len))
+                    return &map->entries[i];
+                match &= match - 1;
+            }
+        }
+
+        return NULL;
+    }
+
+    uint32_t i = hash & map->mask;
+    for (;;) {
+        const flatmap_slot_t * slot = &map->slots[i];
+        if (!slot->index)
+            return NULL;
+
+        if (slot->hash == hash) {
+            flatmap_entry_t * e = &map->entries[slot->index - 1];
+            if (flatmap_key_equals(e, hash, key, len))
+                return e;
+        }
+
+        i = (i + 1) & map->mask;
+    }
+}
+
+/*
+ * Allocates storage that belongs to \a map.
+ */
+static void * flatmap_mem(flatmap_t * map, size_t size) {
+    if (map->arena)
+        return m2_arena_alloc(map->arena, size);
+
+    void * mem = h_malloc(size);
+    if (mem) hattach(mem, map);
+    return mem;
+}
+
+/*
+ * Resizes an array that belongs to \a map. Arenas can't resize in
+ * place, so the contents are copied into a new array.
+ */
+static void * flatmap_resize(flatmap_t * map, void * mem, size_t old_size, size_t size) {
+    if (!map->arena) {
+        if (!mem)
+            return flatmap_mem(map, size);
+        return h_realloc(mem, size);
+    }
+
+    void * resized = m2_arena_alloc(map->arena, size);
+    if (resized && old_size)
+        memcpy(resized, mem, old_size);
+    return resized;
+}
+
+static inline size_t flatmap_tags_size(uint32_t max) {
+    return (max + FLATMAP_GROUP - 1) & ~(FLATMAP_GROUP - 1);
+}
+
+static int flatmap_reserve(flatmap_t * map, uint32_t max) {
+    size_t old_tags = flatmap_tags_size(map->max);
+    size_t new_tags = flatmap_tags_size(max);
+
+    flatmap_entry_t * entries = flatmap_resize(map, map->entries,
+            map->count * sizeof(flatmap_entry_t), max * sizeof(flatmap_entry_t));
+    check_mem(entries);
+    map->entries = entries;
+
+    uint8_t * tags = flatmap_resize(map, map->tags, old_tags, new_tags);
+    check_mem(tags);
+    memset(tags + old_tags, 0, new_tags - old_tags);
+    map->tags = tags;
+
+    map->max = max;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+static inline void flatmap_index_insert(flatmap_t * map, uint32_t hash, uint32_t index) {
+    uint32_t i = hash & map->mask;
+
+    while (map->slots[i].index) {
+        i = (i + 1) & map->mask;
+    }
+
+    map->slots[i].hash = hash;
+    map->slots[i].index = index;
+}
+
+/*
+ * Builds the index afresh with room for \a count entries.
+ */
+static int flatmap_reindex(flatmap_t * map, uint32_t count) {
+    uint32_t nslots = FLATMAP_MIN_SLOTS;
+    uint32_t i = 0;
+
+    while (nslots < count * 2) {
+        nslots *= 2;
+    }
+
+    flatmap_slot_t * slots = NULL;
+    if (map->arena || !map->slots) {
+        slots = flatmap_mem(map, nslots * sizeof(flatmap_slot_t));
+    } else {
+        slots = h_realloc(map->slots, nslots * sizeof(flatmap_slot_t));
+    }
+    check_mem(slots);
+    memset(slots, 0, nslots * sizeof(flatmap_slot_t));
+
+    map->slots = slots;
+    map->mask = nslots - 1;
+
+    for (i = 0; i < map->count; i++) {
+        flatmap_index_insert(map, map->entries[i].hash, i + 1);
+    }
+
+    return 1;
+
+error:
+    return 0;
+}
+
+flatmap_t * flatmap_create(m2_arena_t * arena, size_t hint) {
+    flatmap_t * map = arena ? m2_arena_alloc(arena, sizeof(*map)) : h_malloc(sizeof(*map));
+    check_mem(map);
+
+    memset(map, 0, sizeof(*map));
+    map->arena = arena;
+
+    if (hint < FLATMAP_MIN_SIZE)
+        hint = FLATMAP_MIN_SIZE;
+    if (hint > UINT32_MAX / 4)
+        hint = UINT32_MAX / 4;
+
+    check(flatmap_reserve(map, hint), "Error allocating map");
+
+    if (hint > FLATMAP_SCAN_MAX) {
+        check(flatmap_reindex(map, hint), "Error allocating map index");
+    }
+
+    return map;
+
+error:
+    flatmap_destroy(map);
+    return NULL;
+}
+
+void flatmap_destroy(flatmap_t * map) {
+    if (map && !map->arena) {
+        h_free(map);
+    }
+}
+
+flatmap_entry_t * flatmap_find(const flatmap_t * map, const char * key, size_t len) {
+    return flatmap_lookup(map, key, len, flatmap_hash(key, len));
+}
+
+int flatmap_set(flatmap_t * map, const char * key, size_t len, void * value,
+        int copy, void ** old) {
+
+    uint32_t hash = flatmap_hash(key, len);
+    flatmap_entry_t * e = flatmap_lookup(map, key, len, hash);
+
+    if (e) {
+        *old = e->value;
+        e->value = value;
+        return 1;
+    }
+
+    *old = NULL;
+
+    if (map->count == map->max) {
+        check(map->max < UINT32_MAX / 4, "Map is too large");
+        check(flatmap_reserve(map, map->max * 2), "Error growing map");
+    }
+
+    e = &map->entries[map->count];
+    blk2tbstr(e->key, key, len);
+    e->value = value;
+    e->hash = hash;
+
+    if (copy) {
+        char * data = flatmap_mem(map, len + 1);
+        check_mem(data);
+        memcpy(data, key, len);
+        data[len] = '\0';
+        e->key.data = (unsigned char *)data;
+    }
+
+    map->tags[map->count] = flatmap_tag(hash);
+    map->count++;
+
+    if (map->mask ? map->count * 2 > map->mask + 1 : map->count > FLATMAP_SCAN_MAX) {
+        check(flatmap_reindex(map, map->count), "Error growing map index");
+    } else if (map->mask) {
+        flatmap_index_insert(map, hash, map->count);
+    }
+
+    return 1;
+
+error:
+    return 0;
+}
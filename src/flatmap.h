@@ -0,0 +1,97 @@
+/**
+ * @file flatmap.h
+ *
+ * The hash table behind variant dictionaries.
+ *
+ * Entries are kept in one array, in the order they were added, along
+ * with their hashes. A parallel array holds a tag byte taken from each
+ * hash. Small maps are searched by comparing 16 tags at a time, which
+ * is faster than hashing into buckets at the sizes headers come in.
+ * Once a map grows past FLATMAP_SCAN_MAX entries it also gets an index
+ * of (hash, entry) slots, searched with linear probing.
+ *
+ * Keys are read-only bstrings. They either point at bytes that outlive
+ * the map, or at a copy the map owns.
+ */
+#ifndef _FLATMAP_H_DEF
+#define _FLATMAP_H_DEF
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bstring.h"
+#include "arena.h"
+
+/*
+ * Maps with more entries than this are searched through the index.
+ */
+#define FLATMAP_SCAN_MAX 32
+
+typedef struct flatmap_entry {
+    struct tagbstring key;
+    void * value;
+    uint32_t hash;
+} flatmap_entry_t;
+
+/*
+ * A slot in the index. \a index is one more than the position of
+ * the entry, so that zero marks an empty slot.
+ */
+typedef struct flatmap_slot {
+    uint32_t hash;
+    uint32_t index;
+} flatmap_slot_t;
+
+typedef struct flatmap {
+    flatmap_entry_t * entries;
+    uint8_t * tags;
+    flatmap_slot_t * slots;
+    uint32_t count;
+    uint32_t max;
+    /// The number of slots less one, or 0 if there is no index yet
+    uint32_t mask;
+    /// Where the map's storage comes from, or NULL for the heap
+    m2_arena_t * arena;
+} flatmap_t;
+
+/*
+ * Creates a map with room for \a hint entries, allocated from \a arena
+ * if it isn't NULL.
+ */
+flatmap_t * flatmap_create(m2_arena_t * arena, size_t hint);
+
+/*
+ * Frees a map and the keys it copied, but not the values. Does nothing
+ * for maps in an arena.
+ */
+void flatmap_destroy(flatmap_t * map);
+
+/*
+ * Finds the entry for the \a len bytes at \a key.
+ *
+ * Returns NULL if there isn't one.
+ */
+flatmap_entry_t * flatmap_find(const flatmap_t * map, const char * key, size_t len);
+
+/*
+ * Sets the value for \a key, copying the key bytes if \a copy is set.
+ * If the key was already present, \a old is set to the value it had,
+ * otherwise to NULL.
+ *
+ * Returns 0 on error, non-zero on success.
+ */
+int flatmap_set(flatmap_t * map, const char * key, size_t len, void * value,
+        int copy, void ** old);
+
+static inline uint32_t flatmap_count(const flatmap_t * map) {
+    return map->count;
+}
+
+/*
+ * Gets the \a i th entry, in the order they were added.
+ */
+static inline flatmap_entry_t * flatmap_entry(const flatmap_t * map, uint32_t i) {
+    return &map->entries[i];
+}
+
+#endif//_FLATMAP_H_DEF
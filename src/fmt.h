@@ -0,0 +1,68 @@
+/**
+ * @file fmt.h
+ *
+ * Small formatting helpers for building messages
+ * without going through printf.
+ */
+#ifndef _FMT_H_DEF
+#define _FMT_H_DEF
+
+#include <stddef.h>
+#include <string.h>
+
+static const char fmt_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/**
+ * Gets the number of decimal digits needed to write \a v.
+ */
+static inline size_t fmt_ulong_len(unsigned long v)
+{
+    size_t n = 1;
+    while (v >= 10000) {
+        v /= 10000;
+        n += 4;
+    }
+    if (v >= 1000) return n + 3;
+    if (v >= 100) return n + 2;
+    if (v >= 10) return n + 1;
+    return n;
+}
+
+/**
+ * Writes \a v in decimal to \a out, which must have room
+ * for fmt_ulong_len(v) characters. No terminator is written.
+ *
+ * @returns The number of characters written.
+ */
+static inline size_t fmt_ulong(char * out, unsigned long v)
+{
+    size_t len = fmt_ulong_len(v);
+    char * p = out + len;
+
+    while (v >= 100) {
+        unsigned long i = (v % 100) * 2;
+        v /= 100;
+        *--p = fmt_digit_pairs[i + 1];
+        *--p = fmt_digit_pairs[i];
+    }
+    if (v >= 10) {
+        *--p = fmt_digit_pairs[v * 2 + 1];
+        *--p = fmt_digit_pairs[v * 2];
+    } else {
+        *--p = (char)('0' + v);
+    }
+
+    return len;
+}
+
+#endif//_FMT_H_DEF
@@ -1,838 +1,804 @@
-
-/* vim: set et ts=3 sw=3 ft=c:
- *
- * Copyright (C) 2012 James McLaughlin et al.  All rights reserved.
- * https://github.com/udp/json-parser
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- *
- * 1. Redistributions of source code must retain the above copyright
- *   notice, this list of conditions and the following disclaimer.
- *
- * 2. Redistributions in binary form must reproduce the above copyright
- *   notice, this list of conditions and the following disclaimer in the
- *   documentation and/or other materials provided with the distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- */
-
-#include "json.h"
-
-#ifdef _MSC_VER
-   #ifndef _CRT_SECURE_NO_WARNINGS
-      #define _CRT_SECURE_NO_WARNINGS
-   #endif
-#endif
-
-#ifdef __cplusplus
-   const struct _json_value json_value_none; /* zero-d by ctor */
-#else
-   const struct _json_value json_value_none = { 0, 0, {0}, {0} };
-#endif
-
+#include <stdint.h>
 #include <stdlib.h>
-#include <stdio.h>
 #include <string.h>
-#include <ctype.h>
-#include <math.h>
-
-typedef unsigned short json_uchar;
-
-static unsigned char hex_value (json_char c)
-{
-   if (c >= 'A' && c <= 'F')
-      return (c - 'A') + 10;
-
-   if (c >= 'a' && c <= 'f')
-      return (c - 'a') + 10;
 
-   if (c >= '0' && c <= '9')
-      return c - '0';
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-   return 0xFF;
+#include "mem/halloc.h"
+#include "err.h"
+#include "json.h"
+#include "json_doc.h"
+#include "number.h"
+
+/* Strings */
+
+static inline long json_hex4(const char * p, const char * pe) {
+    long cp = 0;
+    int i = 0;
+
+    if (pe - p < 4)
+        return -1;
+
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        cp <<= 4;
+        if (c >= '0' && c <= '9')
+            cp |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            cp |= c - 'A' + 10;
+        else
+            return -1;
+    }
+
+    return cp;
 }
 
-typedef struct
-{
-   json_settings settings;
-   int first_pass;
-
-   unsigned long used_memory;
-
-   unsigned int uint_max;
-   unsigned long ulong_max;
-
-} json_state;
-
-static void * json_alloc (json_state * state, unsigned long size, int zero)
-{
-   void * mem;
-
-   if ((state->ulong_max - state->used_memory) < size)
-      return 0;
-
-   if (state->settings.max_memory
-         && (state->used_memory += size) > state->settings.max_memory)
-   {
-      return 0;
-   }
-
-   if (! (mem = zero ? calloc (size, 1) : malloc (size)))
-      return 0;
+/*
+ * Decodes \uXXXX escapes to UTF-8, handling surrogate pairs, and
+ * rejects raw control characters and invalid escapes.
+ */
+long json_unescape(const char * p, const char * pe, char * out) {
+    unsigned char * o = (unsigned char *)out;
+
+    while (p < pe) {
+        if (*p != '\\') {
+            if ((unsigned char)*p < 0x20)
+                return -1;
+            *o++ = *p++;
+            continue;
+        }
+
+        if (++p == pe)
+            return -1;
+
+        long cp = 0;
+        switch (*p++) {
+            case '"':  *o++ = '"';  break;
+            case '\\': *o++ = '\\'; break;
+            case '/':  *o++ = '/';  break;
+            case 'b':  *o++ = '\b'; break;
+            case 'f':  *o++ = '\f'; break;
+            case 'n':  *o++ = '\n'; break;
+            case 'r':  *o++ = '\r'; break;
+            case 't':  *o++ = '\t'; break;
+            case 'u':
+                cp = json_hex4(p, pe);
+                if (cp < 0)
+                    return -1;
+                p += 4;
+
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    // A high surrogate must be followed by a low one
+                    long lo = -1;
+                    if (pe - p >= 6 && p[0] == '\\' && p[1] == 'u')
+                        lo = json_hex4(p + 2, pe);
+                    if (lo < 0xDC00 || lo > 0xDFFF)
+                        return -1;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    return -1;
+                }
+
+                if (cp < 0x80) {
+                    *o++ = cp;
+                } else if (cp < 0x800) {
+                    *o++ = 0xC0 | (cp >> 6);
+                    *o++ = 0x80 | (cp & 0x3F);
+                } else if (cp < 0x10000) {
+                    *o++ = 0xE0 | (cp >> 12);
+                    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *o++ = 0x80 | (cp & 0x3F);
+                } else {
+                    *o++ = 0xF0 | (cp >> 18);
+                    *o++ = 0x80 | ((cp >> 12) & 0x3F);
+                    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *o++ = 0x80 | (cp & 0x3F);
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
 
-   return mem;
+    return (char *)o - out;
 }
 
-static int new_value
-   (json_state * state, json_value ** top, json_value ** root, json_value ** alloc, json_type type)
-{
-   json_value * value;
-   int values_size;
 
-   if (!state->first_pass)
-   {
-      value = *top = *alloc;
-      *alloc = (*alloc)->_reserved.next_alloc;
+static inline int json_needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
 
-      if (!*root)
-         *root = value;
+#if defined(__SSE2__)
+
+size_t json_safe_prefix(const char * p, const char * pe) {
+    const char * start = p;
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+
+    while (pe - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        // Unsigned v <= 0x1F exactly when min(v, 0x1F) == v
+        __m128i bad = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        int mask = _mm_movemask_epi8(bad);
+        if (mask)
+            return p - start + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    while (p < pe && !json_needs_escape(*p))
+        p++;
+
+    return p - start;
+}
 
-      switch (value->type)
-      {
-         case json_array:
+#elif defined(__aarch64__) && defined(__ARM_NEON)
 
-            if (! (value->u.array.values = (json_value **) json_alloc
-               (state, value->u.array.length * sizeof (json_value *), 0)) )
-            {
-               return 0;
-            }
+size_t json_safe_prefix(const char * p, const char * pe) {
+    const char * start = p;
 
-            value->u.array.length = 0;
+    while (pe - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t bad = vorrq_u8(
+                vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))),
+                vcltq_u8(v, vdupq_n_u8(0x20)));
+        if (vmaxvq_u8(bad))
             break;
+        p += 16;
+    }
 
-         case json_object:
-
-            values_size = sizeof (*value->u.object.values) * value->u.object.length;
+    while (p < pe && !json_needs_escape(*p))
+        p++;
 
-            if (! ((*(void **) &value->u.object.values) = json_alloc
-                  (state, values_size + ((unsigned long) value->u.object.values), 0)) )
-            {
-               return 0;
-            }
+    return p - start;
+}
 
-            value->_reserved.object_mem = (*(char **) &value->u.object.values) + values_size;
+#else
 
-            value->u.object.length = 0;
-            break;
+size_t json_safe_prefix(const char * p, const char * pe) {
+    const char * start = p;
 
-         case json_string:
+    while (p < pe && !json_needs_escape(*p))
+        p++;
 
-            if (! (value->u.string.ptr = (json_char *) json_alloc
-               (state, (value->u.string.length + 1) * sizeof (json_char), 0)) )
-            {
-               return 0;
-            }
+    return p - start;
+}
 
-            value->u.string.length = 0;
-            break;
+#endif
 
-         default:
-            break;
-      };
+/* On-demand documents */
 
-      return 1;
-   }
+/*
+ * Deepest nesting of objects and arrays a document can have.
+ */
+#define JSON_DOC_MAX_DEPTH 1024
+
+struct json_doc {
+    const char * data;
+    size_t len;
+    // Positions of the structural characters, quotes and the first
+    // character of every other scalar, in order.
+    uint32_t * index;
+    // For each '{' or '[' in the index, the index of its closer.
+    uint32_t * match;
+    size_t count;
+};
+
+/*
+ * The characters of interest in a 64-byte block, one bit per byte.
+ */
+typedef struct json_block {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t space;
+} json_block_t;
+
+typedef void (*json_classify_fn)(const unsigned char * p, json_block_t * b);
+
+#if !defined(__aarch64__) || !defined(__ARM_NEON)
+static void json_classify_scalar(const unsigned char * p, json_block_t * b) {
+    int i = 0;
+
+    memset(b, 0, sizeof(*b));
+    for (i = 0; i < 64; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (p[i]) {
+            case '"':
+                b->quote |= bit;
+                break;
+            case '\\':
+                b->backslash |= bit;
+                break;
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                b->op |= bit;
+                break;
+            case ' ': case '\t': case '\n': case '\r':
+                b->space |= bit;
+                break;
+            default:
+                break;
+        }
+    }
+}
+#endif
 
-   value = (json_value *) json_alloc (state, sizeof (json_value), 1);
+#if defined(__x86_64__) || defined(__i386__)
+
+#define SSE2_EQ(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+
+__attribute__((target("sse2")))
+static void json_classify_sse2(const unsigned char * p, json_block_t * b) {
+    int i = 0;
+
+    memset(b, 0, sizeof(*b));
+    for (i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i op = _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(SSE2_EQ(v, '{'), SSE2_EQ(v, '}')),
+                             _mm_or_si128(SSE2_EQ(v, '['), SSE2_EQ(v, ']'))),
+                _mm_or_si128(SSE2_EQ(v, ':'), SSE2_EQ(v, ',')));
+        __m128i space = _mm_or_si128(
+                _mm_or_si128(SSE2_EQ(v, ' '), SSE2_EQ(v, '\t')),
+                _mm_or_si128(SSE2_EQ(v, '\n'), SSE2_EQ(v, '\r')));
+
+        int shift = 16 * i;
+        b->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(SSE2_EQ(v, '"')) << shift;
+        b->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(SSE2_EQ(v, '\\')) << shift;
+        b->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << shift;
+        b->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << shift;
+    }
+}
 
-   if (!value)
-      return 0;
+#define AVX2_EQ(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+
+__attribute__((target("avx2")))
+static void json_classify_avx2(const unsigned char * p, json_block_t * b) {
+    int i = 0;
+
+    memset(b, 0, sizeof(*b));
+    for (i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+        __m256i op = _mm256_or_si256(
+                _mm256_or_si256(_mm256_or_si256(AVX2_EQ(v, '{'), AVX2_EQ(v, '}')),
+                                _mm256_or_si256(AVX2_EQ(v, '['), AVX2_EQ(v, ']'))),
+                _mm256_or_si256(AVX2_EQ(v, ':'), AVX2_EQ(v, ',')));
+        __m256i space = _mm256_or_si256(
+                _mm256_or_si256(AVX2_EQ(v, ' '), AVX2_EQ(v, '\t')),
+                _mm256_or_si256(AVX2_EQ(v, '\n'), AVX2_EQ(v, '\r')));
+
+        int shift = 32 * i;
+        b->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(AVX2_EQ(v, '"')) << shift;
+        b->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(AVX2_EQ(v, '\\')) << shift;
+        b->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << shift;
+        b->space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << shift;
+    }
+}
 
-   if (!*root)
-      *root = value;
+static json_classify_fn json_classifier(void) {
+    static json_classify_fn fn = NULL;
+
+    // Racing threads all pick the same function, so this is safe
+    if (!fn) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = json_classify_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            fn = json_classify_sse2;
+        else
+            fn = json_classify_scalar;
+    }
+
+    return fn;
+}
 
-   value->type = type;
-   value->parent = *top;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
 
-   if (*alloc)
-      (*alloc)->_reserved.next_alloc = value;
+/*
+ * Packs the high bits of four comparison results into a 64-bit mask.
+ */
+static inline uint64_t neon_mask(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d) {
+    const uint8x16_t bits = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
 
-   *alloc = *top = value;
+    uint8x16_t ab = vpaddq_u8(vandq_u8(a, bits), vandq_u8(b, bits));
+    uint8x16_t cd = vpaddq_u8(vandq_u8(c, bits), vandq_u8(d, bits));
+    uint8x16_t sum = vpaddq_u8(ab, cd);
+    sum = vpaddq_u8(sum, sum);
 
-   return 1;
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
 }
 
-#define e_off \
-   ((int) (i - cur_line_begin))
-
-#define whitespace \
-   case '\n': ++ cur_line;  cur_line_begin = i; \
-   case ' ': case '\t': case '\r'
-
-#define string_add(b)  \
-   do { if (!state.first_pass) string [string_length] = b;  ++ string_length; } while (0);
-
-const static long
-   flag_next = 1,  flag_reproc = 2,  flag_need_comma = 4,  flag_seek_value = 8, 
-   flag_escaped = 16,  flag_string = 32,  flag_need_colon = 64,  flag_done = 128,
-   flag_num_negative = 256,  flag_num_zero = 512,  flag_num_e = 1024,  
-   flag_num_e_got_sign = 2048,  flag_num_e_negative = 4096;
-
-json_value * json_parse_ex (json_settings * settings, const json_char * json, char * error_buf)
-{
-   json_char error [128];
-   unsigned int cur_line;
-   const json_char * cur_line_begin, * i;
-   json_value * top, * root, * alloc = 0;
-   json_state state;
-   long flags;
-   long num_digits, num_fraction, num_e;
-
-   error[0] = '\0';
-
-   memset (&state, 0, sizeof (json_state));
-   memcpy (&state.settings, settings, sizeof (json_settings));
-
-   memset (&state.uint_max, 0xFF, sizeof (state.uint_max));
-   memset (&state.ulong_max, 0xFF, sizeof (state.ulong_max));
-
-   state.uint_max -= 8; /* limit of how much can be added before next check */
-   state.ulong_max -= 8;
-
-   for (state.first_pass = 1; state.first_pass >= 0; -- state.first_pass)
-   {
-      json_uchar uchar;
-      unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
-      json_char * string;
-      unsigned int string_length;
-
-      top = root = 0;
-      flags = flag_seek_value;
-
-      cur_line = 1;
-      cur_line_begin = json;
-
-      for (i = json ;; ++ i)
-      {
-         json_char b = *i;
-
-         if (flags & flag_done)
-         {
-            if (!b)
-               break;
-
-            switch (b)
-            {
-               whitespace:
-                  continue;
-
-               default:
-                  sprintf (error, "%d:%d: Trailing garbage: `%c`", cur_line, e_off, b);
-                  goto e_failed;
-            };
-         }
-
-         if (flags & flag_string)
-         {
-            if (!b)
-            {  sprintf (error, "Unexpected EOF in string (at %d:%d)", cur_line, e_off);
-               goto e_failed;
-            }
-
-            if (string_length > state.uint_max)
-               goto e_overflow;
-
-            if (flags & flag_escaped)
-            {
-               flags &= ~ flag_escaped;
-
-               switch (b)
-               {
-                  case 'b':  string_add ('\b');  break;
-                  case 'f':  string_add ('\f');  break;
-                  case 'n':  string_add ('\n');  break;
-                  case 'r':  string_add ('\r');  break;
-                  case 't':  string_add ('\t');  break;
-                  case 'u':
-
-                    if ((uc_b1 = hex_value (*++ i)) == 0xFF || (uc_b2 = hex_value (*++ i)) == 0xFF
-                          || (uc_b3 = hex_value (*++ i)) == 0xFF || (uc_b4 = hex_value (*++ i)) == 0xFF)
-                    {
-                        sprintf (error, "Invalid character value `%c` (at %d:%d)", b, cur_line, e_off);
-                        goto e_failed;
-                    }
-
-                    uc_b1 = uc_b1 * 16 + uc_b2;
-                    uc_b2 = uc_b3 * 16 + uc_b4;
-
-                    uchar = ((json_char) uc_b1) * 256 + uc_b2;
-
-                    if (sizeof (json_char) >= sizeof (json_uchar) || (uc_b1 == 0 && uc_b2 <= 0x7F))
-                    {
-                       string_add ((json_char) uchar);
-                       break;
-                    }
-
-                    if (uchar <= 0x7FF)
-                    {
-                        if (state.first_pass)
-                           string_length += 2;
-                        else
-                        {  string [string_length ++] = 0xC0 | ((uc_b2 & 0xC0) >> 6) | ((uc_b1 & 0x7) << 2);
-                           string [string_length ++] = 0x80 | (uc_b2 & 0x3F);
-                        }
-
-                        break;
-                    }
-
-                    if (state.first_pass)
-                       string_length += 3;
-                    else
-                    {  string [string_length ++] = 0xE0 | ((uc_b1 & 0xF0) >> 4);
-                       string [string_length ++] = 0x80 | ((uc_b1 & 0xF) << 2) | ((uc_b2 & 0xC0) >> 6);
-                       string [string_length ++] = 0x80 | (uc_b2 & 0x3F);
-                    }
-
-                    break;
-
-                  default:
-                     string_add (b);
-               };
-
-               continue;
-            }
-
-            if (b == '\\')
-            {
-               flags |= flag_escaped;
-               continue;
-            }
-
-            if (b == '"')
-            {
-               if (!state.first_pass)
-                  string [string_length] = 0;
-
-               flags &= ~ flag_string;
-               string = 0;
-
-               switch (top->type)
-               {
-                  case json_string:
-
-                     top->u.string.length = string_length;
-                     flags |= flag_next;
-
-                     break;
-
-                  case json_object:
-
-                     if (state.first_pass)
-                        (*(json_char **) &top->u.object.values) += string_length + 1;
-                     else
-                     {  
-                        top->u.object.values [top->u.object.length].name
-                           = (json_char *) top->_reserved.object_mem;
-
-                        (*(json_char **) &top->_reserved.object_mem) += string_length + 1;
-                     }
-
-                     flags |= flag_seek_value | flag_need_colon;
-                     continue;
-
-                  default:
-                     break;
-               };
-            }
-            else
-            {
-               string_add (b);
-               continue;
-            }
-         }
+#define NEON_EQ(v, c) vceqq_u8((v), vdupq_n_u8(c))
+
+static void json_classify_neon(const unsigned char * p, json_block_t * b) {
+    uint8x16_t quote[4], backslash[4], op[4], space[4];
+    int i = 0;
+
+    for (i = 0; i < 4; i++) {
+        uint8x16_t v = vld1q_u8(p + 16 * i);
+        quote[i] = NEON_EQ(v, '"');
+        backslash[i] = NEON_EQ(v, '\\');
+        op[i] = vorrq_u8(
+                vorrq_u8(vorrq_u8(NEON_EQ(v, '{'), NEON_EQ(v, '}')),
+                         vorrq_u8(NEON_EQ(v, '['), NEON_EQ(v, ']'))),
+                vorrq_u8(NEON_EQ(v, ':'), NEON_EQ(v, ',')));
+        space[i] = vorrq_u8(
+                vorrq_u8(NEON_EQ(v, ' '), NEON_EQ(v, '\t')),
+                vorrq_u8(NEON_EQ(v, '\n'), NEON_EQ(v, '\r')));
+    }
+
+    b->quote = neon_mask(quote[0], quote[1], quote[2], quote[3]);
+    b->backslash = neon_mask(backslash[0], backslash[1], backslash[2], backslash[3]);
+    b->op = neon_mask(op[0], op[1], op[2], op[3]);
+    b->space = neon_mask(space[0], space[1], space[2], space[3]);
+}
 
-         if (flags & flag_seek_value)
-         {
-            switch (b)
-            {
-               whitespace:
-                  continue;
+static json_classify_fn json_classifier(void) {
+    return json_classify_neon;
+}
 
-               case ']':
+#else
 
-                  if (top->type == json_array)
-                     flags = (flags & ~ (flag_need_comma | flag_seek_value)) | flag_next;
-                  else if (!state.settings.settings & json_relaxed_commas)
-                  {  sprintf (error, "%d:%d: Unexpected ]", cur_line, e_off);
-                     goto e_failed;
-                  }
+static json_classify_fn json_classifier(void) {
+    return json_classify_scalar;
+}
 
-                  break;
+#endif
 
-               default:
+/*
+ * Finds the characters escaped by a backslash. Runs of backslashes
+ * escape each other in pairs, and \a carry holds whether the first
+ * character of the next block is escaped.
+ */
+static inline uint64_t json_find_escaped(uint64_t backslash, uint64_t * carry) {
+    uint64_t escaped = *carry;
 
-                  if (flags & flag_need_comma)
-                  {
-                     if (b == ',')
-                     {  flags &= ~ flag_need_comma;
-                        continue;
-                     }
-                     else
-                     {  sprintf (error, "%d:%d: Expected , before %c", cur_line, e_off, b);
-                        goto e_failed;
-                     }
-                  }
+    backslash &= ~escaped;
+    *carry = 0;
 
-                  if (flags & flag_need_colon)
-                  {
-                     if (b == ':')
-                     {  flags &= ~ flag_need_colon;
-                        continue;
-                     }
-                     else
-                     {  sprintf (error, "%d:%d: Expected : before %c", cur_line, e_off, b);
-                        goto e_failed;
-                     }
-                  }
+    while (backslash) {
+        int i = __builtin_ctzll(backslash);
+        if (i == 63) {
+            *carry = 1;
+            break;
+        }
+        escaped |= 2ULL << i;
+        backslash &= ~(3ULL << i);
+    }
 
-                  flags &= ~ flag_seek_value;
+    return escaped;
+}
 
-                  switch (b)
-                  {
-                     case '{':
+/*
+ * Sets every bit from each set bit up to, but not including, the
+ * next set bit. Applied to the quotes, this gives the bytes that are
+ * inside strings, counting the opening quote.
+ */
+static inline uint64_t json_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
 
-                        if (!new_value (&state, &top, &root, &alloc, json_object))
-                           goto e_alloc_failure;
+/*
+ * Finds the positions of everything the document needs in [data,
+ * data + len): structural characters outside strings, every
+ * unescaped quote, and the start of every other scalar.
+ *
+ * \a index must have room for len + 1 entries.
+ *
+ * Returns the number of positions found, or -1 if a string is
+ * left open.
+ */
+static long json_find_structurals(const char * data, size_t len, uint32_t * index) {
+    json_classify_fn classify = json_classifier();
+    uint64_t escape_carry = 0;
+    uint64_t in_string_carry = 0;
+    uint64_t scalar_carry = 0;
+    unsigned char tail[64];
+    size_t count = 0;
+    size_t base = 0;
+
+    for (base = 0; base < len; base += 64) {
+        const unsigned char * block = (const unsigned char *)data + base;
+        json_block_t b;
+
+        if (len - base < 64) {
+            // Pad the last block with whitespace, which changes nothing
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, len - base);
+            block = tail;
+        }
+
+        classify(block, &b);
+
+        uint64_t quote = b.quote & ~json_find_escaped(b.backslash, &escape_carry);
+        uint64_t in_string = json_prefix_xor(quote) ^ in_string_carry;
+        in_string_carry = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t scalar = ~(b.op | b.space | quote | in_string);
+        uint64_t scalar_start = scalar & ~((scalar << 1) | scalar_carry);
+        scalar_carry = scalar >> 63;
+
+        uint64_t bits = (b.op & ~in_string) | quote | scalar_start;
+        while (bits) {
+            index[count++] = base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    }
+
+    return in_string_carry ? -1 : (long)count;
+}
 
-                        continue;
+enum {
+    JSON_EXPECT_VALUE,
+    JSON_EXPECT_VALUE_OR_CLOSE,
+    JSON_EXPECT_KEY,
+    JSON_EXPECT_KEY_OR_CLOSE,
+    JSON_EXPECT_COLON,
+    JSON_EXPECT_COMMA_OR_CLOSE,
+};
+
+/*
+ * Checks that the structurals fit together as JSON and records where
+ * each object and array ends.
+ */
+static int json_link(m2_json_doc_t * doc) {
+    uint32_t stack[JSON_DOC_MAX_DEPTH];
+    int depth = 0;
+    int state = JSON_EXPECT_VALUE;
+    size_t i = 0;
+
+    for (i = 0; i < doc->count; i++) {
+        char c = doc->data[doc->index[i]];
+        char close = depth ? doc->data[doc->index[stack[depth - 1]]] + 2 : 0;
+
+        // '{' + 2 is '}' and '[' + 2 is ']'
+        if (c == close && (state == JSON_EXPECT_VALUE_OR_CLOSE
+                    || state == JSON_EXPECT_KEY_OR_CLOSE
+                    || state == JSON_EXPECT_COMMA_OR_CLOSE)) {
+            doc->match[stack[--depth]] = i;
+            state = JSON_EXPECT_COMMA_OR_CLOSE;
+            continue;
+        }
+
+        switch (state) {
+            case JSON_EXPECT_VALUE:
+            case JSON_EXPECT_VALUE_OR_CLOSE:
+                if (c == '{' || c == '[') {
+                    check(depth < JSON_DOC_MAX_DEPTH, "JSON is nested too deeply");
+                    stack[depth++] = i;
+                    state = c == '{' ? JSON_EXPECT_KEY_OR_CLOSE : JSON_EXPECT_VALUE_OR_CLOSE;
+                    continue;
+                }
+                check(c != '}' && c != ']' && c != ':' && c != ',', "Expected a JSON value");
+                // Skip the closing quote of a string
+                if (c == '"')
+                    i++;
+                break;
+            case JSON_EXPECT_KEY:
+            case JSON_EXPECT_KEY_OR_CLOSE:
+                check(c == '"', "Expected a key string");
+                i++;
+                state = JSON_EXPECT_COLON;
+                continue;
+            case JSON_EXPECT_COLON:
+                check(c == ':', "Expected ':' after key");
+                state = JSON_EXPECT_VALUE;
+                continue;
+            case JSON_EXPECT_COMMA_OR_CLOSE:
+                check(depth && c == ',', "Expected ',' or end of container");
+                state = close == '}' ? JSON_EXPECT_KEY : JSON_EXPECT_VALUE;
+                continue;
+        }
+
+        state = JSON_EXPECT_COMMA_OR_CLOSE;
+    }
+
+    check(depth == 0 && state == JSON_EXPECT_COMMA_OR_CLOSE, "Unexpected end of JSON");
+
+    return 1;
+
+error:
+    return 0;
+}
 
-                     case '[':
+m2_json_doc_t * m2_json_doc(const char * data, size_t len) {
+    m2_json_doc_t * doc = NULL;
 
-                        if (!new_value (&state, &top, &root, &alloc, json_array))
-                           goto e_alloc_failure;
-
-                        flags |= flag_seek_value;
-                        continue;
-
-                     case '"':
-
-                        if (!new_value (&state, &top, &root, &alloc, json_string))
-                           goto e_alloc_failure;
-
-                        flags |= flag_string;
-
-                        string = top->u.string.ptr;
-                        string_length = 0;
-
-                        continue;
-
-                     case 't':
-
-                        if (*(++ i) != 'r' || *(++ i) != 'u' || *(++ i) != 'e')
-                           goto e_unknown_value;
-
-                        if (!new_value (&state, &top, &root, &alloc, json_boolean))
-                           goto e_alloc_failure;
-
-                        top->u.boolean = 1;
-
-                        flags |= flag_next;
-                        break;
-
-                     case 'f':
-
-                        if (*(++ i) != 'a' || *(++ i) != 'l' || *(++ i) != 's' || *(++ i) != 'e')
-                           goto e_unknown_value;
-
-                        if (!new_value (&state, &top, &root, &alloc, json_boolean))
-                           goto e_alloc_failure;
+    check(data, "Data cannot be NULL");
+    check(len < UINT32_MAX, "JSON document is too large");
 
-                        flags |= flag_next;
-                        break;
+    doc = h_malloc(sizeof(*doc));
+    check_mem(doc);
 
-                     case 'n':
+    doc->data = data;
+    doc->len = len;
 
-                        if (*(++ i) != 'u' || *(++ i) != 'l' || *(++ i) != 'l')
-                           goto e_unknown_value;
+    // Every byte could be structural until the index is built,
+    // then it is cut down to what was found
+    doc->index = h_malloc((len + 1) * sizeof(uint32_t));
+    check_mem(doc->index);
+    hattach(doc->index, doc);
 
-                        if (!new_value (&state, &top, &root, &alloc, json_null))
-                           goto e_alloc_failure;
+    long count = json_find_structurals(data, len, doc->index);
+    check(count >= 0, "Unterminated JSON string");
+    doc->count = count;
 
-                        flags |= flag_next;
-                        break;
+    uint32_t * index = h_realloc(doc->index, (count + 1) * sizeof(uint32_t));
+    if (index) doc->index = index;
 
-                     default:
+    doc->match = h_malloc((count + 1) * sizeof(uint32_t));
+    check_mem(doc->match);
+    hattach(doc->match, doc);
 
-                        if (isdigit (b) || b == '-')
-                        {
-                           if (!new_value (&state, &top, &root, &alloc, json_integer))
-                              goto e_alloc_failure;
+    check(json_link(doc), "Invalid JSON document");
 
-                           if (!state.first_pass)
-                           {
-                              while (isdigit (b) || b == '+' || b == '-'
-                                        || b == 'e' || b == 'E' || b == '.')
-                              {
-                                 b = *++ i;
-                              }
-
-                              flags |= flag_next | flag_reproc;
-                              break;
-                           }
+    return doc;
 
-                           flags &= ~ (flag_num_negative | flag_num_e |
-                                        flag_num_e_got_sign | flag_num_e_negative |
-                                           flag_num_zero);
+error:
+    if (doc) h_free(doc);
+    return NULL;
+}
 
-                           num_digits = 0;
-                           num_fraction = 0;
-                           num_e = 0;
+void m2_json_doc_destroy(m2_json_doc_t * doc) {
+    if (doc) h_free(doc);
+}
 
-                           if (b != '-')
-                           {
-                              flags |= flag_reproc;
-                              break;
-                           }
+m2_json_value_t m2_json_doc_root(const m2_json_doc_t * doc) {
+    m2_json_value_t val = { doc, 0 };
+    return val;
+}
 
-                           flags |= flag_num_negative;
-                           continue;
-                        }
-                        else
-                        {  sprintf (error, "%d:%d: Unexpected %c when seeking value", cur_line, e_off, b);
-                           goto e_failed;
-                        }
-                  };
-            };
-         }
-         else
-         {
-            switch (top->type)
-            {
-            case json_object:
-               
-               switch (b)
-               {
-                  whitespace:
-                     continue;
-
-                  case '"':
-
-                     if (flags & flag_need_comma && (!state.settings.settings & json_relaxed_commas))
-                     {
-                        sprintf (error, "%d:%d: Expected , before \"", cur_line, e_off);
-                        goto e_failed;
-                     }
-
-                     flags |= flag_string;
-
-                     string = (json_char *) top->_reserved.object_mem;
-                     string_length = 0;
-
-                     break;
-                  
-                  case '}':
-
-                     flags = (flags & ~ flag_need_comma) | flag_next;
-                     break;
-
-                  case ',':
-
-                     if (flags & flag_need_comma)
-                     {
-                        flags &= ~ flag_need_comma;
-                        break;
-                     }
-
-                  default:
-
-                     sprintf (error, "%d:%d: Unexpected `%c` in object", cur_line, e_off, b);
-                     goto e_failed;
-               };
-
-               break;
-
-            case json_integer:
-            case json_double:
-
-               if (isdigit (b))
-               {
-                  ++ num_digits;
-
-                  if (top->type == json_integer || flags & flag_num_e)
-                  {
-                     if (! (flags & flag_num_e))
-                     {
-                        if (flags & flag_num_zero)
-                        {  sprintf (error, "%d:%d: Unexpected `0` before `%c`", cur_line, e_off, b);
-                           goto e_failed;
-                        }
-
-                        if (num_digits == 1 && b == '0')
-                           flags |= flag_num_zero;
-                     }
-                     else
-                     {
-                        flags |= flag_num_e_got_sign;
-                        num_e = (num_e * 10) + (b - '0');
-                        continue;
-                     }
-
-                     top->u.integer = (top->u.integer * 10) + (b - '0');
-                     continue;
-                  }
-
-                  num_fraction = (num_fraction * 10) + (b - '0');
-                  continue;
-               }
-
-               if (b == '+' || b == '-')
-               {
-                  if ( (flags & flag_num_e) && !(flags & flag_num_e_got_sign))
-                  {
-                     flags |= flag_num_e_got_sign;
-
-                     if (b == '-')
-                        flags |= flag_num_e_negative;
-
-                     continue;
-                  }
-               }
-               else if (b == '.' && top->type == json_integer)
-               {
-                  if (!num_digits)
-                  {  sprintf (error, "%d:%d: Expected digit before `.`", cur_line, e_off);
-                     goto e_failed;
-                  }
-
-                  top->type = json_double;
-                  top->u.dbl = top->u.integer;
-
-                  num_digits = 0;
-                  continue;
-               }
-
-               if (! (flags & flag_num_e))
-               {
-                  if (top->type == json_double)
-                  {
-                     if (!num_digits)
-                     {  sprintf (error, "%d:%d: Expected digit after `.`", cur_line, e_off);
-                        goto e_failed;
-                     }
-
-                     top->u.dbl += ((double) num_fraction) / (pow (10, (double) num_digits));
-                  }
-
-                  if (b == 'e' || b == 'E')
-                  {
-                     flags |= flag_num_e;
-
-                     if (top->type == json_integer)
-                     {
-                        top->type = json_double;
-                        top->u.dbl = top->u.integer;
-                     }
-
-                     num_digits = 0;
-                     flags &= ~ flag_num_zero;
-
-                     continue;
-                  }
-               }
-               else
-               {
-                  if (!num_digits)
-                  {  sprintf (error, "%d:%d: Expected digit after `e`", cur_line, e_off);
-                     goto e_failed;
-                  }
-
-                  top->u.dbl *= pow (10, (double) (flags & flag_num_e_negative ? - num_e : num_e));
-               }
-
-               if (flags & flag_num_negative)
-               {
-                  if (top->type == json_integer)
-                     top->u.integer = - top->u.integer;
-                  else
-                     top->u.dbl = - top->u.dbl;
-               }
-
-               flags |= flag_next | flag_reproc;
-               break;
+/*
+ * Gets the first character of a value, or 0 if it isn't one.
+ */
+static inline char json_value_char(m2_json_value_t val) {
+    if (!val.doc || val.index >= val.doc->count)
+        return 0;
+    return val.doc->data[val.doc->index[val.index]];
+}
 
-            default:
-               break;
-            };
-         }
+/*
+ * Gets the index of whatever follows the value at \a i.
+ */
+static inline size_t json_value_skip(const m2_json_doc_t * doc, size_t i) {
+    switch (doc->data[doc->index[i]]) {
+        case '{':
+        case '[':
+            return doc->match[i] + 1;
+        case '"':
+            return i + 2;
+        default:
+            return i + 1;
+    }
+}
 
-         if (flags & flag_reproc)
-         {
-            flags &= ~ flag_reproc;
-            -- i;
-         }
+/*
+ * Gets the bytes of the scalar at \a i, without trailing whitespace.
+ */
+static inline const char * json_scalar(const m2_json_doc_t * doc, size_t i, const char ** end) {
+    const char * p = doc->data + doc->index[i];
+    const char * pe = doc->data + (i + 1 < doc->count ? doc->index[i + 1] : doc->len);
 
-         if (flags & flag_next)
-         {
-            flags = (flags & ~ flag_next) | flag_need_comma;
+    while (pe > p && (pe[-1] == ' ' || pe[-1] == '\t' || pe[-1] == '\n' || pe[-1] == '\r'))
+        pe--;
 
-            if (!top->parent)
-            {
-               /* root value done */
+    *end = pe;
+    return p;
+}
 
-               flags |= flag_done;
-               continue;
-            }
+/*
+ * Checks that [p, pe) is exactly one JSON number and scans it
+ * into \a num.
+ */
+static int json_is_number(const char * p, const char * pe, number_t * num) {
+    return number_scan(p, pe, num) == pe && (*num->integer != '0' || num->integer_len == 1);
+}
 
-            if (top->parent->type == json_array)
-               flags |= flag_seek_value;
-               
-            if (!state.first_pass)
-            {
-               json_value * parent = top->parent;
+m2_variant_tag m2_json_type(m2_json_value_t val) {
+    const char * p = NULL;
+    const char * pe = NULL;
+    number_t num;
+
+    switch (json_value_char(val)) {
+        case '{':
+            return m2_type_dict;
+        case '[':
+            return m2_type_list;
+        case '"':
+            return m2_type_string;
+        case 0:
+            return m2_type_invalid;
+        default:
+            break;
+    }
 
-               switch (parent->type)
-               {
-                  case json_object:
+    p = json_scalar(val.doc, val.index, &pe);
 
-                     parent->u.object.values
-                        [parent->u.object.length].value = top;
+    if (pe - p == 4 && memcmp(p, "true", 4) == 0)
+        return m2_type_boolean;
+    if (pe - p == 5 && memcmp(p, "false", 5) == 0)
+        return m2_type_boolean;
+    if (pe - p == 4 && memcmp(p, "null", 4) == 0)
+        return m2_type_null;
+    if (json_is_number(p, pe, &num))
+        return num.is_float ? m2_type_float : m2_type_integer;
 
-                     break;
+    return m2_type_invalid;
+}
 
-                  case json_array:
+/*
+ * Checks whether the key string whose opening quote is at \a i is
+ * \a name, decoding it first if it has escapes.
+ */
+static int json_key_equals(const m2_json_doc_t * doc, size_t i, const_bstring name) {
+    const char * p = doc->data + doc->index[i] + 1;
+    const char * pe = doc->data + doc->index[i + 1];
+    size_t len = pe - p;
+    char buf[256];
+    char * key = buf;
+    int ret = 0;
+
+    if (!memchr(p, '\\', len))
+        return len == (size_t)name->slen && memcmp(p, name->data, len) == 0;
+
+    // Escapes only ever shrink the key
+    if (len < (size_t)name->slen)
+        return 0;
+
+    if (len > sizeof(buf)) {
+        key = h_malloc(len);
+        if (!key)
+            return 0;
+    }
+
+    long n = json_unescape(p, pe, key);
+    ret = n == name->slen && memcmp(key, name->data, n) == 0;
+
+    if (key != buf) h_free(key);
+    return ret;
+}
 
-                     parent->u.array.values
-                           [parent->u.array.length] = top;
+int m2_json_find_field(m2_json_value_t obj, const_bstring name, m2_json_value_t * out) {
+    check(json_value_char(obj) == '{', "Value is not an object");
+    check(name && name->data, "Name cannot be NULL");
 
-                     break;
+    const m2_json_doc_t * doc = obj.doc;
+    size_t end = doc->match[obj.index];
+    size_t i = obj.index + 1;
 
-                  default:
-                     break;
-               };
-            }
+    // Each field is key, closing quote, ':', value, then ',' or '}'
+    while (i < end) {
+        size_t value = i + 3;
 
-            if ( (++ top->parent->u.array.length) > state.uint_max)
-               goto e_overflow;
+        if (json_key_equals(doc, i, name)) {
+            out->doc = doc;
+            out->index = value;
+            return 1;
+        }
 
-            top = top->parent;
+        i = json_value_skip(doc, value) + 1;
+    }
 
-            continue;
-         }
-      }
+    return 0;
 
-      alloc = root;
-   }
+error:
+    return 0;
+}
 
-   return root;
+int m2_json_array_get(m2_json_value_t arr, size_t n, m2_json_value_t * out) {
+    check(json_value_char(arr) == '[', "Value is not an array");
 
-e_unknown_value:
+    const m2_json_doc_t * doc = arr.doc;
+    size_t end = doc->match[arr.index];
+    size_t i = arr.index + 1;
 
-   sprintf (error, "%d:%d: Unknown value", cur_line, e_off);
-   goto e_failed;
+    while (i < end) {
+        if (n-- == 0) {
+            out->doc = doc;
+            out->index = i;
+            return 1;
+        }
+        i = json_value_skip(doc, i) + 1;
+    }
 
-e_alloc_failure:
+    return 0;
 
-   strcpy (error, "Memory allocation failure");
-   goto e_failed;
+error:
+    return 0;
+}
 
-e_overflow:
+int m2_json_get_int(m2_json_value_t val, long * out) {
+    const char * p = NULL;
+    const char * pe = NULL;
+    number_t num;
 
-   sprintf (error, "%d:%d: Too long (caught overflow)", cur_line, e_off);
-   goto e_failed;
+    check(json_value_char(val), "Invalid JSON value");
 
-e_failed:
+    p = json_scalar(val.doc, val.index, &pe);
+    check(json_is_number(p, pe, &num) && !num.is_float, "Value is not an integer");
+    check(number_to_long(&num, out), "Integer is too large");
 
-   if (error_buf)
-   {
-      if (*error)
-         strcpy (error_buf, error);
-      else
-         strcpy (error_buf, "Unknown error");
-   }
+    return 1;
 
-   if (state.first_pass)
-      alloc = root;
+error:
+    return 0;
+}
 
-   while (alloc)
-   {
-      top = alloc->_reserved.next_alloc;
-      free (alloc);
-      alloc = top;
-   }
+int m2_json_get_double(m2_json_value_t val, double * out) {
+    const char * p = NULL;
+    const char * pe = NULL;
+    number_t num;
 
-   if (!state.first_pass)
-      json_value_free (root);
+    check(json_value_char(val), "Invalid JSON value");
 
-   return 0;
-}
+    p = json_scalar(val.doc, val.index, &pe);
+    check(json_is_number(p, pe, &num), "Value is not a number");
 
-json_value * json_parse (const json_char * json)
-{
-   json_settings settings;
-   memset (&settings, 0, sizeof (json_settings));
+    *out = number_to_double(&num);
+    return 1;
 
-   return json_parse_ex (&settings, json, 0);
+error:
+    return 0;
 }
 
-void json_value_free (json_value * value)
-{
-   json_value * cur_value;
+int m2_json_get_bool(m2_json_value_t val, int * out) {
+    const char * p = NULL;
+    const char * pe = NULL;
 
-   if (!value)
-      return;
+    check(json_value_char(val), "Invalid JSON value");
 
-   value->parent = 0;
+    p = json_scalar(val.doc, val.index, &pe);
+    if (pe - p == 4 && memcmp(p, "true", 4) == 0) {
+        *out = 1;
+    } else {
+        check(pe - p == 5 && memcmp(p, "false", 5) == 0, "Value is not a boolean");
+        *out = 0;
+    }
 
-   while (value)
-   {
-      switch (value->type)
-      {
-         case json_array:
+    return 1;
 
-            if (!value->u.array.length)
-            {
-               free (value->u.array.values);
-               break;
-            }
+error:
+    return 0;
+}
 
-            value = value->u.array.values [-- value->u.array.length];
-            continue;
+bstring m2_json_get_string(m2_json_value_t val) {
+    bstring str = NULL;
 
-         case json_object:
+    check(json_value_char(val) == '"', "Value is not a string");
 
-            if (!value->u.object.length)
-            {
-               free (value->u.object.values);
-               break;
-            }
+    const m2_json_doc_t * doc = val.doc;
+    const char * p = doc->data + doc->index[val.index] + 1;
+    const char * pe = doc->data + doc->index[val.index + 1];
 
-            value = value->u.object.values [-- value->u.object.length].value;
-            continue;
+    str = bfromcstralloc(pe - p + 1, "");
+    check_mem(str);
 
-         case json_string:
+    long n = json_unescape(p, pe, (char *)str->data);
+    check(n >= 0, "Invalid JSON string");
 
-            free (value->u.string.ptr);
-            break;
+    str->slen = n;
+    str->data[n] = '\0';
 
-         default:
-            break;
-      };
+    return str;
 
-      cur_value = value;
-      value = value->parent;
-      free (cur_value);
-   }
+error:
+    if (str) bdestroy(str);
+    return NULL;
 }
-
@@ -1,136 +1,60 @@
-
-/* vim: set et ts=3 sw=3 ft=c:
- *
- * Copyright (C) 2012 James McLaughlin et al.  All rights reserved.
- * https://github.com/udp/json-parser
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- *
- * 1. Redistributions of source code must retain the above copyright
- *   notice, this list of conditions and the following disclaimer.
- *
- * 2. Redistributions in binary form must reproduce the above copyright
- *   notice, this list of conditions and the following disclaimer in the
- *   documentation and/or other materials provided with the distribution.
+/**
+ * @file json.h
  *
- * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
+ * Low-level helpers for reading JSON, shared by the variant
+ * parser and the on-demand document API.
  */
+#ifndef _JSON_H_DEF
+#define _JSON_H_DEF
 
-#ifndef _JSON_H
-#define _JSON_H
-
-#ifndef json_char
-   #define json_char char
-#endif
-
-#ifdef __cplusplus
-
-   #include <string.h>
-
-   extern "C"
-   {
-
-#endif
-
-typedef struct
-{
-   unsigned long max_memory;
-   int settings;
-
-} json_settings;
-
-#define json_relaxed_commas 1
-
-typedef enum
-{
-   json_none,
-   json_object,
-   json_array,
-   json_integer,
-   json_double,
-   json_string,
-   json_boolean,
-   json_null
-
-} json_type;
-
-extern const struct _json_value json_value_none;
-
-typedef struct _json_value
-{
-   struct _json_value * parent;
-
-   json_type type;
-
-   union
-   {
-      int boolean;
-      long integer;
-      double dbl;
-
-      struct
-      {
-         unsigned int length;
-         json_char * ptr; /* null terminated */
+#include <stddef.h>
 
-      } string;
+static inline const char * json_skip_ws(const char * p, const char * pe) {
+    while (p < pe && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
 
-      struct
-      {
-         unsigned int length;
-
-         struct
-         {
-            json_char * name;
-            struct _json_value * value;
-
-         } * values;
-
-      } object;
-
-      struct
-      {
-         unsigned int length;
-         struct _json_value ** values;
-
-      } array;
-
-   } u;
-
-   union
-   {
-      struct _json_value * next_alloc;
-      void * object_mem;
-
-   } _reserved;
-
-} json_value;
-
-json_value * json_parse
-   (const json_char * json);
-
-json_value * json_parse_ex
-   (json_settings * settings, const json_char * json, char * error);
-
-void json_value_free (json_value *);
-
-
-#ifdef __cplusplus
-   } /* extern "C" */
-#endif
-
-#endif
+/*
+ * Finds the closing quote of the string whose contents start at \a p.
+ * Sets \a escaped if the string contains escape sequences.
+ *
+ * Returns NULL if the string is unterminated or contains a raw
+ * control character.
+ */
+static inline const char * json_string_end(const char * p, const char * pe, int * escaped) {
+    *escaped = 0;
+
+    while (p < pe) {
+        unsigned char c = *p;
+        if (c == '"') {
+            return p;
+        } else if (c == '\\') {
+            *escaped = 1;
+            p += 2;
+        } else if (c < 0x20) {
+            return NULL;
+        } else {
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Decodes the escaped string contents [p, pe) into \a out, which
+ * needs room for pe - p bytes since decoding never grows a string.
+ *
+ * Returns the decoded length or -1 if the contents are invalid.
+ */
+long json_unescape(const char * p, const char * pe, char * out);
 
+/*
+ * Counts the bytes at the start of [p, pe) that can be written in a
+ * JSON string as they are, stopping at the first one that needs to
+ * be escaped.
+ */
+size_t json_safe_prefix(const char * p, const char * pe);
 
+#endif//_JSON_H_DEF
@@ -0,0 +1,119 @@
+/**
+ * @file json_doc.h
+ *
+ * On-demand access to JSON documents.
+ *
+ * m2_json_doc() makes one pass over the input to find the
+ * structural characters and the bounds of every string, then checks
+ * that brackets, keys and separators fit together. Nothing is
+ * decoded at that point. Values are only decoded when they are read
+ * with the m2_json_get_* functions, so a handler that needs a few
+ * fields from a large body never pays for the rest.
+ *
+ * The document points into the input, which must not change or be
+ * freed until the document has been destroyed.
+ */
+#ifndef _JSON_DOC_H_DEF
+#define _JSON_DOC_H_DEF
+
+#include <stddef.h>
+#include "bstring.h"
+#include "variant.h"
+
+typedef struct json_doc m2_json_doc_t;
+
+/**
+ * A value in a document. Only valid while the document is.
+ */
+typedef struct m2_json_value {
+    const m2_json_doc_t * doc;
+    size_t index;
+} m2_json_value_t;
+
+/**
+ * Indexes the JSON document in the \a len bytes at \a data.
+ *
+ * The input does not need to be NUL-terminated.
+ *
+ * Only the structure is checked here: strings are closed, and
+ * brackets, colons and commas are where they should be. Numbers,
+ * literals and escapes are checked when they are read, so a
+ * malformed one such as `{"a": foo}` gives a document, but
+ * m2_json_type() returns m2_type_invalid for it and the getters
+ * fail.
+ *
+ * @returns The document, or NULL if its structure isn't valid.
+ */
+m2_json_doc_t * m2_json_doc(const char * data, size_t len);
+
+/**
+ * Frees a document.
+ */
+void m2_json_doc_destroy(m2_json_doc_t * doc);
+
+/**
+ * Gets the top-level value of a document.
+ */
+m2_json_value_t m2_json_doc_root(const m2_json_doc_t * doc);
+
+/**
+ * Gets the type of a value. Objects are m2_type_dict and arrays
+ * are m2_type_list. Numbers with a fraction or exponent are
+ * m2_type_float and the rest are m2_type_integer.
+ *
+ * @returns m2_type_invalid if \a val is not a valid value.
+ */
+m2_variant_tag m2_json_type(m2_json_value_t val);
+
+/**
+ * Finds the field \a name in the object \a obj. If the name
+ * appears more than once, the first one is used.
+ *
+ * @param obj       An object value.
+ * @param name      The name of the field.
+ * @param[out] out  Set to the value of the field.
+ *
+ * @returns 0 if \a obj is not an object or has no such field,
+ *          non-zero on success.
+ */
+int m2_json_find_field(m2_json_value_t obj, const_bstring name, m2_json_value_t * out);
+
+/**
+ * Gets the item at index \a i in the array \a arr.
+ *
+ * @returns 0 if \a arr is not an array or is too short,
+ *          non-zero on success.
+ */
+int m2_json_array_get(m2_json_value_t arr, size_t i, m2_json_value_t * out);
+
+/**
+ * Reads an integer value.
+ *
+ * @returns 0 if \a val is not an integer or doesn't fit in a long,
+ *          non-zero on success.
+ */
+int m2_json_get_int(m2_json_value_t val, long * out);
+
+/**
+ * Reads a number value as a double.
+ *
+ * @returns 0 if \a val is not a number, non-zero on success.
+ */
+int m2_json_get_double(m2_json_value_t val, double * out);
+
+/**
+ * Reads a boolean value.
+ *
+ * @returns 0 if \a val is not a boolean, non-zero on success.
+ */
+int m2_json_get_bool(m2_json_value_t val, int * out);
+
+/**
+ * Decodes a string value.
+ *
+ * @returns A new bstring that must be freed with bdestroy(), or
+ *          NULL if \a val is not a valid string.
+ */
+bstring m2_json_get_string(m2_json_value_t val);
+
+#endif//_JSON_DOC_H_DEF
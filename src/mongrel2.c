@@ -1,36 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zmq.h>
 
 #include "adt/hash.h"
 #include "adt/darray.h"
 #include "mem/halloc.h"
 #include "variant.h"
+#include "tns.h"
 #include "err.h"
+#include "fmt.h"
+#include "strhash.h"
 
 #include "mongrel2.h"
 
 /*
  * Static bstrings, to avoid needless allocation
  */
-static const struct tagbstring type_str = bsStatic("type");
 static const struct tagbstring method_str = bsStatic("METHOD");
-static const struct tagbstring disconnect_str = bsStatic("disconnect");
+static const struct tagbstring upload_start_str = bsStatic("x-mongrel2-upload-start");
+static const struct tagbstring upload_done_str = bsStatic("x-mongrel2-upload-done");
+static const struct tagbstring json_method_str = bsStatic("JSON");
+static const struct tagbstring websocket_method_str = bsStatic("WEBSOCKET");
+static const struct tagbstring handshake_method_str = bsStatic("WEBSOCKET_HANDSHAKE");
+static const struct tagbstring disconnect_body_str = bsStatic("{\"type\":\"disconnect\"}");
+static const struct tagbstring content_type_str = bsStatic("Content-Type");
+static const struct tagbstring json_type_str = bsStatic("application/json");
+static const struct tagbstring content_length_str = bsStatic("Content-Length");
 
 
-static int parse_request(m2_request_t * req, void * raw, int len);
-
 typedef struct ctx {
     void * zmq_ctx;
 } ctx_t;
 
+/*
+ * The most conn_ids Mongrel2 accepts in a single message.
+ */
+#define BROADCAST_MAX_IDS 128
+
+/*
+ * The most file data sent in a single message by m2_reply_file().
+ */
+#define FILE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Room for the reply prefix of a request before it needs to be
+ * allocated. Mongrel2 UUIDs are 36 characters, so this is plenty.
+ */
+#define PREFIX_INLINE_SIZE 64
+
+/*
+ * An entry in the header index of a request.
+ *
+ * The name points into the request's raw data, and the value is only
+ * parsed from the raw data when it is first asked for.
+ */
+typedef struct header {
+    struct tagbstring name;
+    /// The caseless hash of the name, which exact matches share too
+    uint32_t hash;
+    /// The whole TNetstring of the value
+    const char * raw;
+    size_t raw_len;
+    variant_t * value;
+} header_t;
+
+/*
+ * A request along with the message it was parsed from.
+ *
+ * The public part of the request points into the message data,
+ * so the message is kept alive until the request is freed.
+ *
+ * The "UUID LEN:CONN_ID, " prefix for replies is formatted once
+ * when the request is parsed.
+ *
+ * Unless the connection wants them parsed eagerly, TNetstring headers
+ * are left in the raw data. The first time a header is asked for, the
+ * names and value locations are indexed in one pass.
+ *
+ * Freed requests go back to their connection's pool and are reused,
+ * along with any storage they have built up.
+ *
+ * Everything parsed from a request comes from its arena, so freeing
+ * it doesn't need to walk the parsed values.
+ */
+typedef struct request {
+    m2_request_t base;
+    zmq_msg_t msg;
+    /// Storage for the uuid, conn_id, path and body strings
+    struct tagbstring strings[4];
+    char * prefix;
+    size_t prefix_len;
+    char prefix_buf[PREFIX_INLINE_SIZE];
+    /// A larger buffer for the prefix, kept between uses
+    char * prefix_heap;
+    size_t prefix_heap_len;
+    /// The headers TNetstring, if it hasn't been parsed
+    const char * headers_tns;
+    size_t headers_tns_len;
+    /// The header index, built on first use and kept between uses
+    header_t * index;
+    int index_len;
+    int index_max;
+    int indexed;
+    /// The body of a JSON message, parsed on first use
+    variant_t * json_body;
+    /// Holds the variants parsed from the request, and is reset
+    /// when it is freed
+    m2_arena_t * arena;
+    /// The next request in the pool
+    struct request * next;
+} request_t;
+
+static int parse_request(request_t * req);
+static int prepare_request(request_t * req);
+
 typedef struct conn {
     void * recv_sock;
     void * send_sock;
     const_bstring uuid;
     const_bstring recv_addr;
     const_bstring send_addr;
+    /// Requests ready to be reused, only used by the connection's thread
+    request_t * pool;
+    /// Requests freed by any thread, moved to the pool when it runs out
+    request_t * returned;
+    /// Whether to parse all of the headers when a request is received
+    int eager_headers;
+    /// Whether to pack lists of numbers in JSON bodies
+    int pack_arrays;
+    /// Buffer reused for the bodies of m2_reply_json()
+    m2_writer_t * json_writer;
 } conn_t;
 
 void * m2_ctx_new() {
+    // Seed the hashes before there is anything to hash
+    strhash_init();
+
     ctx_t * ctx = h_malloc(sizeof(*ctx));
     check_mem(ctx);
     memset(ctx, 0, sizeof(*ctx));
@@ -68,6 +176,7 @@ void * m2_connection_open(void * ctx, const_bstring uuid,
 
     conn = h_malloc(sizeof(*conn));
     check_mem(conn);
+    memset(conn, 0, sizeof(*conn));
     hattach(conn, ctx);
 
     conn->uuid = uuid;
@@ -110,62 +219,394 @@ void m2_connection_close(void * conn) {
     }
 }
 
-#define BUFFER_SIZE 4 * 1024 //4k per request
-m2_request_t * m2_recv(void * conn) {
+/*
+ * Allocates a new request for \a connection.
+ */
+static request_t * request_new(conn_t * connection) {
+
+    request_t * req = h_malloc(sizeof(*req));
+    check_mem(req);
+    memset(req, 0, sizeof(*req));
+    hattach(req, connection);
+
+    req->base.conn = connection;
+
+    req->arena = m2_arena_new(0);
+    check_mem(req->arena);
+    hattach(req->arena, req);
+
+    return req;
+
+error:
+    if (req) h_free(req);
+    return NULL;
+}
+
+/*
+ * Takes a request from the connection's pool, or allocates a new one.
+ */
+static request_t * request_alloc(conn_t * connection) {
 
-    m2_request_t * req = NULL;
-    void * raw = NULL;
+    request_t * req = connection->pool;
+
+    if (!req) {
+        req = __atomic_exchange_n(&connection->returned, NULL, __ATOMIC_ACQUIRE);
+    }
+
+    if (req) {
+        connection->pool = req->next;
+        req->next = NULL;
+        return req;
+    }
+
+    return request_new(connection);
+}
+
+/*
+ * Returns a request, whose message has been closed, to its
+ * connection's pool.
+ *
+ * Requests can be freed from any thread, so they are pushed onto the
+ * returned list atomically. Only the connection's thread takes from
+ * it, and always takes the whole list at once.
+ */
+static void request_release(request_t * req) {
+
+    conn_t * connection = (conn_t *)req->base.conn;
+
+    req->base.headers = NULL;
+    req->base.body = NULL;
+    req->headers_tns = NULL;
+    req->index_len = 0;
+    req->indexed = 0;
+    req->json_body = NULL;
+    m2_arena_reset(req->arena);
+
+    request_t * head = __atomic_load_n(&connection->returned, __ATOMIC_RELAXED);
+    do {
+        req->next = head;
+    } while (!__atomic_compare_exchange_n(&connection->returned, &head, req, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int m2_connection_setopt(void * conn, int option, int value) {
+
+    int i = 0;
 
     check(conn, "Not valid connection");
 
-    req = h_malloc(sizeof(*req));
-    check_mem(req);
-    hattach(req, conn);
+    conn_t * connection = (conn_t *)conn;
 
-    raw = h_malloc(BUFFER_SIZE);
-    check_mem(raw);
-    hattach(raw, req);
+    switch (option) {
+        case M2_REQUEST_POOL:
+            check(value >= 0, "Invalid pool size %d", value);
+            for (i = 0; i < value; i++) {
+                request_t * req = request_new(connection);
+                check(req, "Error allocating request");
 
-    conn_t * connection = (void *)conn;
+                req->next = connection->pool;
+                connection->pool = req;
+            }
+            break;
+        case M2_EAGER_HEADERS:
+            connection->eager_headers = value;
+            break;
+        case M2_PACK_ARRAYS:
+            connection->pack_arrays = value;
+            break;
+        default:
+            check(0, "Unknown option %d", option);
+    }
 
-    req->conn = conn;
+    return 1;
 
-    int msglen = zmq_recv(connection->recv_sock, raw, BUFFER_SIZE, 0);
+error:
+    return 0;
+}
+
+int m2_connection_fd(void * conn) {
+
+    int fd = -1;
+    size_t fd_len = sizeof(fd);
+
+    check(conn, "Not valid connection");
+
+    conn_t * connection = (conn_t *)conn;
+
+    check(zmq_getsockopt(connection->recv_sock, ZMQ_FD, &fd, &fd_len) == 0,
+            "Error getting connection file descriptor");
+
+    return fd;
+
+error:
+    return -1;
+}
+
+int m2_connection_events(void * conn) {
+
+    int events = 0;
+    size_t events_len = sizeof(events);
+
+    check(conn, "Not valid connection");
+
+    conn_t * connection = (conn_t *)conn;
+
+    check(zmq_getsockopt(connection->recv_sock, ZMQ_EVENTS, &events, &events_len) == 0,
+            "Error getting connection events");
+
+    return (events & ZMQ_POLLIN) ? M2_POLLIN : 0;
+
+error:
+    return -1;
+}
+
+/*
+ * Receives a message into a new request, without parsing it.
+ *
+ * Returns 1 if a message was received, 0 if ZMQ_DONTWAIT was passed
+ * and no message was waiting, and -1 on error. \a out is only set when
+ * a message was received.
+ */
+static int recv_message(conn_t * connection, int flags, request_t ** out) {
+
+    request_t * req = NULL;
+    int msg_init = 0;
+
+    req = request_alloc(connection);
+    check(req, "Error allocating request");
+
+    check(zmq_msg_init(&req->msg) == 0, "Error initialising message");
+    msg_init = 1;
+
+    int msglen = zmq_msg_recv(&req->msg, connection->recv_sock, flags);
+    if (msglen < 0 && (flags & ZMQ_DONTWAIT) && zmq_errno() == EAGAIN) {
+        zmq_msg_close(&req->msg);
+        request_release(req);
+        return 0;
+    }
     check(msglen >= 0, "Error recieving request");
 
-    req->raw.len = msglen;
-    req->raw.data = raw;
+    req->base.raw.len = msglen;
+    req->base.raw.data = zmq_msg_data(&req->msg);
 
-    parse_request(req, raw, msglen);
-    if (!req) goto error;
-    return req;
+    *out = req;
+    return 1;
 
 error:
-    if (req) h_free(req);
-    if (raw) h_free(raw);
+    if (msg_init) zmq_msg_close(&req->msg);
+    if (req) request_release(req);
+
+    return -1;
+}
+
+/*
+ * Frees a request that was received but could not be parsed.
+ */
+static void discard_request(request_t * req) {
+    zmq_msg_close(&req->msg);
+    request_release(req);
+}
 
+m2_request_t * m2_recv(void * conn) {
+
+    request_t * req = NULL;
+
+    check(conn, "Not valid connection");
+
+    int rc = recv_message((conn_t *)conn, 0, &req);
+    check(rc > 0, "Error recieving request");
+
+    if (!prepare_request(req)) {
+        discard_request(req);
+        return NULL;
+    }
+
+    return &req->base;
+
+error:
     return NULL;
 }
 
-static int parse_request(m2_request_t * req, void * raw, int msglen) {
+m2_request_t * m2_recv_nonblock(void * conn) {
 
-    unsigned char * data = (unsigned char *)raw;
+    request_t * req = NULL;
+
+    check(conn, "Not valid connection");
+
+    int rc = recv_message((conn_t *)conn, ZMQ_DONTWAIT, &req);
+    check(rc >= 0, "Error recieving request");
+    if (rc == 0) {
+        m2_set_errno(0);
+        return NULL;
+    }
+
+    if (!prepare_request(req)) {
+        discard_request(req);
+        return NULL;
+    }
+
+    return &req->base;
+
+error:
+    return NULL;
+}
+
+int m2_recv_many(void * conn, m2_request_t ** out, int max, int timeout_ms) {
+
+    int count = 0;
+    int parsed = 0;
+    int i = 0;
+
+    check(conn, "Not valid connection");
+    check(out, "Invalid output array");
+    check(max > 0, "max must be greater than 0");
+
+    conn_t * connection = (conn_t *)conn;
+
+    if (timeout_ms >= 0) {
+        zmq_pollitem_t item = { connection->recv_sock, 0, ZMQ_POLLIN, 0 };
+        int rc = zmq_poll(&item, 1, timeout_ms);
+        check(rc >= 0, "Error polling for requests");
+        if (rc == 0)
+            return 0;
+    }
+
+    // Only the first receive can block, and only without a timeout,
+    // the rest just drain whatever has already arrived.
+    while (count < max) {
+        request_t * req = NULL;
+        int flags = (count > 0 || timeout_ms >= 0) ? ZMQ_DONTWAIT : 0;
+        int rc = recv_message(connection, flags, &req);
+        if (rc == 0)
+            break;
+        // Keep the requests already received, the error will come
+        // up again on the next call if it lasts.
+        if (rc < 0 && count > 0)
+            break;
+        check(rc > 0, "Error recieving request");
+
+        out[count++] = &req->base;
+    }
+
+    // Parse the whole batch back-to-back, dropping any malformed
+    // requests.
+    for (i = 0; i < count; i++) {
+        m2_request_t * req = out[i];
+        if (prepare_request((request_t *)req)) {
+            out[parsed++] = req;
+        } else {
+            discard_request((request_t *)req);
+        }
+    }
+
+    return parsed;
+
+error:
+    for (i = 0; i < count; i++) {
+        discard_request((request_t *)out[i]);
+    }
+
+    return -1;
+}
+
+/*
+ * Finds the method and upload headers without parsing the headers,
+ * by stepping over the names in the raw TNetstring.
+ */
+static void scan_message_headers(const request_t * r, struct tagbstring * method,
+        int * upload_start, int * upload_done) {
+
+    const char * p = NULL;
+    size_t len = 0;
+    char tag = 0;
+
+    if (!tns_next(r->headers_tns, r->headers_tns + r->headers_tns_len, &p, &len, &tag))
+        return;
+
+    const char * pe = p + len;
+
+    while (p < pe) {
+        const char * name = NULL;
+        size_t name_len = 0;
+        const char * value = NULL;
+
+        p = tns_next(p, pe, &name, &name_len, &tag);
+        if (p) p = tns_next(p, pe, &value, &len, &tag);
+        if (!p) return;
+
+        if (name_len == (size_t)method_str.slen && memcmp(name, method_str.data, name_len) == 0) {
+            if (tag == m2_type_string)
+                blk2tbstr(*method, value, len);
+        } else if (name_len == (size_t)upload_start_str.slen
+                && memcmp(name, upload_start_str.data, name_len) == 0) {
+            *upload_start = 1;
+        } else if (name_len == (size_t)upload_done_str.slen
+                && memcmp(name, upload_done_str.data, name_len) == 0) {
+            *upload_done = 1;
+        }
+    }
+}
+
+/*
+ * Works out what kind of message the request is from its method,
+ * upload headers and, for JSON messages, the start of its body.
+ */
+static m2_message_kind classify_message(const request_t * r) {
+    struct tagbstring method = bsStatic("");
+    int upload_start = 0;
+    int upload_done = 0;
+
+    if (r->headers_tns) {
+        scan_message_headers(r, &method, &upload_start, &upload_done);
+    } else {
+        bstring value = m2_variant_get_string(m2_variant_dict_get(r->base.headers, &method_str));
+        if (value)
+            method = *value;
+        upload_start = m2_variant_dict_get(r->base.headers, &upload_start_str) != NULL;
+        upload_done = m2_variant_dict_get(r->base.headers, &upload_done_str) != NULL;
+    }
+
+    if (biseq(&method, &json_method_str) == 1) {
+        // Mongrel2 always writes disconnects the same way
+        const_bstring body = r->base.body;
+        if (body && body->slen >= disconnect_body_str.slen
+                && memcmp(body->data, disconnect_body_str.data, disconnect_body_str.slen) == 0)
+            return M2_MESSAGE_DISCONNECT;
+        return M2_MESSAGE_JSON;
+    }
+
+    if (biseq(&method, &websocket_method_str) == 1)
+        return M2_MESSAGE_WEBSOCKET;
+    if (biseq(&method, &handshake_method_str) == 1)
+        return M2_MESSAGE_WEBSOCKET_HANDSHAKE;
+
+    if (upload_done)
+        return M2_MESSAGE_UPLOAD_DONE;
+    if (upload_start)
+        return M2_MESSAGE_UPLOAD_START;
+
+    return M2_MESSAGE_HTTP;
+}
+
+static int parse_request(request_t * r) {
+
+    m2_request_t * req = &r->base;
+    unsigned char * data = (unsigned char *)req->raw.data;
+    int msglen = req->raw.len;
 
-    struct tagbstring * strings = NULL;
     void * headers = NULL;
-    variant_t * body = NULL;
 
-    bstring uuid, conn_id, path;
-    strings =
-        (struct tagbstring *)h_malloc(sizeof(struct tagbstring)*3);
-    check_mem(strings);
-    hattach(strings, req);
+    bstring uuid, conn_id, path, body;
+
+    check(data && msglen > 0, "Empty request");
 
-    uuid    = strings;
-    conn_id = strings+1;
-    path    = strings+2;
+    uuid    = r->strings;
+    conn_id = r->strings+1;
+    path    = r->strings+2;
+    body    = r->strings+3;
 
-    // Set up the marker pointers
+    // Set up the marker pointers. The message is exactly msglen
+    // bytes, so every read is checked against pe first.
     unsigned char * p = data;
     unsigned char * pe = data+msglen;
 
@@ -173,150 +614,739 @@ static int parse_request(m2_request_t * req, void * raw, int msglen) {
     uuid->slen = 0;
     uuid->mlen = -1;
 
-    while (*(p++) != ' ' && p != pe) {
+    while (p < pe && *p != ' ') {
+        ++p;
         ++uuid->slen;
     }
 
-    check(!(p == data || p == pe), "Pointer madness!");
+    check(p < pe - 1, "Pointer madness!");
 
+    // Replaces the space
     uuid->data[uuid->slen] = '\0';
+    ++p;
 
     conn_id->data = p;
     conn_id->slen = 0;
     conn_id->mlen = -1;
-    while (*(p++) != ' ' && p != pe) {
+
+    while (p < pe && *p != ' ') {
+        ++p;
         ++conn_id->slen;
     }
 
-    check(p < pe, "Pointer madness");
+    check(p < pe - 1, "Pointer madness");
 
     conn_id->data[conn_id->slen] = '\0';
+    ++p;
 
     path->data = p;
     path->slen = 0;
     path->mlen = -1;
 
-    while(*(p++) != ' ' && p != pe) {
+    while (p < pe && *p != ' ') {
+        ++p;
         ++path->slen;
     }
 
-    check(p != pe, "Pointer madness");
+    check(p < pe - 1, "Pointer madness");
 
     path->data[path->slen] = '\0';
-
-    size_t len = (pe - p);
+    ++p;
 
     char * rest;
     char err[1024];
 
-    headers = m2_parse_tns((const char *)p,len,&rest);
-    check(headers, "Error parsing request headers: (%s)", m2_strerror_cpy(err));
-
-    if (m2_variant_type(headers) == m2_type_string) {
-        void * h = headers;
-        headers = m2_parse_json((const char *)m2_variant_get_string(headers)->data);
-        m2_variant_destroy(h);
+    const char * hdata = NULL;
+    size_t hlen = 0;
+    char htag = 0;
+
+    rest = (char *)tns_next((const char *)p, (const char *)pe, &hdata, &hlen, &htag);
+    check(rest, "Error parsing request headers");
+
+    if (htag == m2_type_dict && !((conn_t *)req->conn)->eager_headers) {
+        r->headers_tns = (const char *)p;
+        r->headers_tns_len = rest - (char *)p;
+    } else {
+        if (htag == m2_type_string) {
+            // JSON headers are decoded straight out of the message
+            char * json_end = NULL;
+            headers = m2_parse_json_arena(r->arena, hdata, hlen, &json_end);
+            check(!headers || json_end == hdata + hlen, "Trailing data after JSON headers");
+        } else {
+            headers = m2_parse_tns_arena(r->arena, (const char *)p, rest - (char *)p, NULL);
+        }
+        check(headers, "Error parsing request headers: (%s)", m2_strerror_cpy(err));
     }
 
-    len = ((char *)pe - rest);
+    size_t len = ((char *)pe - rest);
 
     if (len > 0) {
-        body = m2_parse_tns((const char *)rest, len, NULL);
-        check(body, "Error parsing request body: (%s)", m2_strerror_cpy(err));
+        const char * body_data = NULL;
+        size_t blen = 0;
+        char btag = 0;
+
+        check(tns_next(rest, (const char *)pe, &body_data, &blen, &btag) && btag == m2_type_string,
+                "Error parsing request body");
 
-        req->body = m2_variant_get_string(body);
-        h_free(body);
+        // The body is left in the message, and its type marker is
+        // overwritten so it can still be used as a C string.
+        blk2tbstr(*body, body_data, blen);
+        body->data[blen] = '\0';
+
+        req->body = body;
     }
 
     req->conn_id = conn_id;
     req->headers = headers;
     req->path = path;
     req->uuid = uuid;
+    req->kind = classify_message(r);
 
     return 1;
 
 error:
-    if (strings) h_free(strings);
-    if (headers) m2_variant_destroy(headers);
-    if (body) m2_variant_destroy(body);
+    return 0;
+}
+
+static size_t reply_prefix_size(const_bstring uuid, const_bstring conn_id) {
+    return uuid->slen + 1 + fmt_ulong_len(conn_id->slen) + 1 + conn_id->slen + 2;
+}
+
+static size_t write_reply_prefix(char * out, const_bstring uuid, const_bstring conn_id) {
+    char * p = out;
+
+    memcpy(p, uuid->data, uuid->slen);
+    p += uuid->slen;
+    *p++ = ' ';
+    p += fmt_ulong(p, conn_id->slen);
+    *p++ = ':';
+    memcpy(p, conn_id->data, conn_id->slen);
+    p += conn_id->slen;
+    *p++ = ',';
+    *p++ = ' ';
+
+    return p - out;
+}
+
+static int prepare_request(request_t * req) {
+
+    check(parse_request(req), "Error parsing request");
+
+    req->prefix_len = reply_prefix_size(req->base.uuid, req->base.conn_id);
+    if (req->prefix_len <= sizeof(req->prefix_buf)) {
+        req->prefix = req->prefix_buf;
+    } else {
+        if (req->prefix_len > req->prefix_heap_len) {
+            char * prefix = h_realloc(req->prefix_heap, req->prefix_len);
+            check_mem(prefix);
+            if (!req->prefix_heap) hattach(prefix, req);
 
+            req->prefix_heap = prefix;
+            req->prefix_heap_len = req->prefix_len;
+        }
+        req->prefix = req->prefix_heap;
+    }
+    write_reply_prefix(req->prefix, req->base.uuid, req->base.conn_id);
+
+    return 1;
+
+error:
     return 0;
 }
 
 void m2_request_free(m2_request_t * req) {
 
     if (req) {
-        m2_variant_destroy(req->headers);
-        bdestroy(req->body);
         //bdestroy(req->conn_id);
         //bdestroy(req->path);
         //bdestroy(req->uuid);
 
-        h_free(req);
+        zmq_msg_close(&((request_t *)req)->msg);
+
+        request_release((request_t *)req);
+    }
+}
+
+/*
+ * Indexes the names and values of the unparsed headers in one pass.
+ */
+static int index_headers(request_t * r) {
+
+    const char * p = NULL;
+    size_t len = 0;
+    char tag = 0;
+
+    check(tns_next(r->headers_tns, r->headers_tns + r->headers_tns_len, &p, &len, &tag),
+            "Invalid headers");
+
+    const char * pe = p + len;
+
+    while (p < pe) {
+        const char * name = NULL;
+        size_t name_len = 0;
+        const char * value = NULL;
+
+        const char * next = tns_next(p, pe, &name, &name_len, &tag);
+        check(next && tag == m2_type_string, "Invalid header name");
+
+        p = tns_next(next, pe, &value, &len, &tag);
+        check(p, "Invalid header value");
+
+        if (r->index_len == r->index_max) {
+            int max = r->index_max ? r->index_max * 2 : 32;
+            header_t * index = h_realloc(r->index, max * sizeof(header_t));
+            check_mem(index);
+            if (!r->index) hattach(index, r);
+
+            r->index = index;
+            r->index_max = max;
+        }
+
+        header_t * h = &r->index[r->index_len++];
+        h->name.mlen = -1;
+        h->name.slen = name_len;
+        h->name.data = (unsigned char *)name;
+        h->hash = (uint32_t)strhash_caseless(name, name_len);
+        h->raw = next;
+        h->raw_len = p - next;
+        h->value = NULL;
+    }
+
+    r->indexed = 1;
+
+    return 1;
+
+error:
+    r->index_len = 0;
+    return 0;
+}
+
+/*
+ * Finds the last header called \a name in the index, building the index
+ * first if needed, and parses its value.
+ */
+static variant_t * find_header(request_t * r, const_bstring name, int caseless) {
+
+    int i = 0;
+
+    if (!r->indexed) {
+        check(index_headers(r), "Error indexing headers");
+    }
+
+    uint32_t hash = (uint32_t)strhash_caseless(name->data, name->slen);
+
+    // Later duplicates win, as they would in a dict
+    for (i = r->index_len - 1; i >= 0; i--) {
+        header_t * h = &r->index[i];
+        if (h->hash != hash || h->name.slen != name->slen)
+            continue;
+        if ((caseless ? biseqcaseless(&h->name, name) : biseq(&h->name, name)) == 1) {
+            if (!h->value) {
+                h->value = m2_parse_tns_arena(r->arena, h->raw, h->raw_len, NULL);
+                check(h->value, "Error parsing header");
+            }
+            return h->value;
+        }
     }
+
+    return NULL;
+
+error:
+    return NULL;
 }
 
 variant_t * m2_request_get_header(const m2_request_t * req, const_bstring name) {
-    return m2_variant_dict_get(req->headers, name);
+
+    check(req, "Invalid request");
+    check(name, "Invalid header name");
+
+    if (req->headers || !((request_t *)req)->headers_tns) {
+        return m2_variant_dict_get(req->headers, name);
+    }
+
+    return find_header((request_t *)req, name, 0);
+
+error:
+    return NULL;
+}
+
+variant_t * m2_request_get_header_caseless(const m2_request_t * req, const_bstring name) {
+
+    check(req, "Invalid request");
+    check(name, "Invalid header name");
+
+    if (req->headers || !((request_t *)req)->headers_tns) {
+        return m2_variant_dict_get_caseless(req->headers, name);
+    }
+
+    return find_header((request_t *)req, name, 1);
+
+error:
+    return NULL;
+}
+
+variant_t * m2_request_get_headers(const m2_request_t * req) {
+
+    check(req, "Invalid request");
+
+    request_t * r = (request_t *)req;
+
+    if (!req->headers && r->headers_tns) {
+        r->base.headers = m2_parse_tns_arena(r->arena, r->headers_tns, r->headers_tns_len, NULL);
+        check(req->headers, "Error parsing headers");
+    }
+
+    return req->headers;
+
+error:
+    return NULL;
 }
 
 int m2_request_is_disconnected(const m2_request_t * req) {
-    int ret = 1;
-    if (req) {
-        ret = 0;
-        variant_t * method_v = m2_request_get_header(req, &method_str);
-        bstring method = NULL;
-        if (m2_variant_type(method_v) == m2_type_string) {
-            method = m2_variant_get_string(method_v);
-        }
-        if (method) {
-            if (biseqcstr(method, "JSON")) {
-                variant_t * body = m2_parse_json((char *)req->body->data);
-                variant_t * type = m2_variant_dict_get(body, &type_str);
-                if (type && m2_variant_type(type) == m2_type_string) {
-                    ret = biseq(m2_variant_get_string(type), &disconnect_str);
-                }
-                m2_variant_destroy(body);
-            }
+    return req ? req->kind == M2_MESSAGE_DISCONNECT : 1;
+}
+
+variant_t * m2_request_get_json(const m2_request_t * req) {
+    check(req, "Invalid request");
+
+    request_t * r = (request_t *)req;
+
+    if (!r->json_body && req->body
+            && (req->kind == M2_MESSAGE_JSON || req->kind == M2_MESSAGE_DISCONNECT)) {
+        const char * body = (const char *)req->body->data;
+
+        if (((conn_t *)req->conn)->pack_arrays) {
+            r->json_body = m2_parse_json_packed(r->arena, body, req->body->slen, NULL);
+        } else {
+            r->json_body = m2_parse_json_arena(r->arena, body, req->body->slen, NULL);
         }
+        check(r->json_body, "Error parsing JSON body");
+    }
+
+    return r->json_body;
 
+error:
+    return NULL;
+}
+
+/*
+ * Sends \a frame, which is closed whether it was sent or not.
+ */
+static int send_message(conn_t * connection, zmq_msg_t * frame) {
+
+    int sent = zmq_msg_send(frame, connection->send_sock, 0);
+    if (sent < 0) zmq_msg_close(frame);
+
+    check(sent >= 0, "Error sending message");
+
+    return sent;
+
+error:
+    return -1;
+}
+
+/*
+ * Sends a single reply frame made of \a prefix followed by the
+ * \a n fragments in \a iov.
+ *
+ * Mongrel2 reads each reply as one frame, so the body can't be passed
+ * as separate parts. Instead the fragments are gathered once, straight
+ * into a message of the right size, which 0MQ then sends without
+ * copying it again.
+ */
+static int send_frame(conn_t * connection, const char * prefix, size_t prefix_len,
+        const struct iovec * iov, int n) {
+
+    zmq_msg_t frame;
+    size_t len = prefix_len;
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        len += iov[i].iov_len;
+    }
+
+    check(zmq_msg_init_size(&frame, len) == 0, "Error allocating message");
+
+    char * out = zmq_msg_data(&frame);
+    memcpy(out, prefix, prefix_len);
+    out += prefix_len;
+    for (i = 0; i < n; i++) {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
     }
-    return ret;
+
+    return send_message(connection, &frame);
+
+error:
+    return -1;
+}
+
+/*
+ * Sends \a resp after \a prefix, serializing it straight into
+ * the outgoing message.
+ */
+static int send_response(conn_t * connection, const char * prefix, size_t prefix_len,
+        const m2_response_t * resp) {
+
+    zmq_msg_t frame;
+
+    check(zmq_msg_init_size(&frame, prefix_len + m2_response_size(resp)) == 0,
+            "Error allocating message");
+
+    char * out = zmq_msg_data(&frame);
+    memcpy(out, prefix, prefix_len);
+    m2_response_write(resp, out + prefix_len);
+
+    return send_message(connection, &frame);
+
+error:
+    return -1;
+}
+
+int m2_sendv(void * conn, const_bstring uuid, const_bstring conn_id,
+        const struct iovec * iov, int n) {
+
+    char buf[PREFIX_INLINE_SIZE];
+    char * prefix = buf;
+
+    check(conn, "Invalid connection");
+    check(uuid, "Invalid uuid");
+    check(conn_id, "Invalid connection id");
+    check(iov || n == 0, "Invalid message");
+    check(n >= 0, "Invalid fragment count");
+
+    size_t prefix_len = reply_prefix_size(uuid, conn_id);
+    if (prefix_len > sizeof(buf)) {
+        prefix = h_malloc(prefix_len);
+        check_mem(prefix);
+    }
+    write_reply_prefix(prefix, uuid, conn_id);
+
+    int sent = send_frame((conn_t *)conn, prefix, prefix_len, iov, n);
+
+    if (prefix != buf) h_free(prefix);
+
+    return sent;
+
+error:
+    return -1;
 }
 
 int m2_send(void * conn, const_bstring uuid, const_bstring conn_id, const_bstring msg) {
 
-    bstring header = NULL;
+    check(msg, "Invalid message");
+
+    struct iovec iov = { msg->data, msg->slen };
+
+    return m2_sendv(conn, uuid, conn_id, &iov, 1);
+
+error:
+    return -1;
+}
+
+int m2_replyv(const m2_request_t * req, const struct iovec * iov, int n) {
+    if (req) {
+        const request_t * r = (const request_t *)req;
+
+        check(iov || n == 0, "Invalid message");
+        check(n >= 0, "Invalid fragment count");
+
+        return send_frame((conn_t *)req->conn, r->prefix, r->prefix_len, iov, n);
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+int m2_reply(const m2_request_t * req, const_bstring msg) {
+
+    check(msg, "Invalid message");
+
+    struct iovec iov = { msg->data, msg->slen };
+
+    return m2_replyv(req, &iov, 1);
+
+error:
+    return -1;
+}
+
+int m2_send_response(void * conn, const_bstring uuid, const_bstring conn_id,
+        const m2_response_t * resp) {
+
+    char buf[PREFIX_INLINE_SIZE];
+    char * prefix = buf;
 
     check(conn, "Invalid connection");
     check(uuid, "Invalid uuid");
     check(conn_id, "Invalid connection id");
+    check(resp, "Invalid response");
+
+    size_t prefix_len = reply_prefix_size(uuid, conn_id);
+    if (prefix_len > sizeof(buf)) {
+        prefix = h_malloc(prefix_len);
+        check_mem(prefix);
+    }
+    write_reply_prefix(prefix, uuid, conn_id);
+
+    int sent = send_response((conn_t *)conn, prefix, prefix_len, resp);
+
+    if (prefix != buf) h_free(prefix);
+
+    return sent;
+
+error:
+    return -1;
+}
+
+ssize_t m2_broadcast(void * conn, const_bstring uuid, const long * ids, size_t n,
+        const_bstring msg) {
+
+    size_t start = 0;
+    size_t i = 0;
+    ssize_t total = 0;
+
+    check(conn, "Invalid connection");
+    check(uuid, "Invalid uuid");
+    check(ids || n == 0, "Invalid connection ids");
     check(msg, "Invalid message");
 
     conn_t * connection = (conn_t *)conn;
 
-    header = bformat("%s %d:%s, ", uuid->data, conn_id->slen, conn_id->data);
-    check(header, "Error formatting response header");
+    for (start = 0; start < n; start += BROADCAST_MAX_IDS) {
+        size_t end = start + BROADCAST_MAX_IDS < n ? start + BROADCAST_MAX_IDS : n;
+        zmq_msg_t frame;
 
-    if (msg)
-        bconcat(header, msg);
+        size_t ids_len = end - start - 1;
+        for (i = start; i < end; i++) {
+            check(ids[i] >= 0, "Invalid connection id %ld", ids[i]);
+            ids_len += fmt_ulong_len(ids[i]);
+        }
 
-    int n = zmq_send(connection->send_sock, header->data, header->slen, 0);
-    bdestroy(header);
+        size_t len = uuid->slen + 1 + fmt_ulong_len(ids_len) + 1 + ids_len + 2 + msg->slen;
+        check(zmq_msg_init_size(&frame, len) == 0, "Error allocating message");
+
+        char * p = zmq_msg_data(&frame);
+        memcpy(p, uuid->data, uuid->slen);
+        p += uuid->slen;
+        *p++ = ' ';
+        p += fmt_ulong(p, ids_len);
+        *p++ = ':';
+        for (i = start; i < end; i++) {
+            if (i != start)
+                *p++ = ' ';
+            p += fmt_ulong(p, ids[i]);
+        }
+        *p++ = ',';
+        *p++ = ' ';
+        memcpy(p, msg->data, msg->slen);
 
-    check(n >= 0, "Error sending message");
+        int sent = send_message(connection, &frame);
+        check(sent >= 0, "Error sending broadcast");
 
-    return n;
+        total += sent;
+    }
 
-error:
-    if (header) bdestroy(header);
+    return total;
 
+error:
     return -1;
 }
 
-int m2_reply(const m2_request_t * req, const_bstring msg) {
-    if (req)
-        return m2_send(req->conn, req->uuid, req->conn_id, msg);
+int m2_reply_response(const m2_request_t * req, const m2_response_t * resp) {
+    if (req) {
+        const request_t * r = (const request_t *)req;
+
+        check(resp, "Invalid response");
+
+        return send_response((conn_t *)req->conn, r->prefix, r->prefix_len, resp);
+    }
     return 0;
+
+error:
+    return -1;
+}
+
+int m2_reply_json(const m2_request_t * req, int status, const variant_t * val) {
+    m2_response_t * resp = NULL;
+    int sent = -1;
+
+    check(req, "Invalid request");
+
+    conn_t * connection = (conn_t *)req->conn;
+    const request_t * r = (const request_t *)req;
+
+    if (!connection->json_writer) {
+        connection->json_writer = m2_writer_new(0);
+        check_mem(connection->json_writer);
+        hattach(connection->json_writer, connection);
+    }
+
+    m2_writer_t * w = connection->json_writer;
+    m2_writer_reset(w);
+    check(m2_variant_write_json(val, w), "Error serializing reply");
+
+    size_t len = 0;
+    const char * body = m2_writer_data(w, &len);
+
+    resp = m2_response_new(status);
+    check(resp, "Error creating response");
+    check(m2_response_set_header(resp, &content_type_str, &json_type_str), "Error setting header");
+    check(m2_response_set_body_ref(resp, body, len), "Error setting body");
+
+    sent = send_response(connection, r->prefix, r->prefix_len, resp);
+
+error:
+    m2_response_destroy(resp);
+    return sent;
 }
 
+/*
+ * Frees the mapping behind a file chunk message. The size of the
+ * mapping is stored at its start.
+ */
+static void unmap_file_chunk(void * data, void * hint) {
+    (void)data;
+    munmap(hint, *(size_t *)hint);
+}
+
+/*
+ * Sends \a len bytes of the file \a fd from \a offset, preceded by the
+ * reply prefix and \a head, without copying the file data.
+ *
+ * The file range is mapped privately, directly after enough anonymous
+ * memory to hold the prefix and head, which are then written just in
+ * front of the data. The mapping is handed to 0MQ as the message and
+ * unmapped once 0MQ has sent it.
+ */
+static int send_file_chunk(conn_t * connection, const char * prefix, size_t prefix_len,
+        const char * head, size_t head_len, int fd, off_t offset, size_t len) {
+
+    zmq_msg_t frame;
+    char * region = MAP_FAILED;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    off_t map_off = offset & ~(off_t)(page - 1);
+    size_t gap = offset - map_off;
+    size_t lead = prefix_len + head_len;
+    size_t headroom = (sizeof(size_t) + lead + page - 1) & ~(page - 1);
+    size_t map_len = headroom + gap + len;
+
+    region = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(region != MAP_FAILED, "Error reserving memory for file");
+
+    void * data = mmap(region + headroom, gap + len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, map_off);
+    check(data != MAP_FAILED, "Error mapping file");
+
+    madvise(data, gap + len, MADV_SEQUENTIAL);
+
+    *(size_t *)region = map_len;
+
+    char * start = region + headroom + gap - lead;
+    memcpy(start, prefix, prefix_len);
+    if (head_len)
+        memcpy(start + prefix_len, head, head_len);
+
+    int rc = zmq_msg_init_data(&frame, start, lead + len, unmap_file_chunk, region);
+    check(rc == 0, "Error creating message");
+
+    return send_message(connection, &frame);
+
+error:
+    if (region != MAP_FAILED) munmap(region, map_len);
+
+    return -1;
+}
+
+ssize_t m2_reply_file_response(const m2_request_t * req, m2_response_t * resp,
+        const_bstring path, off_t offset, size_t len) {
+
+    int fd = -1;
+    char * head = NULL;
+    ssize_t total = 0;
+
+    check(req, "Invalid request");
+    check(resp, "Invalid response");
+    check(path, "Invalid path");
+    check(offset >= 0, "Invalid offset");
+
+    const request_t * r = (const request_t *)req;
+    conn_t * connection = (conn_t *)req->conn;
+
+    const char * filename = (const char *)path->data;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    check(fd >= 0, "Error opening `%s'", filename);
+
+    struct stat st;
+    check(fstat(fd, &st) == 0, "Error reading `%s'", filename);
+    check(S_ISREG(st.st_mode), "`%s' is not a regular file", filename);
+    check(offset <= st.st_size, "Offset is past the end of `%s'", filename);
+
+    if (len == 0)
+        len = st.st_size - offset;
+    check(len <= (size_t)(st.st_size - offset), "Range is past the end of `%s'", filename);
+
+    char length_buf[24];
+    struct tagbstring length;
+    btfromblk(length, length_buf, fmt_ulong(length_buf, len));
+    check(m2_response_set_header(resp, &content_length_str, &length), "Error setting Content-Length");
+
+    size_t head_len = m2_response_head_size(resp);
+    head = h_malloc(head_len);
+    check_mem(head);
+    m2_response_write_head(resp, head);
+
+    if (len == 0) {
+        struct iovec iov = { head, head_len };
+        total = send_frame(connection, r->prefix, r->prefix_len, &iov, 1);
+        check(total >= 0, "Error sending file");
+    }
+
+    // The first chunk is cut short so the rest start on a page
+    // boundary and don't need any of the file mapped twice.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t chunk = FILE_CHUNK_SIZE - (offset & (page - 1));
+
+    while (len > 0) {
+        if (chunk > len)
+            chunk = len;
+
+        int sent = send_file_chunk(connection, r->prefix, r->prefix_len,
+                head, head_len, fd, offset, chunk);
+        check(sent >= 0, "Error sending file");
+
+        total += sent;
+        offset += chunk;
+        len -= chunk;
+        head_len = 0;
+        chunk = FILE_CHUNK_SIZE;
+    }
+
+    h_free(head);
+    close(fd);
+
+    return total;
+
+error:
+    if (head) h_free(head);
+    if (fd >= 0) close(fd);
+
+    return -1;
+}
+
+ssize_t m2_reply_file(const m2_request_t * req, const_bstring path, off_t offset, size_t len) {
+
+    m2_response_t * resp = m2_response_new(200);
+    check(resp, "Error creating response");
+
+    ssize_t sent = m2_reply_file_response(req, resp, path, offset, len);
+
+    m2_response_destroy(resp);
+
+    return sent;
+
+error:
+    return -1;
+}
@@ -11,8 +11,13 @@
 #ifndef _MONGREL2_H_DEF
 #define _MONGREL2_H_DEF
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "bstring.h"
 #include "variant.h"
+#include "json_doc.h"
+#include "response.h"
 
 /**
  * Creates a new context for using this library.
@@ -36,8 +41,12 @@ void m2_ctx_destroy(void * ctx);
 /**
  * Opens a new connection to a Mongrel2 instance.
  *
- * Connections are not thread safe and should be opened, used
- * and closed in the same thread.
+ * Connections are not thread safe, and only one thread may use
+ * a connection at a time. A connection can be handed to another
+ * thread if there is a full memory barrier between the last use on
+ * one thread and the first on the other, such as starting or joining
+ * a thread, or a mutex. m2_server_start() opens its connections
+ * this way and hands them to the workers.
  *
  * @param   ctx         A context created with m2_ctx_new()
  * @param   uuid        A unique id to identify this connection.
@@ -64,6 +73,80 @@ void * m2_connection_open(void * ctx, const_bstring uuid,
  */
 void m2_connection_close(void * conn);
 
+/// Connection options, for m2_connection_setopt()
+enum {
+    /// Preallocates this many requests in the connection's pool
+    M2_REQUEST_POOL = 1,
+    /// If non-zero, parses all of the headers into the `headers` field
+    /// of each request as it is received, instead of on demand
+    M2_EAGER_HEADERS = 2,
+    /// If non-zero, m2_request_get_json() reads lists of numbers into
+    /// packed arrays, as m2_parse_json_packed() does
+    M2_PACK_ARRAYS = 3,
+};
+
+/**
+ * Sets an option on the connection.
+ *
+ * Must be called from the thread using the connection.
+ *
+ * @param   conn    An open connection.
+ * @param   option  The option to set.
+ * @param   value   The value for the option.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_connection_setopt(void * conn, int option, int value);
+
+/// A request can be received from the connection without blocking
+#define M2_POLLIN 1
+
+/**
+ * Gets a file descriptor that can be used to wait for requests on
+ * the connection with poll(), epoll or similar.
+ *
+ * The descriptor only signals that the state of the connection may
+ * have changed, it is edge-triggered and should not be read from or
+ * written to. When it becomes readable, check m2_connection_events()
+ * and keep calling m2_recv_nonblock() until it no longer reports
+ * M2_POLLIN.
+ *
+ * @param   conn    An open connection.
+ *
+ * @returns A file descriptor, or -1 on error.
+ */
+int m2_connection_fd(void * conn);
+
+/**
+ * Gets the events currently pending on the connection.
+ *
+ * @param   conn    An open connection.
+ *
+ * @returns M2_POLLIN if a request is waiting, 0 if not
+ *          or -1 on error.
+ */
+int m2_connection_events(void * conn);
+
+/**
+ * The kinds of message Mongrel2 sends to handlers.
+ */
+typedef enum {
+    /// An ordinary HTTP request
+    M2_MESSAGE_HTTP,
+    /// A JSON message, such as one from a Flash socket
+    M2_MESSAGE_JSON,
+    /// The client has disconnected
+    M2_MESSAGE_DISCONNECT,
+    /// A WebSocket frame
+    M2_MESSAGE_WEBSOCKET,
+    /// A request to upgrade to a WebSocket
+    M2_MESSAGE_WEBSOCKET_HANDSHAKE,
+    /// A large upload has started being written to a file
+    M2_MESSAGE_UPLOAD_START,
+    /// A large upload has finished
+    M2_MESSAGE_UPLOAD_DONE,
+} m2_message_kind;
+
 /**
  * Request object
  */
@@ -73,7 +156,8 @@ typedef struct {
     /// The raw data from the request
     struct {
         int len; /// The length of the data
-        void * data; /// A pointer to the data
+        void * data; /// A pointer into the received message, valid until
+                     /// the request is freed
     } raw;
     /// The UUID from the Mongrel2 instance
     bstring uuid;
@@ -81,10 +165,14 @@ typedef struct {
     bstring conn_id;
     /// The path used to match
     bstring path;
-    /// The headers from the request
+    /// The headers from the request. NULL unless the connection has
+    /// M2_EAGER_HEADERS set or m2_request_get_headers() has been called.
     variant_t * headers;
-    /// The body of the request, NULL if there is no body
+    /// The body of the request, NULL if there is no body. Points into
+    /// the received message.
     bstring body;
+    /// What kind of message this is, worked out when it was received
+    m2_message_kind kind;
 } m2_request_t;
 
 /**
@@ -96,18 +184,82 @@ typedef struct {
  */
 m2_request_t * m2_recv(void * conn);
 
+/**
+ * Receives a request from the connection, if one is waiting.
+ *
+ * @param   conn    The connection to receive on.
+ *
+ * @returns A request_t object representing the request, or NULL if
+ *          no request was waiting or on error. m2_errno() is only
+ *          non-zero in the case of an error.
+ */
+m2_request_t * m2_recv_nonblock(void * conn);
+
+/**
+ * Receives a batch of requests from the connection.
+ *
+ * Waits for the first request, then takes any further requests
+ * that are already waiting on the connection, up to \a max. The
+ * batch is parsed once it has been received. Requests that fail to
+ * parse are dropped. If receiving fails partway through, the requests
+ * received before the failure are still returned.
+ *
+ * Each request must be freed with m2_request_free().
+ *
+ * @param   conn        The connection to receive on.
+ * @param   out         An array of at least \a max request pointers
+ *                      to fill.
+ * @param   max         The maximum number of requests to receive.
+ * @param   timeout_ms  How long to wait for the first request, in
+ *                      milliseconds. A negative value waits forever.
+ *
+ * @returns The number of requests placed in \a out, 0 if the timeout
+ *          expired or -1 if no request could be received.
+ */
+int m2_recv_many(void * conn, m2_request_t ** out, int max, int timeout_ms);
+
 /**
  * Frees a request.
  *
+ * The request is returned to its connection's pool to be reused
+ * by a later receive. It can be freed from any thread, but must
+ * be freed before its connection is closed.
+ *
+ * Everything parsed from the request, such as its headers and JSON
+ * body, is freed with it. Use m2_variant_clone() to keep any of it.
+ *
  * @param req   The request to free
  */
 void m2_request_free(m2_request_t * req);
 
+/**
+ * Checks whether the request is Mongrel2 telling the handler that
+ * the client has disconnected.
+ *
+ * Same as checking for M2_MESSAGE_DISCONNECT in \a req->kind.
+ */
 int m2_request_is_disconnected(const m2_request_t * req);
 
+/**
+ * Gets the parsed body of a JSON or disconnect message.
+ *
+ * The body is parsed the first time this is called, and belongs
+ * to the request. Its lists of numbers are packed if the
+ * connection's M2_PACK_ARRAYS option is set.
+ *
+ * @returns The body, or NULL if the request is another kind of
+ *          message or the body isn't valid JSON.
+ */
+variant_t * m2_request_get_json(const m2_request_t * req);
+
 /**
  * Gets the header from the request, \a req by \a name.
  *
+ * Headers are only parsed as they are asked for, unless the connection
+ * has M2_EAGER_HEADERS set. The returned value belongs to the request,
+ * and its strings point into the received message, so are not
+ * NUL-terminated.
+ *
  * @param req       The request
  * @param name      The name of the header
  *
@@ -120,6 +272,29 @@ int m2_request_is_disconnected(const m2_request_t * req);
  */
 variant_t * m2_request_get_header(const m2_request_t * req, const_bstring name);
 
+/**
+ * Gets a header like m2_request_get_header(), but ignores the case of
+ * ASCII letters in \a name, as HTTP does. If more than one header
+ * matches, the last one wins.
+ *
+ * @param req       The request
+ * @param name      The name of the header
+ *
+ * @returns a tnetstring value or NULL on error.
+ */
+variant_t * m2_request_get_header_caseless(const m2_request_t * req, const_bstring name);
+
+/**
+ * Gets all of the headers from the request as a dictionary, parsing
+ * them if they haven't been already. Also sets the `headers` field.
+ *
+ * @param req       The request
+ *
+ * @returns a dictionary variant or NULL on error. It belongs to the
+ *          request.
+ */
+variant_t * m2_request_get_headers(const m2_request_t * req);
+
 /**
  * Sends a reply on the connection using the given values.
  *
@@ -133,6 +308,41 @@ variant_t * m2_request_get_header(const m2_request_t * req, const_bstring name);
  */
 int m2_send(void * conn, const_bstring uuid, const_bstring conn_id, const_bstring msg);
 
+/**
+ * Sends a reply made of several fragments on the connection.
+ *
+ * The fragments are gathered directly into a single message, so
+ * there is no need to concatenate them first.
+ *
+ * @param conn     The connection to send on
+ * @param uuid     The UUID of the sender
+ * @param conn_id  The conn_id of the client. Can also be a list of
+ *                 ids seperated by a space
+ * @param iov      The fragments of the message, in order
+ * @param n        The number of fragments in \a iov
+ *
+ * @returns The number of bytes sent or -1 on error
+ */
+int m2_sendv(void * conn, const_bstring uuid, const_bstring conn_id,
+        const struct iovec * iov, int n);
+
+/**
+ * Sends the same message to many clients.
+ *
+ * The ids are sent in groups of up to 128, the most Mongrel2
+ * accepts in one message, so any number of ids can be given.
+ *
+ * @param conn     The connection to send on
+ * @param uuid     The UUID of the sender
+ * @param ids      The conn_ids of the clients
+ * @param n        The number of ids in \a ids
+ * @param msg      The message to send
+ *
+ * @returns The total number of bytes sent or -1 on error
+ */
+ssize_t m2_broadcast(void * conn, const_bstring uuid, const long * ids, size_t n,
+        const_bstring msg);
+
 /**
  * Replies to the request with the given message.
  *
@@ -143,4 +353,173 @@ int m2_send(void * conn, const_bstring uuid, const_bstring conn_id, const_bstrin
  */
 int m2_reply(const m2_request_t * req, const_bstring msg);
 
+/**
+ * Replies to the request with a message made of several fragments.
+ *
+ * @param req   The request to reply to
+ * @param iov   The fragments of the message, in order
+ * @param n     The number of fragments in \a iov
+ *
+ * @returns The number of bytes sent or -1 on error
+ */
+int m2_replyv(const m2_request_t * req, const struct iovec * iov, int n);
+
+/**
+ * Sends an HTTP response on the connection.
+ *
+ * The response is serialized directly into the message sent to
+ * Mongrel2.
+ *
+ * @param conn     The connection to send on
+ * @param uuid     The UUID of the sender
+ * @param conn_id  The conn_id of the client. Can also be a list of
+ *                 ids seperated by a space
+ * @param resp     The response to send
+ *
+ * @returns The number of bytes sent or -1 on error
+ */
+int m2_send_response(void * conn, const_bstring uuid, const_bstring conn_id,
+        const m2_response_t * resp);
+
+/**
+ * Replies to the request with an HTTP response.
+ *
+ * @param req   The request to reply to
+ * @param resp  The response to send
+ *
+ * @returns The number of bytes sent or -1 on error
+ */
+int m2_reply_response(const m2_request_t * req, const m2_response_t * resp);
+
+/**
+ * Replies to the request with \a val serialized as JSON, in an
+ * HTTP response with an `application/json` content type.
+ *
+ * The body is serialized into a buffer kept by the connection, so
+ * replies don't allocate once it has grown large enough.
+ *
+ * @param req       The request to reply to
+ * @param status    The HTTP status code
+ * @param val       The value to send
+ *
+ * @returns The number of bytes sent or -1 on error
+ */
+int m2_reply_json(const m2_request_t * req, int status, const variant_t * val);
+
+/**
+ * Replies to the request with part of a file, as a 200 response.
+ *
+ * See m2_reply_file_response().
+ */
+ssize_t m2_reply_file(const m2_request_t * req, const_bstring path, off_t offset, size_t len);
+
+/**
+ * Replies to the request with part of a file, using \a resp for
+ * the status and headers.
+ *
+ * The file is mapped into memory and sent in chunks of up to
+ * 1MB, each handed to 0MQ without copying the file data.
+ *
+ * The Content-Length header of \a resp is set to \a len, any
+ * body it has is ignored.
+ *
+ * 0MQ may still be sending the mapped chunks after this returns.
+ * If the file is truncated before it has finished, reading the
+ * missing pages raises SIGBUS in the process. Only send files that
+ * are replaced rather than changed in place, such as by writing a
+ * new file and renaming it over the old one.
+ *
+ * @param req       The request to reply to
+ * @param resp      The status and headers to send
+ * @param path      The path of the file
+ * @param offset    Where to start in the file
+ * @param len       The number of bytes to send. 0 sends the rest of
+ *                  the file from \a offset
+ *
+ * @returns The total number of bytes sent or -1 on error
+ */
+ssize_t m2_reply_file_response(const m2_request_t * req, m2_response_t * resp,
+        const_bstring path, off_t offset, size_t len);
+
+// Server
+
+/**
+ * A pool of worker threads, each receiving and handling requests
+ * on its own connection.
+ */
+typedef struct server m2_server_t;
+
+/**
+ * Handles a single request in a server worker thread.
+ *
+ * The request is freed by the server once the handler returns.
+ *
+ * @param req   The request to handle.
+ * @param data  The data pointer given to m2_server_new().
+ */
+typedef void (*m2_handler_t)(m2_request_t * req, void * data);
+
+/**
+ * Creates a new server.
+ *
+ * The server is not started until m2_server_start() is called.
+ *
+ * @param   ctx         A context created with m2_ctx_new()
+ * @param   uuid        A unique id to identify the connections.
+ * @param   recv_addr   The address to connect to, to receive
+ *                      requests.
+ * @param   send_addr   The address to connect to, to send replies.
+ * @param   nthreads    The number of worker threads.
+ * @param   handler     The function called for each request.
+ * @param   data        Passed through to \a handler.
+ *
+ * @returns A new server, or NULL on error.
+ */
+m2_server_t * m2_server_new(void * ctx, const_bstring uuid,
+        const_bstring recv_addr, const_bstring send_addr,
+        int nthreads, m2_handler_t handler, void * data);
+
+/**
+ * Restricts a worker thread to the given CPUs.
+ *
+ * Must be called before the server is started. Workers without
+ * any affinity set can run on any CPU the process can.
+ *
+ * @param   server  The server.
+ * @param   worker  The index of the worker, from 0 to nthreads-1.
+ * @param   cpus    The CPUs the worker may run on.
+ * @param   ncpus   The number of entries in \a cpus. 0 clears the
+ *                  affinity.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_server_set_affinity(m2_server_t * server, int worker,
+        const int * cpus, int ncpus);
+
+/**
+ * Opens a connection for each worker and starts the worker threads.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_server_start(m2_server_t * server);
+
+/**
+ * Tells the workers to stop, without waiting for them.
+ *
+ * Requests already received are still handled. It is safe to call
+ * this from a signal handler or from inside a handler.
+ */
+void m2_server_stop(m2_server_t * server);
+
+/**
+ * Waits for the workers to exit after m2_server_stop() and
+ * closes their connections.
+ */
+void m2_server_join(m2_server_t * server);
+
+/**
+ * Stops the server, waits for it and frees it.
+ */
+void m2_server_destroy(m2_server_t * server);
+
 #endif//_MONGREL2_H_DEF
@@ -0,0 +1,95 @@
+/**
+ * @file number.h
+ *
+ * Locale-free number parsing, shared by the TNetstring and JSON
+ * decoders.
+ *
+ * Numbers are read in two steps. number_scan() checks the syntax
+ * and collects the significant digits and the power of ten, then
+ * number_to_long() or number_to_double() turns that into a value.
+ * Neither step reads past the end of the input, so numbers can be
+ * parsed straight out of a message.
+ */
+#ifndef _NUMBER_H_DEF
+#define _NUMBER_H_DEF
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The most significant digits that always fit in a uint64_t.
+ */
+#define NUMBER_MAX_DIGITS 19
+
+/*
+ * A scanned number, worth mantissa * 10^exponent.
+ */
+typedef struct number {
+    /// The first NUMBER_MAX_DIGITS significant digits
+    uint64_t mantissa;
+    /// The power of ten to scale the mantissa by
+    int64_t exponent;
+    /// The digits before the decimal point
+    const char * integer;
+    size_t integer_len;
+    /// The digits after the decimal point
+    const char * fraction;
+    size_t fraction_len;
+    int negative;
+    /// Set if the number has a fraction or an exponent
+    int is_float;
+    /// Set if there were digits that didn't fit in the mantissa
+    int truncated;
+} number_t;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Converts the run of ASCII digits at the start of the 8 bytes at \a p
+ * at once. Sets \a ndigits to the number of digits found, from 0 to 8.
+ */
+static inline uint64_t number_swar_digits(const char * p, int * ndigits) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+
+    uint64_t x = v - 0x3030303030303030ULL;
+    // The high bit of each byte is set if it isn't a digit
+    uint64_t bad = (x | (x + 0x7676767676767676ULL)) & 0x8080808080808080ULL;
+    int n = bad ? __builtin_ctzll(bad) >> 3 : 8;
+
+    *ndigits = n;
+    if (n == 0)
+        return 0;
+
+    // Line the digits up at the top, so the bytes shifted in at the
+    // bottom become leading zeros.
+    x <<= 8 * (8 - n);
+    x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+/*
+ * Scans the number at the start of [p, pe). The syntax is JSON's,
+ * except that leading zeros are allowed:
+ *
+ *     [-]digits[.digits][(e|E)[+|-]digits]
+ *
+ * Returns a pointer past the number, or NULL if there isn't one.
+ */
+const char * number_scan(const char * p, const char * pe, number_t * num);
+
+/*
+ * Converts a scanned integer. Returns 0 if the number has a fraction
+ * or exponent, or doesn't fit in a long.
+ */
+int number_to_long(const number_t * num, long * out);
+
+/*
+ * Converts a scanned number to the nearest double. Values too large
+ * for a double become infinities.
+ */
+double number_to_double(const number_t * num);
+
+#endif//_NUMBER_H_DEF
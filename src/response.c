@@ -0,0 +1,413 @@
+#include <string.h>
+#include <time.h>
+
+#include "mem/halloc.h"
+#include "err.h"
+#include "fmt.h"
+
+#include "response.h"
+
+struct response {
+    int status;
+    /// The headers, already formatted as "Name: value\r\n" lines
+    char * headers;
+    size_t headers_len;
+    size_t headers_max;
+    /// Whether Date and Content-Length were set explicitly
+    int has_date;
+    int has_length;
+    const char * body;
+    size_t body_len;
+    /// The body, if it was copied
+    char * body_copy;
+};
+
+static const struct tagbstring date_str = bsStatic("Date");
+static const struct tagbstring content_length_str = bsStatic("Content-Length");
+
+#define CONTENT_LENGTH_PREFIX "Content-Length: "
+#define CRLF "\r\n"
+
+/*
+ * "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+ */
+#define DATE_LINE_LEN 37
+
+#define STATUS(C,R) case C: { static const struct tagbstring s = bsStatic("HTTP/1.1 " #C " " R CRLF); return &s; }
+
+/*
+ * Gets the precomputed status line for the common status codes,
+ * or NULL for anything else.
+ */
+static const_bstring status_line(int status) {
+    switch (status) {
+        STATUS(100, "Continue")
+        STATUS(101, "Switching Protocols")
+        STATUS(200, "OK")
+        STATUS(201, "Created")
+        STATUS(202, "Accepted")
+        STATUS(203, "Non-Authoritative Information")
+        STATUS(204, "No Content")
+        STATUS(205, "Reset Content")
+        STATUS(206, "Partial Content")
+        STATUS(300, "Multiple Choices")
+        STATUS(301, "Moved Permanently")
+        STATUS(302, "Found")
+        STATUS(303, "See Other")
+        STATUS(304, "Not Modified")
+        STATUS(307, "Temporary Redirect")
+        STATUS(308, "Permanent Redirect")
+        STATUS(400, "Bad Request")
+        STATUS(401, "Unauthorized")
+        STATUS(402, "Payment Required")
+        STATUS(403, "Forbidden")
+        STATUS(404, "Not Found")
+        STATUS(405, "Method Not Allowed")
+        STATUS(406, "Not Acceptable")
+        STATUS(408, "Request Timeout")
+        STATUS(409, "Conflict")
+        STATUS(410, "Gone")
+        STATUS(411, "Length Required")
+        STATUS(412, "Precondition Failed")
+        STATUS(413, "Payload Too Large")
+        STATUS(414, "URI Too Long")
+        STATUS(415, "Unsupported Media Type")
+        STATUS(416, "Range Not Satisfiable")
+        STATUS(417, "Expectation Failed")
+        STATUS(422, "Unprocessable Entity")
+        STATUS(426, "Upgrade Required")
+        STATUS(428, "Precondition Required")
+        STATUS(429, "Too Many Requests")
+        STATUS(431, "Request Header Fields Too Large")
+        STATUS(500, "Internal Server Error")
+        STATUS(501, "Not Implemented")
+        STATUS(502, "Bad Gateway")
+        STATUS(503, "Service Unavailable")
+        STATUS(504, "Gateway Timeout")
+        STATUS(505, "HTTP Version Not Supported")
+        default:
+            return NULL;
+    }
+}
+
+#undef STATUS
+
+/*
+ * "HTTP/1.1 NNN \r\n", for status codes without a precomputed line.
+ */
+#define OTHER_STATUS_LINE_LEN 15
+
+static size_t status_line_len(int status) {
+    const_bstring line = status_line(status);
+    return line ? (size_t)line->slen : OTHER_STATUS_LINE_LEN;
+}
+
+static size_t write_status_line(int status, char * out) {
+    const_bstring line = status_line(status);
+    if (line) {
+        memcpy(out, line->data, line->slen);
+        return line->slen;
+    }
+
+    memcpy(out, "HTTP/1.1 ", 9);
+    fmt_ulong(out + 9, status);
+    memcpy(out + 12, " " CRLF, 3);
+    return OTHER_STATUS_LINE_LEN;
+}
+
+/*
+ * The Date line only changes once a second, so it is formatted
+ * at most that often for each thread.
+ */
+static __thread time_t date_time = -1;
+static __thread char date_line[DATE_LINE_LEN];
+
+static const char * date_line_now() {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    time_t now = time(NULL);
+    if (now != date_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+
+        char * p = date_line;
+        memcpy(p, "Date: ", 6);
+        p += 6;
+        memcpy(p, days + tm.tm_wday * 3, 3);
+        p += 3;
+        *p++ = ',';
+        *p++ = ' ';
+        *p++ = '0' + tm.tm_mday / 10;
+        *p++ = '0' + tm.tm_mday % 10;
+        *p++ = ' ';
+        memcpy(p, months + tm.tm_mon * 3, 3);
+        p += 3;
+        *p++ = ' ';
+        p += fmt_ulong(p, tm.tm_year + 1900);
+        *p++ = ' ';
+        *p++ = '0' + tm.tm_hour / 10;
+        *p++ = '0' + tm.tm_hour % 10;
+        *p++ = ':';
+        *p++ = '0' + tm.tm_min / 10;
+        *p++ = '0' + tm.tm_min % 10;
+        *p++ = ':';
+        *p++ = '0' + tm.tm_sec / 10;
+        *p++ = '0' + tm.tm_sec % 10;
+        memcpy(p, " GMT" CRLF, 6);
+
+        date_time = now;
+    }
+
+    return date_line;
+}
+
+m2_response_t * m2_response_new(int status) {
+
+    m2_response_t * resp = NULL;
+
+    check(status >= 100 && status <= 999, "Invalid status %d", status);
+
+    resp = h_malloc(sizeof(*resp));
+    check_mem(resp);
+    memset(resp, 0, sizeof(*resp));
+
+    resp->status = status;
+
+    return resp;
+
+error:
+    return NULL;
+}
+
+void m2_response_destroy(m2_response_t * resp) {
+    if (resp) {
+        h_free(resp);
+    }
+}
+
+int m2_response_set_status(m2_response_t * resp, int status) {
+    check(resp, "Invalid response");
+    check(status >= 100 && status <= 999, "Invalid status %d", status);
+
+    resp->status = status;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+static int valid_header(const_bstring name, const_bstring value) {
+    int i = 0;
+
+    if (!name || !value || name->slen <= 0 || value->slen < 0)
+        return 0;
+
+    for (i = 0; i < name->slen; i++) {
+        unsigned char c = name->data[i];
+        if (c == ':' || c == '\r' || c == '\n' || c == ' ')
+            return 0;
+    }
+    for (i = 0; i < value->slen; i++) {
+        unsigned char c = value->data[i];
+        if (c == '\r' || c == '\n')
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Removes all header lines named \a name.
+ */
+static void remove_header(m2_response_t * resp, const_bstring name) {
+    char * p = resp->headers;
+    char * pe = resp->headers + resp->headers_len;
+
+    while (p < pe) {
+        char * eol = (char *)memchr(p, '\n', pe - p) + 1;
+        char * colon = (char *)memchr(p, ':', eol - p);
+
+        struct tagbstring line_name;
+        btfromblk(line_name, p, colon - p);
+
+        if (biseqcaseless(&line_name, name)) {
+            memmove(p, eol, pe - eol);
+            pe -= eol - p;
+        } else {
+            p = eol;
+        }
+    }
+
+    resp->headers_len = pe - resp->headers;
+}
+
+int m2_response_add_header(m2_response_t * resp, const_bstring name, const_bstring value) {
+
+    check(resp, "Invalid response");
+    check(valid_header(name, value), "Invalid header");
+
+    size_t line_len = name->slen + 2 + value->slen + 2;
+
+    if (resp->headers_len + line_len > resp->headers_max) {
+        size_t max = resp->headers_max ? resp->headers_max * 2 : 256;
+        while (max < resp->headers_len + line_len) {
+            max *= 2;
+        }
+
+        char * headers = h_realloc(resp->headers, max);
+        check_mem(headers);
+        if (!resp->headers) hattach(headers, resp);
+
+        resp->headers = headers;
+        resp->headers_max = max;
+    }
+
+    char * p = resp->headers + resp->headers_len;
+    memcpy(p, name->data, name->slen);
+    p += name->slen;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value->data, value->slen);
+    p += value->slen;
+    memcpy(p, CRLF, 2);
+
+    resp->headers_len += line_len;
+
+    if (biseqcaseless(name, &date_str)) {
+        resp->has_date = 1;
+    } else if (biseqcaseless(name, &content_length_str)) {
+        resp->has_length = 1;
+    }
+
+    return 1;
+
+error:
+    return 0;
+}
+
+int m2_response_set_header(m2_response_t * resp, const_bstring name, const_bstring value) {
+
+    check(resp, "Invalid response");
+    check(valid_header(name, value), "Invalid header");
+
+    remove_header(resp, name);
+
+    return m2_response_add_header(resp, name, value);
+
+error:
+    return 0;
+}
+
+int m2_response_set_body(m2_response_t * resp, const_bstring body) {
+
+    char * copy = NULL;
+
+    check(resp, "Invalid response");
+    check(body && body->slen >= 0, "Invalid body");
+
+    if (body->slen > 0) {
+        copy = h_malloc(body->slen);
+        check_mem(copy);
+        hattach(copy, resp);
+        memcpy(copy, body->data, body->slen);
+    }
+
+    if (resp->body_copy) h_free(resp->body_copy);
+
+    resp->body_copy = copy;
+    resp->body = copy;
+    resp->body_len = body->slen;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+int m2_response_set_body_ref(m2_response_t * resp, const void * data, size_t len) {
+
+    check(resp, "Invalid response");
+    check(data || len == 0, "Invalid body");
+
+    if (resp->body_copy) h_free(resp->body_copy);
+
+    resp->body_copy = NULL;
+    resp->body = data;
+    resp->body_len = len;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+/*
+ * Whether Content-Length is added when \a resp is written. It isn't
+ * allowed on 1xx and 204 responses, and on a 304 it would describe
+ * the representation that wasn't sent (RFC 7230 section 3.3.2).
+ */
+static int auto_length(const m2_response_t * resp) {
+    if (resp->has_length)
+        return 0;
+    return !(resp->status / 100 == 1 || resp->status == 204 || resp->status == 304);
+}
+
+size_t m2_response_head_size(const m2_response_t * resp) {
+
+    size_t len = status_line_len(resp->status);
+
+    if (!resp->has_date)
+        len += DATE_LINE_LEN;
+    if (auto_length(resp))
+        len += sizeof(CONTENT_LENGTH_PREFIX) - 1 + fmt_ulong_len(resp->body_len) + 2;
+
+    return len + resp->headers_len + 2;
+}
+
+size_t m2_response_size(const m2_response_t * resp) {
+    return m2_response_head_size(resp) + resp->body_len;
+}
+
+size_t m2_response_write_head(const m2_response_t * resp, char * out) {
+
+    char * p = out;
+
+    p += write_status_line(resp->status, p);
+
+    if (!resp->has_date) {
+        memcpy(p, date_line_now(), DATE_LINE_LEN);
+        p += DATE_LINE_LEN;
+    }
+
+    if (auto_length(resp)) {
+        memcpy(p, CONTENT_LENGTH_PREFIX, sizeof(CONTENT_LENGTH_PREFIX) - 1);
+        p += sizeof(CONTENT_LENGTH_PREFIX) - 1;
+        p += fmt_ulong(p, resp->body_len);
+        memcpy(p, CRLF, 2);
+        p += 2;
+    }
+
+    if (resp->headers_len) {
+        memcpy(p, resp->headers, resp->headers_len);
+        p += resp->headers_len;
+    }
+
+    memcpy(p, CRLF, 2);
+    p += 2;
+
+    return p - out;
+}
+
+size_t m2_response_write(const m2_response_t * resp, char * out) {
+
+    size_t len = m2_response_write_head(resp, out);
+
+    if (resp->body_len) {
+        memcpy(out + len, resp->body, resp->body_len);
+        len += resp->body_len;
+    }
+
+    return len;
+}
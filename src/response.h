@@ -0,0 +1,112 @@
+/**
+ * @file response.h
+ *
+ * A builder for HTTP responses.
+ *
+ * The response keeps track of its exact serialized size, so
+ * it can be written straight into the message that is sent
+ * to Mongrel2 without any intermediate buffers.
+ */
+#ifndef _RESPONSE_H_DEF
+#define _RESPONSE_H_DEF
+
+#include <stddef.h>
+#include "bstring.h"
+
+typedef struct response m2_response_t;
+
+/**
+ * Creates a new response with the given status code and no
+ * headers or body.
+ *
+ * The `Date` and `Content-Length` headers are added when the
+ * response is written, unless they are set explicitly.
+ * `Content-Length` is left out of 1xx, 204 and 304 responses.
+ *
+ * @param status    The HTTP status code, e.g. 200.
+ *
+ * @returns A new response, or NULL on error.
+ */
+m2_response_t * m2_response_new(int status);
+
+/**
+ * Frees a response.
+ *
+ * Any body set with m2_response_set_body_ref() is not freed.
+ */
+void m2_response_destroy(m2_response_t * resp);
+
+/**
+ * Sets the status code of the response.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_response_set_status(m2_response_t * resp, int status);
+
+/**
+ * Adds a header to the response, keeping any existing headers
+ * with the same name.
+ *
+ * @param resp      The response.
+ * @param name      The name of the header. Cannot contain ':' or
+ *                  line breaks.
+ * @param value     The value of the header. Cannot contain line
+ *                  breaks.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_response_add_header(m2_response_t * resp, const_bstring name, const_bstring value);
+
+/**
+ * Sets a header on the response, replacing any existing headers
+ * with the same name. Names are compared case-insensitively.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_response_set_header(m2_response_t * resp, const_bstring name, const_bstring value);
+
+/**
+ * Sets the body of the response to a copy of \a body.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_response_set_body(m2_response_t * resp, const_bstring body);
+
+/**
+ * Sets the body of the response to refer to \a data, without
+ * copying it.
+ *
+ * The data must stay valid until the response has been sent
+ * or destroyed.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_response_set_body_ref(m2_response_t * resp, const void * data, size_t len);
+
+/**
+ * Gets the exact number of bytes m2_response_write() will write.
+ */
+size_t m2_response_size(const m2_response_t * resp);
+
+/**
+ * Gets the number of bytes of the response before the body.
+ */
+size_t m2_response_head_size(const m2_response_t * resp);
+
+/**
+ * Writes the status line and headers of the response to \a out,
+ * which must have room for m2_response_head_size() bytes.
+ *
+ * @returns The number of bytes written.
+ */
+size_t m2_response_write_head(const m2_response_t * resp, char * out);
+
+/**
+ * Writes the whole response to \a out, which must have room for
+ * m2_response_size() bytes.
+ *
+ * @returns The number of bytes written.
+ */
+size_t m2_response_write(const m2_response_t * resp, char * out);
+
+#endif//_RESPONSE_H_DEF
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zmq.h>
+
+#include "mem/halloc.h"
+#include "err.h"
+
+#include "mongrel2.h"
+
+/*
+ * How long a worker waits for requests before checking whether
+ * the server has been stopped, and how many requests it takes
+ * from the connection per wakeup.
+ */
+#define WORKER_POLL_MS 100
+#define WORKER_BATCH 32
+
+/*
+ * How long a worker waits before receiving again after an error,
+ * doubling while the errors continue.
+ */
+#define WORKER_BACKOFF_MIN_MS 10
+#define WORKER_BACKOFF_MAX_MS 1000
+
+typedef struct worker {
+    struct server * server;
+    void * conn;
+    pthread_t thread;
+    int started;
+    cpu_set_t cpus;
+    int has_cpus;
+} worker_t;
+
+struct server {
+    void * ctx;
+    bstring uuid;
+    bstring recv_addr;
+    bstring send_addr;
+    m2_handler_t handler;
+    void * data;
+    int running;
+    int stopping;
+    int nworkers;
+    worker_t * workers;
+};
+
+m2_server_t * m2_server_new(void * ctx, const_bstring uuid,
+        const_bstring recv_addr, const_bstring send_addr,
+        int nthreads, m2_handler_t handler, void * data) {
+
+    m2_server_t * server = NULL;
+
+    check(ctx, "Invalid context");
+    check(uuid, "uuid not valid");
+    check(recv_addr, "recv_addr not valid");
+    check(send_addr, "send_addr not valid");
+    check(nthreads > 0, "nthreads must be greater than 0");
+    check(handler, "handler not valid");
+
+    server = h_malloc(sizeof(*server));
+    check_mem(server);
+    memset(server, 0, sizeof(*server));
+
+    server->workers = h_calloc(nthreads, sizeof(worker_t));
+    check_mem(server->workers);
+    hattach(server->workers, server);
+
+    server->ctx = ctx;
+    server->handler = handler;
+    server->data = data;
+    server->nworkers = nthreads;
+
+    server->uuid = bstrcpy(uuid);
+    server->recv_addr = bstrcpy(recv_addr);
+    server->send_addr = bstrcpy(send_addr);
+    check_mem(server->uuid && server->recv_addr && server->send_addr);
+
+    return server;
+
+error:
+    m2_server_destroy(server);
+    return NULL;
+}
+
+int m2_server_set_affinity(m2_server_t * server, int worker,
+        const int * cpus, int ncpus) {
+
+    int i = 0;
+
+    check(server, "Invalid server");
+    check(!server->running, "Affinity must be set before the server is started");
+    check(worker >= 0 && worker < server->nworkers, "Invalid worker %d", worker);
+    check(cpus || ncpus == 0, "Invalid cpu list");
+
+    worker_t * w = &server->workers[worker];
+
+    CPU_ZERO(&w->cpus);
+    for (i = 0; i < ncpus; i++) {
+        check(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE, "Invalid cpu %d", cpus[i]);
+        CPU_SET(cpus[i], &w->cpus);
+    }
+    w->has_cpus = ncpus > 0;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+/*
+ * Whether the 0MQ error \a err means the connection can't be used
+ * again. ETERM is how the context tells its sockets to close.
+ */
+static int worker_error_fatal(int err) {
+    return err == ETERM || err == ENOTSOCK || err == EFAULT;
+}
+
+static void worker_sleep(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static void * worker_run(void * arg) {
+
+    worker_t * w = (worker_t *)arg;
+    m2_server_t * server = w->server;
+    m2_request_t * reqs[WORKER_BATCH];
+    int backoff = 0;
+    int i = 0;
+
+    while (!__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE)) {
+        int n = m2_recv_many(w->conn, reqs, WORKER_BATCH, WORKER_POLL_MS);
+        if (n < 0) {
+            int err = zmq_errno();
+            if (err == EAGAIN || err == EINTR)
+                continue;
+            if (err == ETERM)
+                break;
+
+            fprintf(stderr, "Worker %d: %s: %s\n", (int)(w - server->workers),
+                    m2_strerror() ? m2_strerror() : "Error receiving requests",
+                    zmq_strerror(err));
+            if (worker_error_fatal(err))
+                break;
+
+            // Anything else may clear up, but shouldn't be retried
+            // in a tight loop
+            backoff = backoff ? backoff * 2 : WORKER_BACKOFF_MIN_MS;
+            if (backoff > WORKER_BACKOFF_MAX_MS)
+                backoff = WORKER_BACKOFF_MAX_MS;
+            worker_sleep(backoff);
+            continue;
+        }
+
+        backoff = 0;
+
+        for (i = 0; i < n; i++) {
+            server->handler(reqs[i], server->data);
+            m2_request_free(reqs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+int m2_server_start(m2_server_t * server) {
+
+    pthread_attr_t attr;
+    int attr_init = 0;
+    int rc = 0;
+    int i = 0;
+
+    check(server, "Invalid server");
+    check(!server->running, "Server is already running");
+
+    server->stopping = 0;
+    server->running = 1;
+
+    // Connections are all opened here, since they are attached to the
+    // context, and handed over to the worker threads. Starting a thread
+    // is a full memory barrier, so that is safe with 0MQ sockets.
+    for (i = 0; i < server->nworkers; i++) {
+        worker_t * w = &server->workers[i];
+        w->server = server;
+        w->conn = m2_connection_open(server->ctx, server->uuid,
+                server->recv_addr, server->send_addr);
+        check(w->conn, "Error opening connection for worker %d", i);
+    }
+
+    for (i = 0; i < server->nworkers; i++) {
+        worker_t * w = &server->workers[i];
+
+        rc = pthread_attr_init(&attr);
+        check(rc == 0, "Error creating thread attributes");
+        attr_init = 1;
+
+        if (w->has_cpus) {
+            rc = pthread_attr_setaffinity_np(&attr, sizeof(w->cpus), &w->cpus);
+            check(rc == 0, "Error setting affinity for worker %d", i);
+        }
+
+        rc = pthread_create(&w->thread, &attr, worker_run, w);
+        check(rc == 0, "Error starting worker %d", i);
+        w->started = 1;
+
+        pthread_attr_destroy(&attr);
+        attr_init = 0;
+    }
+
+    return 1;
+
+error:
+    if (attr_init) pthread_attr_destroy(&attr);
+    m2_server_stop(server);
+    m2_server_join(server);
+
+    return 0;
+}
+
+void m2_server_stop(m2_server_t * server) {
+    if (server) {
+        __atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void m2_server_join(m2_server_t * server) {
+
+    int i = 0;
+
+    if (server) {
+        for (i = 0; i < server->nworkers; i++) {
+            worker_t * w = &server->workers[i];
+            if (w->started) {
+                pthread_join(w->thread, NULL);
+                w->started = 0;
+            }
+            // Joining is a full memory barrier too, so the
+            // connection can be closed on this thread
+            if (w->conn) {
+                m2_connection_close(w->conn);
+                w->conn = NULL;
+            }
+        }
+
+        server->running = 0;
+    }
+}
+
+void m2_server_destroy(m2_server_t * server) {
+    if (server) {
+        m2_server_stop(server);
+        m2_server_join(server);
+
+        bdestroy(server->uuid);
+        bdestroy(server->recv_addr);
+        bdestroy(server->send_addr);
+
+        h_free(server);
+    }
+}
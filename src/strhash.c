@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "strhash.h"
+
+/*
+ * The constants from wyhash.
+ */
+static const uint64_t strhash_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static pthread_once_t strhash_once = PTHREAD_ONCE_INIT;
+static int strhash_ready = 0;
+/// The process's seed, already mixed with the secret
+static uint64_t strhash_seed = 0;
+
+/*
+ * Replaces \a a and \a b with the low and high halves of their product.
+ */
+static inline void strhash_mum(uint64_t * a, uint64_t * b) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t a_lo = (uint32_t)*a, a_hi = *a >> 32;
+    uint64_t b_lo = (uint32_t)*b, b_hi = *b >> 32;
+    uint64_t ll = a_lo * b_lo;
+    uint64_t lh = a_lo * b_hi;
+    uint64_t hl = a_hi * b_lo;
+    uint64_t hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    *a = (mid << 32) | (uint32_t)ll;
+    *b = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+static inline uint64_t strhash_mix(uint64_t a, uint64_t b) {
+    strhash_mum(&a, &b);
+    return a ^ b;
+}
+
+/*
+ * Sets bit 5 of every byte of \a x that is an upper case ASCII letter,
+ * which makes it lower case.
+ */
+static inline uint64_t strhash_lower(uint64_t x) {
+    uint64_t low7 = x & 0x7F7F7F7F7F7F7F7FULL;
+    // The high bit of each byte is set if it is above 'Z', and
+    // if it is at least 'A'
+    uint64_t above_z = low7 + 0x2525252525252525ULL;
+    uint64_t from_a = low7 + 0x3F3F3F3F3F3F3F3FULL;
+    uint64_t upper = (from_a ^ above_z) & ~x & 0x8080808080808080ULL;
+    return x | (upper >> 2);
+}
+
+/*
+ * The reads don't care about byte order. The hash is only ever
+ * compared with others from the same process.
+ */
+static inline uint64_t strhash_read8(const uint8_t * p, int fold) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return fold ? strhash_lower(v) : v;
+}
+
+static inline uint64_t strhash_read4(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t strhash_finish(uint64_t a, uint64_t b, uint64_t seed, size_t len) {
+    a ^= strhash_secret[1];
+    b ^= seed;
+    strhash_mum(&a, &b);
+    return strhash_mix(a ^ strhash_secret[0] ^ len, b ^ strhash_secret[1]);
+}
+
+/*
+ * Hashes a key longer than 16 bytes, 48 and then 16 bytes at a time.
+ */
+static uint64_t strhash_long(const uint8_t * p, size_t len, int fold) {
+    uint64_t seed = strhash_seed;
+    size_t i = len;
+
+    if (i > 48) {
+        uint64_t seed1 = seed;
+        uint64_t seed2 = seed;
+        do {
+            seed = strhash_mix(strhash_read8(p, fold) ^ strhash_secret[1],
+                    strhash_read8(p + 8, fold) ^ seed);
+            seed1 = strhash_mix(strhash_read8(p + 16, fold) ^ strhash_secret[2],
+                    strhash_read8(p + 24, fold) ^ seed1);
+            seed2 = strhash_mix(strhash_read8(p + 32, fold) ^ strhash_secret[3],
+                    strhash_read8(p + 40, fold) ^ seed2);
+            p += 48;
+            i -= 48;
+        } while (i > 48);
+        seed ^= seed1 ^ seed2;
+    }
+
+    while (i > 16) {
+        seed = strhash_mix(strhash_read8(p, fold) ^ strhash_secret[1],
+                strhash_read8(p + 8, fold) ^ seed);
+        p += 16;
+        i -= 16;
+    }
+
+    // The last 16 bytes of the key, some of which may have been
+    // mixed in already
+    return strhash_finish(strhash_read8(p + i - 16, fold),
+            strhash_read8(p + i - 8, fold), seed, len);
+}
+
+/*
+ * Hashes keys of up to 16 bytes, which most header names are, with
+ * two pairs of 4 byte reads that overlap when the key is shorter.
+ */
+static inline uint64_t strhash_bytes(const uint8_t * p, size_t len, int fold) {
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    if (len > 16)
+        return strhash_long(p, len, fold);
+
+    if (len >= 4) {
+        size_t mid = (len >> 3) << 2;
+        a = (strhash_read4(p) << 32) | strhash_read4(p + mid);
+        b = (strhash_read4(p + len - 4) << 32) | strhash_read4(p + len - 4 - mid);
+    } else if (len > 0) {
+        // Each of the 1 to 3 bytes at least once
+        a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+    }
+
+    // Folding works on each byte, so it can wait until the reads
+    // have been put together
+    if (fold) {
+        a = strhash_lower(a);
+        b = strhash_lower(b);
+    }
+
+    return strhash_finish(a, b, strhash_seed, len);
+}
+
+/*
+ * Gets 8 random bytes for the seed, from the kernel if possible.
+ */
+static uint64_t strhash_random(void) {
+    uint64_t seed = 0;
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = 0;
+        close(fd);
+    }
+
+    if (seed == 0) {
+        // Without /dev/urandom, at least differ between processes
+        // and runs.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec
+            ^ ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)&seed;
+    }
+
+    return seed;
+}
+
+static void strhash_pick_seed(void) {
+    uint64_t seed = strhash_random();
+    strhash_seed = seed ^ strhash_mix(seed ^ strhash_secret[0], strhash_secret[1]);
+    __atomic_store_n(&strhash_ready, 1, __ATOMIC_RELEASE);
+}
+
+void strhash_init(void) {
+    pthread_once(&strhash_once, strhash_pick_seed);
+}
+
+uint64_t strhash(const void * key, size_t len) {
+    if (!__atomic_load_n(&strhash_ready, __ATOMIC_ACQUIRE))
+        strhash_init();
+    return strhash_bytes(key, len, 0);
+}
+
+uint64_t strhash_caseless(const void * key, size_t len) {
+    if (!__atomic_load_n(&strhash_ready, __ATOMIC_ACQUIRE))
+        strhash_init();
+    return strhash_bytes(key, len, 1);
+}
@@ -0,0 +1,41 @@
+/**
+ * @file strhash.h
+ *
+ * The string hash used for dictionary keys and header names.
+ *
+ * It is built like wyhash: the key is read 8 or 16 bytes at a time,
+ * or 48 bytes at a time when it is long, and each step is mixed in
+ * with a 64x64->128 bit multiply. The length is part of the hash, so
+ * keys that differ only in trailing zero bytes don't collide.
+ *
+ * The hash is seeded with random bytes once per process, so which keys
+ * collide can't be predicted from outside. The seed is picked by
+ * m2_ctx_new(), or by the first hash if that comes before it. It never
+ * changes after that, so hashes can be kept for as long as the process
+ * runs, but not stored or sent anywhere else.
+ */
+#ifndef _STRHASH_H_DEF
+#define _STRHASH_H_DEF
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Picks the process's seed, if it hasn't been already. Safe to call
+ * from any thread, any number of times.
+ */
+void strhash_init(void);
+
+/*
+ * Hashes the \a len bytes at \a key.
+ */
+uint64_t strhash(const void * key, size_t len);
+
+/*
+ * Hashes the \a len bytes at \a key with ASCII letters folded to
+ * lower case, so keys that are equal ignoring case hash the same.
+ * This is the hash for header names.
+ */
+uint64_t strhash_caseless(const void * key, size_t len);
+
+#endif//_STRHASH_H_DEF
@@ -0,0 +1,81 @@
+/**
+ * @file tns.h
+ *
+ * Low-level helpers for reading TNetstrings, shared by
+ * the variant parser and the request parser.
+ */
+#ifndef _TNS_H_DEF
+#define _TNS_H_DEF
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "number.h"
+
+/*
+ * The longest length prefix accepted. Nine digits is plenty for
+ * anything that fits in a message.
+ */
+#define TNS_MAX_LENGTH_DIGITS 9
+
+/*
+ * Non-zero for the characters that are valid TNetstring type markers.
+ */
+static const unsigned char tns_valid_tag[256] = {
+    [','] = 1, ['#'] = 1, ['^'] = 1, ['!'] = 1,
+    ['~'] = 1, ['}'] = 1, [']'] = 1,
+};
+
+/*
+ * Reads the length prefix and ':' at \a p, without going past \a pe.
+ *
+ * Returns a pointer to the payload, or NULL if there is no valid prefix.
+ */
+static inline const char * tns_read_length(const char * p, const char * pe, size_t * len) {
+    const char * start = p;
+    size_t n = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (pe - p >= 8) {
+        int ndigits = 0;
+        n = number_swar_digits(p, &ndigits);
+        p += ndigits;
+    }
+#endif
+
+    while (p < pe && p - start < TNS_MAX_LENGTH_DIGITS && *p >= '0' && *p <= '9') {
+        n = n * 10 + (*p - '0');
+        p++;
+    }
+
+    if (p == start || p == pe || *p != ':')
+        return NULL;
+
+    *len = n;
+    return p + 1;
+}
+
+/*
+ * Reads the TNetstring at the start of [p, pe) without parsing its
+ * value. Sets \a value, \a len and \a tag to the payload and type.
+ *
+ * Returns a pointer just past the TNetstring, or NULL if it is
+ * malformed.
+ */
+static inline const char * tns_next(const char * p, const char * pe,
+        const char ** value, size_t * len, char * tag) {
+    size_t n = 0;
+
+    p = tns_read_length(p, pe, &n);
+    if (!p || (size_t)(pe - p) <= n || !tns_valid_tag[(unsigned char)p[n]])
+        return NULL;
+
+    *value = p;
+    *len = n;
+    *tag = p[n];
+
+    return p + n + 1;
+}
+
+#endif//_TNS_H_DEF
@@ -1,22 +1,85 @@
 #include "bstring.h"
-#include "adt/hash.h"
-#include "adt/darray.h"
 #include "err.h"
-#include "json.h"
 #include "variant.h"
+#include "arena.h"
+#include "flatmap.h"
+#include "tns.h"
+#include "number.h"
+#include "json.h"
+#include "fmt.h"
 
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 
+typedef struct variant_list variant_list_t;
+
+/*
+ * The room for a string, and its terminating '\0', in the variant
+ * itself.
+ */
+#define SMALL_STRING_SIZE 13
+
+/*
+ * The mlen of strings kept in the variant. Being negative, bstrlib
+ * treats them as read-only.
+ */
+#define SMALL_STRING_MLEN (-2)
+
+/*
+ * A variant, in 32 bytes. Strings shorter than SMALL_STRING_SIZE are
+ * stored in \a small, so most header values need no memory of their
+ * own. The tag comes last so that \a small fills the space up to it.
+ *
+ * Short strings on the heap get their own bytes when their bstring is
+ * asked for, since it could be resized.
+ */
 struct variant_s {
-    m2_variant_tag type;
     union {
-        bstring string;
+        /// The variant owns the bytes if mlen is positive, and holds
+        /// them in small if it is SMALL_STRING_MLEN
+        struct tagbstring string;
         long integer;
         double fpoint;
         int boolean;
-        hash_t * dict;
-        darray_t * list;
+        flatmap_t * dict;
+        variant_list_t * list;
     } value;
+    unsigned char small[SMALL_STRING_SIZE];
+    /// An m2_variant_tag
+    unsigned char type;
+    /// Set if the variant came from an arena, and is freed with it
+    unsigned char in_arena;
+    /// Set if the variant is an item stored in a list, and is freed with it
+    unsigned char in_list;
+};
+
+/*
+ * The number of items a list holds before it needs an array of
+ * its own.
+ */
+#define LIST_INLINE_SIZE 4
+
+/*
+ * The number of values a packed array holds in the space of the
+ * inline items.
+ */
+#define ARRAY_INLINE_SIZE (LIST_INLINE_SIZE * sizeof(variant_t) / sizeof(int64_t))
+
+/*
+ * The items of a list, stored one after another. They are kept in
+ * \a inline_items until there are more than LIST_INLINE_SIZE of them,
+ * then in an array that doubles in size each time it fills.
+ *
+ * Packed arrays use the same storage, with \a items holding int64_t
+ * or double values instead of variants. While a parser is filling
+ * one, \a max counts values rather than variants.
+ */
+struct variant_list {
+    variant_t * items;
+    uint32_t count;
+    uint32_t max;
+    variant_t inline_items[LIST_INLINE_SIZE];
 };
 
 m2_variant_tag m2_variant_type(const variant_t * val) {
@@ -27,113 +90,217 @@ m2_variant_tag m2_variant_type(const variant_t * val) {
     }
 }
 
-void m2_variant_destroy(variant_t * var) {
-
-    if (var) {
+/*
+ * Frees everything \a var owns, but not \a var itself.
+ */
+static void variant_clear(variant_t * var) {
+    uint32_t i = 0;
 
-        switch(var->type) {
-            case m2_type_string:
-                bdestroy(var->value.string);
-                break;
-            case m2_type_dict:
-                hash_free_nodes(var->value.dict);
-                hash_destroy(var->value.dict);
-                break;
-            case m2_type_list:
-                darray_clear_destroy(var->value.list);
-                break;
-            default:
-                break;
-        }
+    switch(var->type) {
+        case m2_type_string:
+            // Allocated as bstrlib would, so it can be resized
+            if (var->value.string.mlen > 0)
+                free(var->value.string.data);
+            break;
+        case m2_type_dict:
+            if (var->value.dict) {
+                for (i = 0; i < flatmap_count(var->value.dict); i++) {
+                    m2_variant_destroy(flatmap_entry(var->value.dict, i)->value);
+                }
+                flatmap_destroy(var->value.dict);
+            }
+            break;
+        case m2_type_list:
+            if (var->value.list) {
+                for (i = 0; i < var->value.list->count; i++) {
+                    variant_clear(&var->value.list->items[i]);
+                }
+            }
+            // fall through
+        case m2_type_int_array:
+        case m2_type_float_array:
+            // Along with the array of items, if it has one
+            h_free(var->value.list);
+            break;
+        default:
+            break;
+    }
+}
 
+void m2_variant_destroy(variant_t * var) {
+    if (var && !var->in_arena && !var->in_list) {
+        variant_clear(var);
         h_free(var);
     }
 }
 
-static inline variant_t * variant_val_create(m2_variant_tag tag) {
+/*
+ * Allocates from \a arena, or from the heap if it is NULL.
+ */
+static inline void * variant_mem(m2_arena_t * arena, size_t size) {
+    return arena ? m2_arena_alloc(arena, size) : h_malloc(size);
+}
+
+static inline variant_t * variant_val_create(m2_arena_t * arena, m2_variant_tag tag) {
     variant_t * val = NULL;
-    val = (variant_t *)h_malloc(sizeof(*val));
+    val = (variant_t *)variant_mem(arena, sizeof(*val));
     check_mem(val);
 
     memset(val, 0, sizeof(*val));
 
     val->type = tag;
+    val->in_arena = arena != NULL;
 
     return val;
 error:
-    if (val) h_free(val);
     return NULL;
 }
 
-static hnode_t * hnode_alloc(void * unused) {
-    (void)unused;
-
-    return (hnode_t *)h_malloc(sizeof(hnode_t));
-}
-
-static void hnode_free(hnode_t * node, void * unused) {
-    (void)unused;
-
-    if (node) {
-        bstring key = (bstring)hnode_getkey(node);
-        if (key) {
-            bdestroy(key);
-        }
-        void * data = hnode_get(node);
-        if (data) {
-            m2_variant_destroy(data);
-        }
-        h_free(node);
-    }
-}
-
 variant_t * m2_variant_string_new() {
-    variant_t * val = variant_val_create(m2_type_string);
+    variant_t * val = variant_val_create(NULL, m2_type_string);
     return val;
 }
 variant_t * m2_variant_integer_new() {
-    return variant_val_create(m2_type_integer);
+    return variant_val_create(NULL, m2_type_integer);
 }
 variant_t * m2_variant_float_new() {
-    return variant_val_create(m2_type_float);
+    return variant_val_create(NULL, m2_type_float);
 }
 variant_t * m2_variant_bool_new() {
-    return variant_val_create(m2_type_boolean);
+    return variant_val_create(NULL, m2_type_boolean);
 }
 variant_t * m2_variant_null_new() {
-    return variant_val_create(m2_type_null);
+    return variant_val_create(NULL, m2_type_null);
 }
 
-variant_t * m2_variant_dict_new() {
-    variant_t * val = NULL;
-    val = variant_val_create(m2_type_dict);
-    if (val) {
-        val->value.dict = hash_create(HASHCOUNT_T_MAX, (hash_comp_t)bstrcmp, (hash_fun_t)bstr_hash_fun);
-        hash_set_allocator(val->value.dict, hnode_alloc, hnode_free, NULL);
+/*
+ * Gets the bytes of the string variant \a val, which are in the
+ * variant itself for short strings. Their data pointer is stale if
+ * the variant has been moved.
+ */
+static inline const unsigned char * string_data(const variant_t * val) {
+    if (val->value.string.mlen == SMALL_STRING_MLEN)
+        return val->small;
+    // Strings from m2_variant_string_new() have no bytes yet
+    if (!val->value.string.data)
+        return (const unsigned char *)"";
+    return val->value.string.data;
+}
+
+/*
+ * Gives \a val a copy of the \a len bytes at \a data, which it owns.
+ * Short strings are copied into the variant.
+ */
+static int string_copy(variant_t * val, const char * data, size_t len) {
+    unsigned char * copy = NULL;
+
+    check(len < (size_t)INT_MAX, "String is too long");
+
+    if (len < SMALL_STRING_SIZE) {
+        memcpy(val->small, data, len);
+        val->small[len] = '\0';
+
+        val->value.string.mlen = SMALL_STRING_MLEN;
+        val->value.string.slen = len;
+        val->value.string.data = val->small;
+        return 1;
     }
 
+    // bstrlib frees and resizes strings with free() and realloc()
+    copy = malloc(len + 1);
+    check_mem(copy);
+
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+
+    val->value.string.mlen = len + 1;
+    val->value.string.slen = len;
+    val->value.string.data = copy;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+/*
+ * The most items a dict is sized for before it is filled.
+ */
+#define DICT_MAX_HINT 1024
+
+static variant_t * dict_new(m2_arena_t * arena, size_t hint) {
+    variant_t * val = variant_val_create(arena, m2_type_dict);
+    check_mem(val);
+
+    val->value.dict = flatmap_create(arena, hint);
+    check(val->value.dict, "Error creating dict");
+
     return val;
+
+error:
+    m2_variant_destroy(val);
+    return NULL;
+}
+
+variant_t * m2_variant_dict_new() {
+    return dict_new(NULL, 0);
+}
+
+/*
+ * Gives the list variant \a val its storage, from \a arena or the
+ * heap if it is NULL.
+ */
+static int list_init(m2_arena_t * arena, variant_t * val) {
+    variant_list_t * list = variant_mem(arena, sizeof(variant_list_t));
+    check_mem(list);
+
+    list->items = list->inline_items;
+    list->count = 0;
+    list->max = LIST_INLINE_SIZE;
+    val->value.list = list;
+
+    return 1;
+
+error:
+    return 0;
 }
 
 variant_t * m2_variant_list_new() {
-    variant_t * val = NULL;
-    val = variant_val_create(m2_type_list);
-    if (val) {
-        val->value.list = darray_create(sizeof(variant_t), 32);
-    }
+    variant_t * val = variant_val_create(NULL, m2_type_list);
+    check_mem(val);
+
+    check(list_init(NULL, val), "Error creating list");
 
     return val;
+
+error:
+    m2_variant_destroy(val);
+    return NULL;
 }
 
-int m2_variant_dict_set(variant_t * dict, const_bstring key, variant_t * item) {
-    check(m2_variant_type(dict) == m2_type_dict, "val is not a dictionary");
+/*
+ * Moves the items of \a list from \a old_size bytes of storage to
+ * \a size bytes, from \a arena or the heap if it is NULL, keeping
+ * their contents. The storage grows in place when it can. Storage on
+ * the heap is attached to the list.
+ */
+static int list_grow(m2_arena_t * arena, variant_list_t * list, size_t old_size, size_t size) {
+    variant_t * items = NULL;
+
+    if (list->items == list->inline_items) {
+        items = variant_mem(arena, size);
+        check_mem(items);
+        memcpy(items, list->items, old_size);
+        if (!arena) hattach(items, list);
+    } else if (arena) {
+        items = m2_arena_realloc(arena, list->items, old_size, size);
+        check_mem(items);
+    } else {
+        items = h_realloc(list->items, size);
+        check_mem(items);
+    }
 
-    hnode_t * node = NULL;
-    node = hash_lookup(dict->value.dict, key);
-    if (node)
-        node->hash_data = item;
-    else
-        hash_alloc_insert(dict->value.dict, key, item);
+    list->items = items;
 
     return 1;
 
@@ -141,326 +308,1613 @@ error:
     return 0;
 }
 
-variant_t * m2_variant_dict_get(const variant_t * dict, const_bstring key) {
-    check(m2_variant_type(dict) == m2_type_dict, "val is not a dictionary");
+/*
+ * Adds an empty item of type \a tag to the end of \a list, and
+ * returns it to be filled in. A full list moves to storage twice the
+ * size, from \a arena or the heap if it is NULL.
+ */
+static variant_t * list_add(m2_arena_t * arena, variant_list_t * list, m2_variant_tag tag) {
+    variant_t * item = NULL;
+
+    if (list->count == list->max) {
+        check(list->max < UINT32_MAX / 2, "List is too large");
+
+        check(list_grow(arena, list, list->max * sizeof(variant_t),
+                    list->max * 2 * sizeof(variant_t)), "Error growing list");
+        list->max *= 2;
+    }
+
+    item = &list->items[list->count++];
+    memset(item, 0, sizeof(*item));
+    item->type = tag;
+    item->in_arena = arena != NULL;
+    item->in_list = 1;
 
-    return hash_lookup(dict->value.dict, key)->hash_data;
+    return item;
 
 error:
     return NULL;
 }
 
-int m2_variant_list_append(variant_t * list, variant_t * item) {
-    check(m2_variant_type(list) == m2_type_list, "val is not a list");
+/*
+ * Adds a value to the end of the packed array \a list, which a parser
+ * is filling, and returns the space for it. Grows like list_add().
+ */
+static void * array_add(m2_arena_t * arena, variant_list_t * list) {
+    if (list->count == list->max) {
+        check(list->max < UINT32_MAX / 2, "Array is too large");
+
+        check(list_grow(arena, list, list->max * sizeof(int64_t),
+                    list->max * 2 * sizeof(int64_t)), "Error growing array");
+        list->max *= 2;
+    }
+
+    return (int64_t *)list->items + list->count++;
+
+error:
+    return NULL;
+}
+
+/*
+ * Turns the packed array \a val, which a parser is filling, back into
+ * a list once an item turns up that doesn't belong in it. The storage
+ * grows to fit a variant for each value, and one more, and then the
+ * values are spread out from the last one down, so each is read
+ * before a variant is written over it.
+ */
+static int array_unpack(m2_arena_t * arena, variant_t * val) {
+    variant_list_t * list = val->value.list;
+    int ints = val->type == m2_type_int_array;
+    uint32_t max = LIST_INLINE_SIZE;
+    uint32_t i = list->count;
+
+    check(list->count < UINT32_MAX / 2, "List is too large");
+    while (max <= list->count)
+        max *= 2;
+
+    if (max > LIST_INLINE_SIZE) {
+        check(list_grow(arena, list, list->max * sizeof(int64_t), max * sizeof(variant_t)),
+                "Error unpacking array");
+    }
 
-    darray_push(list->value.list, item);
+    while (i-- > 0) {
+        variant_t item;
+
+        memset(&item, 0, sizeof(item));
+        if (ints) {
+            item.type = m2_type_integer;
+            item.value.integer = ((int64_t *)list->items)[i];
+        } else {
+            item.type = m2_type_float;
+            item.value.fpoint = ((double *)list->items)[i];
+        }
+        item.in_arena = arena != NULL;
+        item.in_list = 1;
+
+        list->items[i] = item;
+    }
+
+    list->max = max;
+    val->type = m2_type_list;
 
     return 1;
+
 error:
     return 0;
 }
 
-bstring m2_variant_get_string(variant_t * value) {
-    check(m2_variant_type(value) == m2_type_string, "Type is not a string");
-    return value->value.string;
+/*
+ * Shrinks the storage of the packed array \a val to fit its values,
+ * once nothing more will be added. Storage in \a arena only gives its
+ * space back if nothing has been allocated after it.
+ */
+static void array_trim(m2_arena_t * arena, variant_t * val) {
+    variant_list_t * list = val->value.list;
+    variant_t * items = NULL;
+
+    if ((val->type != m2_type_int_array && val->type != m2_type_float_array)
+            || list->items == list->inline_items || list->count == list->max)
+        return;
+
+    // Keeps the larger storage if this fails
+    if (arena) {
+        items = m2_arena_realloc(arena, list->items, list->max * sizeof(int64_t),
+                list->count * sizeof(int64_t));
+    } else {
+        items = h_realloc(list->items, list->count * sizeof(int64_t));
+    }
+
+    if (items) {
+        list->items = items;
+        list->max = list->count;
+    }
+}
+
+/*
+ * Adds an item of type \a tag to the list \a val, which a parser is
+ * filling, turning it back from a packed array first if need be.
+ */
+static variant_t * list_item_new(m2_arena_t * arena, variant_t * val, m2_variant_tag tag) {
+    if (val->type != m2_type_list) {
+        check(array_unpack(arena, val), "Error unpacking array");
+    }
+
+    return list_add(arena, val->value.list, tag);
+
 error:
     return NULL;
 }
 
-/* TNetstrings implementation */
-static inline variant_t * tns_parse_string(const char * data, size_t len) {
-    variant_t * val = variant_val_create(m2_type_string);
-    if (val)
-        val->value.string = blk2bstr(data, len);
+/*
+ * Creates a value of type \a tag to go in \a container. Items of a
+ * list are built in place at its end. Anything else gets a variant of
+ * its own, which the caller adds to the dict or uses as the root.
+ */
+static inline variant_t * item_new(m2_arena_t * arena, variant_t * container, m2_variant_tag tag) {
+    if (container && container->type != m2_type_dict)
+        return list_item_new(arena, container, tag);
 
-    return val;
+    return variant_val_create(arena, tag);
 }
 
-static inline variant_t * tns_parse_integer(const char * data, size_t len, int base) {
-    variant_t * val = variant_val_create(m2_type_integer);
-    if (val) {
-        char * end = NULL;
-        val->value.integer = strtol( data, &end, base);
+/*
+ * Creates a number to go in \a container, as item_new() does, either
+ * the integer \a n or the float \a d as \a tag says.
+ *
+ * If \a pack is set, a list that has held nothing but numbers of the
+ * same type keeps them as a packed array, and \a container is
+ * returned rather than an item.
+ */
+static variant_t * number_new(m2_arena_t * arena, variant_t * container,
+        m2_variant_tag tag, long n, double d, int pack) {
+    m2_variant_tag array_type = tag == m2_type_integer ? m2_type_int_array : m2_type_float_array;
+    variant_t * val = NULL;
+
+    if (pack && container && (container->type == array_type
+                || (container->type == m2_type_list && container->value.list->count == 0))) {
+        if (container->type == m2_type_list) {
+            container->type = array_type;
+            container->value.list->max = ARRAY_INLINE_SIZE;
+        }
 
-        check(end != NULL && (size_t)(end - data) == len, "Error parsing integer");
+        void * slot = array_add(arena, container->value.list);
+        check_mem(slot);
+
+        if (tag == m2_type_integer) {
+            *(int64_t *)slot = n;
+        } else {
+            *(double *)slot = d;
+        }
+
+        return container;
+    }
+
+    val = item_new(arena, container, tag);
+    check_mem(val);
+
+    if (tag == m2_type_integer) {
+        val->value.integer = n;
+    } else {
+        val->value.fpoint = d;
     }
 
     return val;
 
 error:
-    m2_variant_destroy(val);
     return NULL;
 }
 
-static inline variant_t * tns_parse_float(const char * data, size_t len) {
-    variant_t * val = variant_val_create(m2_type_float);
-    if (val) {
-        char * end = NULL;
-        val->value.fpoint = strtod(data, &end);
+/*
+ * Turns \a val into a packed array if it is a list of nothing but
+ * integers, or nothing but floats. The values are moved down over the
+ * variants they came from, so no memory is needed. Arrays on the heap
+ * are then shrunk to fit, and ones in an arena keep their storage
+ * until it is reset.
+ */
+static void list_pack(variant_t * val) {
+    variant_list_t * list = val->value.list;
+    m2_variant_tag item_type = m2_type_invalid;
+    uint32_t i = 0;
+
+    if (val->type != m2_type_list || list->count == 0)
+        return;
+
+    item_type = list->items[0].type;
+    if (item_type != m2_type_integer && item_type != m2_type_float)
+        return;
+
+    for (i = 1; i < list->count; i++) {
+        if (list->items[i].type != item_type)
+            return;
+    }
 
-        check(end != NULL && (size_t)(end - data) == len, "Error parsing float");
+    // Each value is written below the variant it is read from
+    if (item_type == m2_type_integer) {
+        int64_t * ints = (int64_t *)list->items;
+        for (i = 0; i < list->count; i++) {
+            int64_t n = list->items[i].value.integer;
+            ints[i] = n;
+        }
+        val->type = m2_type_int_array;
+    } else {
+        double * floats = (double *)list->items;
+        for (i = 0; i < list->count; i++) {
+            double d = list->items[i].value.fpoint;
+            floats[i] = d;
+        }
+        val->type = m2_type_float_array;
     }
 
-    return val;
+    if (!val->in_arena && list->items != list->inline_items) {
+        // Keeps the larger array if this fails
+        variant_t * items = h_realloc(list->items, list->count * sizeof(int64_t));
+        if (items) {
+            list->items = items;
+            list->max = list->count;
+        }
+    }
+}
+
+int m2_variant_pack(variant_t * val) {
+    uint32_t i = 0;
+
+    check(val, "Invalid variant");
+
+    switch (val->type) {
+        case m2_type_dict:
+            for (i = 0; i < flatmap_count(val->value.dict); i++) {
+                m2_variant_pack(flatmap_entry(val->value.dict, i)->value);
+            }
+            break;
+        case m2_type_list:
+            for (i = 0; i < val->value.list->count; i++) {
+                m2_variant_pack(&val->value.list->items[i]);
+            }
+            list_pack(val);
+            break;
+        default:
+            break;
+    }
+
+    return 1;
 
 error:
-    m2_variant_destroy(val);
-    return NULL;
+    return 0;
 }
 
-static inline variant_t * tns_parse_bool(const char * data, size_t len) {
-    const char * i = data;
-    int d = 0;
-    if (len == 4) {
-        check(*(i++) != 't' || *(i++) != 'r' || *(i++) != 'u' || *(i++) != 'e', "Invalid bool value");
-        d = 1;
-    } else if (len == 5) {
-        check(*(i++) != 'f' || *(i++) != 'a' || *(i++) != 'l' || *(i++) != 's' || *(i++) != 'e', "Invalid bool value");
+/*
+ * Reads the \a i th value of a packed array into \a item.
+ */
+static inline void array_get(const variant_t * val, uint32_t i, variant_t * item) {
+    memset(item, 0, sizeof(*item));
+
+    if (val->type == m2_type_int_array) {
+        item->type = m2_type_integer;
+        item->value.integer = ((const int64_t *)val->value.list->items)[i];
     } else {
-        check(0, "Invalid bool value");
+        item->type = m2_type_float;
+        item->value.fpoint = ((const double *)val->value.list->items)[i];
     }
+}
 
-    variant_t * val = variant_val_create(m2_type_boolean);
-    val->value.boolean = d;
+/*
+ * Sets the entry named by the \a len bytes at \a key to \a item.
+ *
+ * If \a copy is set the dict keeps a copy of the key, otherwise the
+ * key bytes must outlive the dictionary.
+ */
+static int dict_set_key(variant_t * dict, const char * key, size_t len,
+        variant_t * item, int copy) {
 
-    return val;
+    void * old = NULL;
+
+    check(flatmap_set(dict->value.dict, key, len, item, copy, &old), "Error setting item");
+    m2_variant_destroy(old);
+
+    return 1;
 
 error:
-    return NULL;
+    return 0;
 }
 
-#define rotate_buffer(data,rest,len,orig_len) {\
-    len = len - (rest - data);\
-    check(len < orig_len, "Buffer math went wonky");\
-    data = rest;\
+int m2_variant_dict_set(variant_t * dict, const_bstring key, variant_t * item) {
+    check(m2_variant_type(dict) == m2_type_dict, "val is not a dictionary");
+    check(!dict->in_arena, "Variants from an arena can't be changed");
+    check(key, "Invalid key");
+
+    check(dict_set_key(dict, (const char *)key->data, key->slen, item, 1), "Error setting item");
+    bdestroy((bstring)key);
+
+    return 1;
+
+error:
+    return 0;
 }
 
-static inline variant_t * tns_parse_dict(const char * data, size_t len) {
+variant_t * m2_variant_dict_get(const variant_t * dict, const_bstring key) {
+    check(m2_variant_type(dict) == m2_type_dict, "val is not a dictionary");
+    check(key, "Invalid key");
 
-    variant_t * val = (variant_t *)m2_variant_dict_new();
+    flatmap_entry_t * e = flatmap_find(dict->value.dict, (const char *)key->data, key->slen);
 
-    void * key = NULL;
-    void * item = NULL;
-    char * rest = NULL;
-    size_t orig_len = len;
+    return e ? e->value : NULL;
 
-    while (len > 0) {
-        key = m2_parse_tns(data, len, &rest);
-        check(key, "Error parsing key");
-        check(m2_variant_type(key) == m2_type_string, "key must be a string");
-        rotate_buffer(data, rest, len, orig_len);
+error:
+    return NULL;
+}
 
-        item = m2_parse_tns(data, len, &rest);
-        check(item, "Error parsing item");
-        rotate_buffer(data, rest, len, orig_len);
+variant_t * m2_variant_dict_get_caseless(const variant_t * dict, const_bstring key) {
+    check(m2_variant_type(dict) == m2_type_dict, "val is not a dictionary");
+    check(key, "Invalid key");
 
-        m2_variant_dict_set(val, ((variant_t *)key)->value.string, item);
-        free(key);
+    flatmap_t * map = dict->value.dict;
+    uint32_t i = flatmap_count(map);
 
-        key = NULL;
-        item = NULL;
+    // The hashes can't be used, so check each key, latest first
+    while (i-- > 0) {
+        flatmap_entry_t * e = flatmap_entry(map, i);
+        if (e->key.slen == key->slen && biseqcaseless(&e->key, key) == 1)
+            return e->value;
     }
 
-    return val;
+    return NULL;
 
 error:
-    if (key) m2_variant_destroy(key);
-    if (item) m2_variant_destroy(item);
-    m2_variant_destroy(val);
     return NULL;
 }
 
-static inline variant_t * tns_parse_list(const char * data, size_t len) {
-
-    variant_t * val = (variant_t *)m2_variant_list_new();
+int m2_variant_list_append(variant_t * list, variant_t * item) {
+    check(m2_variant_type(list) == m2_type_list, "val is not a list");
+    check(!list->in_arena, "Variants from an arena can't be changed");
+    check(item && !item->in_arena && !item->in_list, "Item can't be moved into a list");
 
-    void * item = NULL;
-    char * rest = NULL;
-    size_t orig_len = len;
+    variant_t * slot = list_add(NULL, list->value.list, item->type);
+    check(slot, "Error appending item");
 
-    while (len > 0) {
-        item = m2_parse_tns(data, len, &rest);
-        check(item, "Error parsing item");
-        rotate_buffer(data, rest, len, orig_len);
+    slot->value = item->value;
+    memcpy(slot->small, item->small, sizeof(slot->small));
+    h_free(item);
 
-        m2_variant_list_append(val, item);
+    return 1;
+error:
+    return 0;
+}
 
-        item = NULL;
-    }
+size_t m2_variant_list_length(const variant_t * list) {
+    m2_variant_tag type = m2_variant_type(list);
+    check(type == m2_type_list || type == m2_type_int_array || type == m2_type_float_array,
+            "val is not a list");
 
-    return val;
+    return list->value.list->count;
 
 error:
-    if (item) m2_variant_destroy(item);
-    m2_variant_destroy(val);
+    return 0;
+}
+
+variant_t * m2_variant_list_get(const variant_t * list, size_t index) {
+    check(m2_variant_type(list) == m2_type_list, "val is not a list");
 
+    if (index >= list->value.list->count)
+        return NULL;
+
+    return &list->value.list->items[index];
+
+error:
     return NULL;
 }
-variant_t * m2_parse_tns(const char * data,
-        size_t len, char ** rest) {
 
-    void * val = NULL;
-    const char * end = data+len;
-    m2_variant_tag type = m2_type_null;
+const int64_t * m2_variant_get_int_array(const variant_t * val, size_t * len) {
+    check(m2_variant_type(val) == m2_type_int_array, "val is not an integer array");
+    check(len, "Invalid length");
 
-    check(data, "Data cannot be NULL");
-    check(len, "Len must be greater than 0");
+    *len = val->value.list->count;
+    return (const int64_t *)val->value.list->items;
+
+error:
+    return NULL;
+}
+
+const double * m2_variant_get_float_array(const variant_t * val, size_t * len) {
+    check(m2_variant_type(val) == m2_type_float_array, "val is not a float array");
+    check(len, "Invalid length");
 
-    char * valstr = NULL;
-    long vallen = strtol(data, &valstr, 10);
+    *len = val->value.list->count;
+    return (const double *)val->value.list->items;
 
-    //Checks!
-    check(vallen >= 0, "Invalid size");
-    check(end >= (valstr+(vallen)), "Parsed value (%ld) is greater than buffer size", vallen)
-    check(valstr[0] == ':', "Invalid TNetstring, expected ':' got %c", valstr[0])
-    valstr++;
+error:
+    return NULL;
+}
 
-    type = valstr[vallen];
+bstring m2_variant_get_string(variant_t * value) {
+    check(m2_variant_type(value) == m2_type_string, "Type is not a string");
 
-    if (rest) {
-        *rest = valstr + vallen + 1;
+    if (value->value.string.mlen == SMALL_STRING_MLEN) {
+        if (value->in_arena) {
+            // Read-only like the rest of the arena, but the variant
+            // may have moved since the data pointer was set
+            value->value.string.data = value->small;
+        } else {
+            // Strings on the heap can be resized by bstrlib, so they
+            // need bytes of their own
+            unsigned char * data = malloc(value->value.string.slen + 1);
+            check_mem(data);
+
+            memcpy(data, value->small, value->value.string.slen + 1);
+            value->value.string.mlen = value->value.string.slen + 1;
+            value->value.string.data = data;
+        }
     }
 
-    switch (type) {
+    // Strings from m2_variant_string_new() have no bytes yet
+    return value->value.string.data ? &value->value.string : NULL;
+error:
+    return NULL;
+}
+
+/*
+ * Copies \a val and everything in it into \a copy, which is on the
+ * heap and already has its type set.
+ */
+static int variant_copy(variant_t * copy, const variant_t * val) {
+    variant_t * item = NULL;
+    uint32_t i = 0;
+
+    switch (val->type) {
         case m2_type_string:
-            val = tns_parse_string(valstr, vallen);
-            break;
-        case m2_type_integer:
-            val = tns_parse_integer(valstr, vallen, 10);
-            break;
-        case m2_type_float:
-            val = tns_parse_float(valstr, vallen);
-            break;
-        case m2_type_boolean:
-            val = tns_parse_bool(valstr, vallen);
+            if (val->value.string.data) {
+                check(string_copy(copy, (const char *)string_data(val),
+                            val->value.string.slen), "Error copying string");
+            }
             break;
         case m2_type_dict:
-            val = tns_parse_dict(valstr, vallen);
+            copy->value.dict = flatmap_create(NULL, flatmap_count(val->value.dict));
+            check(copy->value.dict, "Error creating dict");
+
+            for (i = 0; i < flatmap_count(val->value.dict); i++) {
+                flatmap_entry_t * e = flatmap_entry(val->value.dict, i);
+
+                item = m2_variant_clone(e->value);
+                check(item, "Error copying dict item");
+                check(dict_set_key(copy, (const char *)e->key.data, e->key.slen, item, 1),
+                        "Error copying dict item");
+                item = NULL;
+            }
             break;
         case m2_type_list:
-            val = tns_parse_list(valstr, vallen);
+            check(list_init(NULL, copy), "Error creating list");
+
+            for (i = 0; i < val->value.list->count; i++) {
+                const variant_t * from = &val->value.list->items[i];
+
+                // A failed copy stays in the list, and is freed with it
+                item = list_add(NULL, copy->value.list, from->type);
+                check(item, "Error copying list item");
+                check(variant_copy(item, from), "Error copying list item");
+                item = NULL;
+            }
             break;
-        case m2_type_null:
-            check(vallen == 0, "Null must be represented as '0:~'");
-            val = variant_val_create(m2_type_null);
+        case m2_type_int_array:
+        case m2_type_float_array: {
+            size_t size = val->value.list->count * sizeof(int64_t);
+
+            check(list_init(NULL, copy), "Error creating array");
+
+            if (size > sizeof(copy->value.list->inline_items)) {
+                variant_t * items = h_malloc(size);
+                check_mem(items);
+                hattach(items, copy->value.list);
+                copy->value.list->items = items;
+            }
+
+            memcpy(copy->value.list->items, val->value.list->items, size);
+            copy->value.list->count = copy->value.list->max = val->value.list->count;
             break;
-        case m2_type_invalid:
+        }
         default:
-            check(0, "Invalid type");
+            copy->value = val->value;
     }
 
-
-    return val;
+    return 1;
 
 error:
-    return NULL;
+    m2_variant_destroy(item);
+    return 0;
 }
 
-static variant_t * json_val_to_variant(const json_value * jval) {
+variant_t * m2_variant_clone(const variant_t * val) {
+    variant_t * copy = NULL;
+
+    check(val, "Invalid variant");
+
+    copy = variant_val_create(NULL, val->type);
+    check_mem(copy);
+
+    check(variant_copy(copy, val), "Error copying variant");
+
+    return copy;
+
+error:
+    m2_variant_destroy(copy);
+    return NULL;
+}
+
+/* TNetstrings implementation */
+
+/*
+ * Deepest nesting of dicts and lists the parser will follow.
+ */
+#define TNS_MAX_DEPTH 64
+
+/*
+ * A dict or list that is still being read. \a end points at its
+ * type marker, and \a key at the key read for the next dict item.
+ */
+typedef struct tns_frame {
+    variant_t * container;
+    const char * end;
+    const char * key;
+    size_t keylen;
+} tns_frame_t;
+
+static inline variant_t * tns_parse_string(m2_arena_t * arena, variant_t * container,
+        const char * data, size_t len, int view) {
+    variant_t * val = item_new(arena, container, m2_type_string);
+    check_mem(val);
+
+    if (view) {
+        // The string points straight at the data
+        blk2tbstr(val->value.string, data, len);
+    } else {
+        check(string_copy(val, data, len), "Error copying string");
+    }
+
+    return val;
+
+error:
+    m2_variant_destroy(val);
+    return NULL;
+}
+
+static inline variant_t * tns_parse_integer(m2_arena_t * arena, variant_t * container,
+        const char * data, size_t len, int pack) {
+    number_t num;
+    long n = 0;
+
+    check(number_scan(data, data + len, &num) == data + len
+            && number_to_long(&num, &n), "Error parsing integer");
+
+    return number_new(arena, container, m2_type_integer, n, 0, pack);
+
+error:
+    return NULL;
+}
+
+/*
+ * Reads the non-finite values that are written with "%g".
+ */
+static inline int tns_parse_nonfinite(const char * data, size_t len, double * out) {
+    int neg = len > 0 && *data == '-';
+    data += neg;
+    len -= neg;
+
+    if (len == 3 && memcmp(data, "inf", 3) == 0) {
+        *out = neg ? -HUGE_VAL : HUGE_VAL;
+    } else if (len == 3 && memcmp(data, "nan", 3) == 0) {
+        *out = neg ? -NAN : NAN;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static inline variant_t * tns_parse_float(m2_arena_t * arena, variant_t * container,
+        const char * data, size_t len, int pack) {
+    number_t num;
+    double d = 0;
+
+    if (number_scan(data, data + len, &num) == data + len) {
+        d = number_to_double(&num);
+    } else {
+        check(tns_parse_nonfinite(data, len, &d), "Error parsing float");
+    }
+
+    return number_new(arena, container, m2_type_float, 0, d, pack);
+
+error:
+    return NULL;
+}
+
+static inline variant_t * tns_parse_bool(m2_arena_t * arena, variant_t * container,
+        const char * data, size_t len) {
+    int d = 0;
+    if (len == 4 && memcmp(data, "true", 4) == 0) {
+        d = 1;
+    } else {
+        check(len == 5 && memcmp(data, "false", 5) == 0, "Invalid bool value");
+    }
+
+    variant_t * val = item_new(arena, container, m2_type_boolean);
+    if (val)
+        val->value.boolean = d;
+
+    return val;
+
+error:
+    return NULL;
+}
+
+/*
+ * Creates a scalar of \a type to go in \a container, as item_new()
+ * does, or packs it into \a container as number_new() does.
+ */
+static inline variant_t * tns_parse_scalar(m2_arena_t * arena, variant_t * container,
+        char type, const char * data, size_t len, int view, int pack) {
+    switch (type) {
+        case m2_type_string:
+            return tns_parse_string(arena, container, data, len, view);
+        case m2_type_integer:
+            return tns_parse_integer(arena, container, data, len, pack);
+        case m2_type_float:
+            return tns_parse_float(arena, container, data, len, pack);
+        case m2_type_boolean:
+            return tns_parse_bool(arena, container, data, len);
+        case m2_type_null:
+            check(len == 0, "Null must be represented as '0:~'");
+            return item_new(arena, container, m2_type_null);
+        default:
+            check(0, "Invalid type");
+    }
+
+error:
+    return NULL;
+}
+
+/*
+ * Parses the TNetstring at \a data in a single pass.
+ *
+ * Nested dicts and lists are tracked on an explicit stack rather
+ * than by recursion, and every length prefix is read against the
+ * end of its enclosing container, so nothing is read twice and
+ * malformed input can't run past the buffer.
+ *
+ * Each value is attached to its container as soon as it is created,
+ * and list items are created in place, so on error only the root
+ * needs to be destroyed. If \a arena isn't NULL everything is
+ * allocated from it instead of the heap. If \a pack is set, lists of
+ * numbers are read straight into packed arrays.
+ */
+static variant_t * tns_parse(m2_arena_t * arena, const char * data,
+        size_t len, char ** rest, int view, int pack) {
+
+    tns_frame_t stack[TNS_MAX_DEPTH];
+    int depth = 0;
+    variant_t * root = NULL;
+    variant_t * item = NULL;
+    const char * p = data;
+    const char * pe = data + len;
+
+    check(data, "Data cannot be NULL");
+    check(len, "Len must be greater than 0");
+
+    do {
+        tns_frame_t * top = depth ? &stack[depth - 1] : NULL;
+        variant_t * container = top ? top->container : NULL;
+        const char * end = top ? top->end : pe;
+        const char * value = NULL;
+        const char * next = NULL;
+        size_t vallen = 0;
+        char type = 0;
+        int open = 0;
+
+        if (container && container->type == m2_type_dict) {
+            next = tns_next(p, end, &value, &vallen, &type);
+            check(next, "Error parsing key");
+            check(type == m2_type_string, "key must be a string");
+
+            top->key = value;
+            top->keylen = vallen;
+            p = next;
+        }
+
+        next = tns_next(p, end, &value, &vallen, &type);
+        check(next, "Invalid TNetstring");
+
+        if (type == m2_type_dict || type == m2_type_list) {
+            check(depth < TNS_MAX_DEPTH, "TNetstring is nested too deeply");
+
+            item = item_new(arena, container, type);
+            check_mem(item);
+
+            if (type == m2_type_dict) {
+                // Header items take 40 bytes or so, and there's no
+                // point sizing big dicts for more than the usual few.
+                item->value.dict = flatmap_create(arena,
+                        vallen / 32 < DICT_MAX_HINT ? vallen / 32 : DICT_MAX_HINT);
+                check(item->value.dict, "Error creating dict");
+            } else {
+                check(list_init(arena, item), "Error creating list");
+            }
+
+            stack[depth].container = item;
+            stack[depth].end = value + vallen;
+            open = 1;
+            p = value;
+        } else {
+            item = tns_parse_scalar(arena, container, type, value, vallen, view, pack);
+            check(item, "Error parsing item");
+            p = next;
+        }
+
+        // List items are already in place
+        if (!container) {
+            root = item;
+        } else if (container->type == m2_type_dict) {
+            check(dict_set_key(container, top->key, top->keylen, item, !view),
+                    "Error setting item");
+        }
+        item = NULL;
+
+        if (open)
+            depth++;
+
+        // Step over the type marker of every container read to the end
+        while (depth && p == stack[depth - 1].end) {
+            p++;
+            depth--;
+            if (pack) array_trim(arena, stack[depth].container);
+        }
+    } while (depth);
+
+    if (rest) {
+        *rest = (char *)p;
+    }
+
+    return root;
+
+error:
+    if (item) m2_variant_destroy(item);
+    m2_variant_destroy(root);
+    return NULL;
+}
+
+variant_t * m2_parse_tns(const char * data, size_t len, char ** rest) {
+    return tns_parse(NULL, data, len, rest, 0, 0);
+}
+
+variant_t * m2_parse_tns_view(const char * data, size_t len, char ** rest) {
+    return tns_parse(NULL, data, len, rest, 1, 0);
+}
+
+variant_t * m2_parse_tns_arena(m2_arena_t * arena, const char * data, size_t len, char ** rest) {
+    check(arena, "Invalid arena");
+
+    return tns_parse(arena, data, len, rest, 1, 0);
+
+error:
+    return NULL;
+}
+
+variant_t * m2_parse_tns_packed(m2_arena_t * arena, const char * data, size_t len, char ** rest) {
+    return tns_parse(arena, data, len, rest, arena != NULL, 1);
+}
+
+/* JSON implementation */
+
+/*
+ * Deepest nesting of objects and arrays the parser will follow.
+ */
+#define JSON_MAX_DEPTH 64
+
+/*
+ * Creates a string variant for \a container from the contents
+ * [p, pe). Short strings are unescaped into the variant. Longer ones
+ * own their bytes on the heap, and are read-only in an arena.
+ */
+static variant_t * json_parse_string(m2_arena_t * arena, variant_t * container,
+        const char * p, const char * pe, int escaped) {
+    size_t len = pe - p;
     variant_t * val = NULL;
-    json_type t = jval->type;
-    int i = 0;
-    int len = 0;
-    switch(t) {
-        case json_array:
-            val = m2_variant_list_new();
-            len = jval->u.array.length;
-            for (i = 0; i < len; i++) {
-                m2_variant_list_append(val, json_val_to_variant(jval->u.array.values[i]));
+    char * data = NULL;
+    long n = len;
+
+    check(len < (size_t)INT_MAX, "JSON string is too long");
+
+    val = item_new(arena, container, m2_type_string);
+    check_mem(val);
+
+    if (len < SMALL_STRING_SIZE) {
+        data = (char *)val->small;
+    } else {
+        // bstrlib frees and resizes strings with free() and realloc()
+        data = arena ? m2_arena_alloc(arena, len + 1) : malloc(len + 1);
+        check_mem(data);
+    }
+
+    if (escaped) {
+        n = json_unescape(p, pe, data);
+        check(n >= 0, "Invalid escape in JSON string");
+    } else {
+        memcpy(data, p, len);
+    }
+    data[n] = '\0';
+
+    blk2tbstr(val->value.string, data, n);
+    if (data == (char *)val->small) {
+        val->value.string.mlen = SMALL_STRING_MLEN;
+    } else if (!arena) {
+        val->value.string.mlen = (int)len + 1;
+    }
+
+    return val;
+
+error:
+    if (!arena && val && data != (char *)val->small) free(data);
+    m2_variant_destroy(val);
+    return NULL;
+}
+
+/*
+ * Parses the number at \a p into \a out, a new item for \a container,
+ * or packs it into \a container as number_new() does.
+ *
+ * Returns a pointer past the number or NULL on error.
+ */
+static const char * json_parse_number(m2_arena_t * arena, variant_t * container,
+        const char * p, const char * pe, variant_t ** out, int pack) {
+    number_t num;
+    long n = 0;
+
+    p = number_scan(p, pe, &num);
+    check(p, "Invalid JSON number");
+    check(*num.integer != '0' || num.integer_len == 1, "JSON numbers can't have leading zeros");
+
+    // Integers too large for a long are kept as floats
+    if (number_to_long(&num, &n)) {
+        *out = number_new(arena, container, m2_type_integer, n, 0, pack);
+    } else {
+        *out = number_new(arena, container, m2_type_float, 0, number_to_double(&num), pack);
+    }
+    check_mem(*out);
+
+    return p;
+
+error:
+    return NULL;
+}
+
+/*
+ * Reads an object key and the ':' after it.
+ *
+ * Returns a pointer to the value or NULL on error.
+ */
+static const char * json_read_key(const char * p, const char * pe,
+        const char ** key, const char ** key_end, int * escaped) {
+
+    p = json_skip_ws(p, pe);
+    check(p < pe && *p == '"', "Expected a key string");
+
+    *key = p + 1;
+    *key_end = json_string_end(*key, pe, escaped);
+    check(*key_end, "Unterminated key string");
+
+    p = json_skip_ws(*key_end + 1, pe);
+    check(p < pe && *p == ':', "Expected ':' after key");
+
+    return p + 1;
+
+error:
+    return NULL;
+}
+
+/*
+ * Adds \a item to the dict \a container under the key [key, key_end).
+ */
+static int json_add(variant_t * container, const char * key,
+        const char * key_end, int escaped, variant_t * item) {
+
+    if (!escaped)
+        return dict_set_key(container, key, key_end - key, item, 1);
+
+    char buf[256];
+    char * name = buf;
+    int rc = 0;
+
+    if ((size_t)(key_end - key) > sizeof(buf)) {
+        name = h_malloc(key_end - key);
+        check_mem(name);
+    }
+
+    long len = json_unescape(key, key_end, name);
+    check(len >= 0, "Invalid escape in JSON key");
+
+    rc = dict_set_key(container, name, len, item, 1);
+
+error:
+    if (name != buf) h_free(name);
+    return rc;
+}
+
+/*
+ * The character that closes \a container, which may have been packed
+ * since it was opened.
+ */
+static inline char json_close_char(const variant_t * container) {
+    return container->type == m2_type_dict ? '}' : ']';
+}
+
+/*
+ * Parses the JSON value at \a data in a single pass, creating the
+ * variants directly.
+ *
+ * Like tns_parse(), open objects and arrays are kept on an explicit
+ * stack and each value is attached to its container, or created in
+ * place at the end of it, as soon as it is read. Nothing past data + len is read.
+ * Lists of numbers are packed as they are read if \a pack is set.
+ */
+static variant_t * json_parse(m2_arena_t * arena, const char * data, size_t len,
+        char ** rest, int pack) {
+
+    variant_t * stack[JSON_MAX_DEPTH];
+    int depth = 0;
+    variant_t * root = NULL;
+    variant_t * item = NULL;
+    const char * p = data;
+    const char * pe = data + len;
+    const char * key = NULL;
+    const char * key_end = NULL;
+    int key_escaped = 0;
+
+    check(data, "Data cannot be NULL");
+
+    for (;;) {
+        variant_t * parent = depth ? stack[depth - 1] : NULL;
+        variant_t * container = NULL;
+        const char * end = NULL;
+        int escaped = 0;
+
+        p = json_skip_ws(p, pe);
+        check(p < pe, "Unexpected end of JSON");
+
+        switch (*p) {
+            case '{':
+                item = container = item_new(arena, parent, m2_type_dict);
+                check_mem(item);
+                item->value.dict = flatmap_create(arena, 0);
+                check(item->value.dict, "Error creating dict");
+                p++;
+                break;
+            case '[':
+                item = container = item_new(arena, parent, m2_type_list);
+                check_mem(item);
+                check(list_init(arena, item), "Error creating list");
+                p++;
+                break;
+            case '"':
+                end = json_string_end(p + 1, pe, &escaped);
+                check(end, "Unterminated JSON string");
+                item = json_parse_string(arena, parent, p + 1, end, escaped);
+                check(item, "Error parsing JSON string");
+                p = end + 1;
+                break;
+            case 't':
+                check(pe - p >= 4 && memcmp(p, "true", 4) == 0, "Invalid JSON literal");
+                item = item_new(arena, parent, m2_type_boolean);
+                check_mem(item);
+                item->value.boolean = 1;
+                p += 4;
+                break;
+            case 'f':
+                check(pe - p >= 5 && memcmp(p, "false", 5) == 0, "Invalid JSON literal");
+                item = item_new(arena, parent, m2_type_boolean);
+                check_mem(item);
+                p += 5;
+                break;
+            case 'n':
+                check(pe - p >= 4 && memcmp(p, "null", 4) == 0, "Invalid JSON literal");
+                item = item_new(arena, parent, m2_type_null);
+                check_mem(item);
+                p += 4;
+                break;
+            default:
+                p = json_parse_number(arena, parent, p, pe, &item, pack);
+                check(p, "Invalid JSON value");
+        }
+
+        // List items are already in place
+        if (!parent) {
+            root = item;
+        } else if (parent->type == m2_type_dict) {
+            check(json_add(parent, key, key_end, key_escaped, item), "Error setting item");
+        }
+        item = NULL;
+
+        if (container) {
+            check(depth < JSON_MAX_DEPTH, "JSON is nested too deeply");
+            stack[depth++] = container;
+
+            p = json_skip_ws(p, pe);
+            check(p < pe, "Unexpected end of JSON");
+
+            if (*p != json_close_char(container)) {
+                if (container->type == m2_type_dict) {
+                    p = json_read_key(p, pe, &key, &key_end, &key_escaped);
+                    check(p, "Error parsing JSON object");
+                }
+                continue;
             }
+
+            p++;
+            depth--;
+        }
+
+        // Step over the closing bracket of every container that
+        // ends here, until there is another item to read.
+        while (depth) {
+            p = json_skip_ws(p, pe);
+            check(p < pe, "Unexpected end of JSON");
+
+            if (*p == ',')
+                break;
+
+            check(*p == json_close_char(stack[depth - 1]), "Expected ',' or end of container");
+            p++;
+            depth--;
+            if (pack) array_trim(arena, stack[depth]);
+        }
+
+        if (!depth)
             break;
-        case json_boolean:
-            val = m2_variant_bool_new();
-            val->value.boolean = jval->u.boolean;
-            break;
-        case json_double:
-            val = m2_variant_float_new();
-            val->value.fpoint = jval->u.dbl;
-            break;
-        case json_integer:
-            val = m2_variant_integer_new();
-            val->value.integer = jval->u.integer;
-            break;
-        case json_none:
-        case json_null:
-            val = m2_variant_null_new();
-            break;
-        case json_object:
-            val = m2_variant_dict_new();
-            len = jval->u.object.length;
-            for (i = 0; i < len; i++) {
-                m2_variant_dict_set(val, bfromcstr(jval->u.object.values[i].name),
-                        json_val_to_variant(jval->u.object.values[i].value));
+        p++;
+
+        if (stack[depth - 1]->type == m2_type_dict) {
+            p = json_read_key(p, pe, &key, &key_end, &key_escaped);
+            check(p, "Error parsing JSON object");
+        }
+    }
+
+    p = json_skip_ws(p, pe);
+    if (rest) {
+        *rest = (char *)p;
+    } else {
+        check(p == pe, "Trailing data after JSON value");
+    }
+
+    return root;
+
+error:
+    if (item) m2_variant_destroy(item);
+    m2_variant_destroy(root);
+    return NULL;
+}
+
+variant_t * m2_parse_json(const char * data, size_t len, char ** rest) {
+    return json_parse(NULL, data, len, rest, 0);
+}
+
+variant_t * m2_parse_json_arena(m2_arena_t * arena, const char * data, size_t len, char ** rest) {
+    check(arena, "Invalid arena");
+
+    return json_parse(arena, data, len, rest, 0);
+
+error:
+    return NULL;
+}
+
+variant_t * m2_parse_json_packed(m2_arena_t * arena, const char * data, size_t len, char ** rest) {
+    return json_parse(arena, data, len, rest, 1);
+}
+
+/* Number output */
+
+/*
+ * The longest output of format_double().
+ */
+#define DOUBLE_MAX_LEN 32
+
+/*
+ * Formats \a value with the fewest decimal places, up to 15, that
+ * read back as exactly the same double. This covers most values
+ * without going through snprintf.
+ *
+ * Returns the length written, or 0 if \a value needs more digits.
+ */
+static size_t format_fixed(char * out, double value) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    };
+    double mag = value < 0 ? -value : value;
+    size_t k = 0;
+
+    if (mag < 1e-5 || mag >= 1e15)
+        return 0;
+
+    for (k = 1; k <= 15; k++) {
+        double scaled = mag * pow10[k];
+        // Past 2^53 the scaled value is no longer exact
+        if (scaled >= 9007199254740992.0)
+            return 0;
+
+        unsigned long m = (unsigned long)(scaled + 0.5);
+
+        // Both operands are exact, so the division rounds the same
+        // way as reading the decimal string back.
+        if ((double)m / pow10[k] != mag)
+            continue;
+
+        char digits[24];
+        size_t n = fmt_ulong(digits, m);
+        size_t len = 0;
+
+        if (value < 0)
+            out[len++] = '-';
+
+        if (n <= k) {
+            out[len++] = '0';
+            out[len++] = '.';
+            memset(out + len, '0', k - n);
+            len += k - n;
+            memcpy(out + len, digits, n);
+            len += n;
+        } else {
+            memcpy(out + len, digits, n - k);
+            len += n - k;
+            out[len++] = '.';
+            memcpy(out + len, digits + n - k, k);
+            len += k;
+        }
+
+        return len;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the finite double \a value with the fewest digits that read
+ * back as the same value, with a ".0" on whole numbers so they read
+ * back as floats.
+ *
+ * Returns the length written, at most DOUBLE_MAX_LEN.
+ */
+static size_t format_double(char * out, double value) {
+    size_t len = 0;
+
+    if (value > -1e15 && value < 1e15 && value == (double)(long)value
+            && (value != 0 || !signbit(value))) {
+        // Whole numbers are common and don't need snprintf
+        long n = (long)value;
+        if (n < 0) {
+            out[len++] = '-';
+            n = -n;
+        }
+        len += fmt_ulong(out + len, n);
+    } else if ((len = format_fixed(out, value)) == 0) {
+        int precision = 15;
+        for (precision = 15; precision <= 17; precision++) {
+            len = snprintf(out, DOUBLE_MAX_LEN, "%.*g", precision, value);
+            if (strtod(out, NULL) == value)
+                break;
+        }
+    }
+
+    if (!memchr(out, '.', len) && !memchr(out, 'e', len)) {
+        out[len++] = '.';
+        out[len++] = '0';
+    }
+
+    return len;
+}
+
+/* JSON output */
+
+/*
+ * The most input json_write_string() escapes per reservation, which
+ * can need up to 6 bytes of output for each byte.
+ */
+#define JSON_ESCAPE_CHUNK 1024
+
+/*
+ * Writes the string [p, p + len) as a JSON string. Writes the \a lead
+ * and \a trail characters around it too, unless they're 0.
+ */
+static int json_write_string(m2_writer_t * w, const char * p, size_t len,
+        char lead, char trail) {
+
+    static const char hex[] = "0123456789abcdef";
+    const char * pe = p + len;
+    int first = 1;
+
+    do {
+        const char * end = (size_t)(pe - p) > JSON_ESCAPE_CHUNK ? p + JSON_ESCAPE_CHUNK : pe;
+        char * out = m2_writer_reserve(w, (end - p) * 6 + 4);
+        check(out, "Error writing JSON");
+
+        char * o = out;
+        if (first) {
+            if (lead)
+                *o++ = lead;
+            *o++ = '"';
+            first = 0;
+        }
+
+        while (p < end) {
+            // Copy everything up to the next byte that needs escaping
+            size_t n = json_safe_prefix(p, end);
+            memcpy(o, p, n);
+            o += n;
+            p += n;
+            if (p == end)
+                break;
+
+            unsigned char c = *p++;
+            *o++ = '\\';
+            switch (c) {
+                case '"':  *o++ = '"';  break;
+                case '\\': *o++ = '\\'; break;
+                case '\b': *o++ = 'b';  break;
+                case '\f': *o++ = 'f';  break;
+                case '\n': *o++ = 'n';  break;
+                case '\r': *o++ = 'r';  break;
+                case '\t': *o++ = 't';  break;
+                default:
+                    memcpy(o, "u00", 3);
+                    o[3] = hex[c >> 4];
+                    o[4] = hex[c & 0xF];
+                    o += 5;
             }
-            break;
-        case json_string:
-            val = m2_variant_string_new();
-            val->value.string = bfromcstr(jval->u.string.ptr);
-            break;
+        }
+
+        if (p == pe) {
+            *o++ = '"';
+            if (trail)
+                *o++ = trail;
+        }
+
+        m2_writer_advance(w, o - out);
+    } while (p < pe);
+
+    return 1;
+
+error:
+    return 0;
+}
+
+static int json_write_integer(m2_writer_t * w, long value) {
+    char * out = m2_writer_reserve(w, 21);
+    check(out, "Error writing JSON");
+
+    size_t len = 0;
+    unsigned long n = value;
+    if (value < 0) {
+        out[len++] = '-';
+        n = 0 - n;
     }
+    len += fmt_ulong(out + len, n);
 
-    return val;
+    m2_writer_advance(w, len);
+    return 1;
+
+error:
+    return 0;
 }
 
-variant_t * m2_parse_json(const char * str) {
-    json_value * val = json_parse(str);
+static int json_write_float(m2_writer_t * w, double value) {
+    // JSON has no way to write NaN or the infinities
+    if (!isfinite(value))
+        return m2_writer_write(w, "null", 4);
 
-    void * v = (void *)json_val_to_variant(val);
+    char * out = m2_writer_reserve(w, DOUBLE_MAX_LEN);
+    check(out, "Error writing JSON");
 
-    json_value_free(val);
+    m2_writer_advance(w, format_double(out, value));
+    return 1;
 
-    return v;
+error:
+    return 0;
 }
 
-void m2_variant_dump_json(variant_t * var) {
-    int first = 0;
-    switch(var->type) {
-        case m2_type_dict:
-            printf("{ ");
-            hscan_t scan;
-            hnode_t * n;
-            hash_scan_begin(&scan, var->value.dict);
-            while ((n = hash_scan_next(&scan))) {
-                if (first) {
-                    printf(",\n");
+static int json_write(const variant_t * val, m2_writer_t * w, int depth) {
+    int first = 1;
+    int i = 0;
+
+    check(val, "Invalid variant");
+    check(depth < JSON_MAX_DEPTH, "Variant is nested too deeply");
+
+    switch (val->type) {
+        case m2_type_string:
+            return json_write_string(w, (const char *)string_data(val),
+                    val->value.string.slen, 0, 0);
+        case m2_type_integer:
+            return json_write_integer(w, val->value.integer);
+        case m2_type_float:
+            return json_write_float(w, val->value.fpoint);
+        case m2_type_boolean:
+            if (val->value.boolean)
+                return m2_writer_write(w, "true", 4);
+            return m2_writer_write(w, "false", 5);
+        case m2_type_null:
+            return m2_writer_write(w, "null", 4);
+        case m2_type_dict: {
+            check(m2_writer_write(w, "{", 1), "Error writing JSON");
+
+            for (i = 0; i < (int)flatmap_count(val->value.dict); i++) {
+                flatmap_entry_t * e = flatmap_entry(val->value.dict, i);
+
+                check(json_write_string(w, (const char *)e->key.data, e->key.slen,
+                            first ? 0 : ',', ':'), "Error writing JSON");
+                check(json_write(e->value, w, depth + 1), "Error writing JSON");
+                first = 0;
+            }
+
+            return m2_writer_write(w, "}", 1);
+        }
+        case m2_type_list:
+            check(m2_writer_write(w, "[", 1), "Error writing JSON");
+
+            for (i = 0; i < (int)val->value.list->count; i++) {
+                if (i) {
+                    check(m2_writer_write(w, ",", 1), "Error writing JSON");
                 }
-                first = 1;
-                printf("\"%s\":", ((bstring)n->hash_key)->data);
-                m2_variant_dump_json(n->hash_data);
+                check(json_write(&val->value.list->items[i], w, depth + 1), "Error writing JSON");
             }
 
-            printf(" }");
-            break;
+            return m2_writer_write(w, "]", 1);
+        case m2_type_int_array:
+        case m2_type_float_array: {
+            const int64_t * ints = (const int64_t *)val->value.list->items;
+            const double * floats = (const double *)val->value.list->items;
+
+            check(m2_writer_write(w, "[", 1), "Error writing JSON");
+
+            for (i = 0; i < (int)val->value.list->count; i++) {
+                if (i) {
+                    check(m2_writer_write(w, ",", 1), "Error writing JSON");
+                }
+                if (val->type == m2_type_int_array) {
+                    check(json_write_integer(w, ints[i]), "Error writing JSON");
+                } else {
+                    check(json_write_float(w, floats[i]), "Error writing JSON");
+                }
+            }
+
+            return m2_writer_write(w, "]", 1);
+        }
+        default:
+            check(0, "Invalid variant type");
+    }
+
+error:
+    return 0;
+}
+
+int m2_variant_write_json(const variant_t * val, m2_writer_t * w) {
+    check(w, "Invalid writer");
+
+    return json_write(val, w, 0);
+
+error:
+    return 0;
+}
+
+static int write_file(void * data, const char * buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE *)data) == len;
+}
+
+void m2_variant_dump_json(variant_t * var) {
+    m2_writer_t * w = m2_writer_new_sink(write_file, stdout, 0);
+    if (w) {
+        if (m2_variant_write_json(var, w))
+            m2_writer_flush(w);
+        m2_writer_destroy(w);
+    }
+}
+
+/* TNetstring output */
+
+/*
+ * Formats the payload of a number or boolean into \a buf.
+ *
+ * Returns the length, or -1 if \a val has no such payload.
+ */
+static int tns_format_scalar(const variant_t * val, char * buf) {
+    unsigned long n = 0;
+    size_t len = 0;
+
+    switch (val->type) {
+        case m2_type_integer:
+            n = val->value.integer;
+            if (val->value.integer < 0) {
+                buf[len++] = '-';
+                n = 0 - n;
+            }
+            return len + fmt_ulong(buf + len, n);
+        case m2_type_float:
+            if (!isfinite(val->value.fpoint))
+                return snprintf(buf, DOUBLE_MAX_LEN, "%g", val->value.fpoint);
+            return format_double(buf, val->value.fpoint);
         case m2_type_boolean:
-            if (var->value.boolean)
-                printf("true");
-            else
-                printf("false");
+            if (val->value.boolean) {
+                memcpy(buf, "true", 4);
+                return 4;
+            }
+            memcpy(buf, "false", 5);
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+static size_t tns_size(const variant_t * val, int depth) {
+    char buf[DOUBLE_MAX_LEN];
+    size_t len = 0;
+    size_t item = 0;
+    int i = 0;
+
+    check(val, "Invalid variant");
+    check(depth < TNS_MAX_DEPTH, "Variant is nested too deeply");
+
+    switch (val->type) {
+        case m2_type_string:
+            len = val->value.string.slen;
             break;
-        case m2_type_float:
-            printf("%e", var->value.fpoint);
+        case m2_type_null:
             break;
-        case m2_type_integer:
-            printf("%ld", var->value.integer);
+        case m2_type_dict:
+            for (i = 0; i < (int)flatmap_count(val->value.dict); i++) {
+                flatmap_entry_t * e = flatmap_entry(val->value.dict, i);
+
+                item = tns_size(e->value, depth + 1);
+                check(item, "Error sizing TNetstring");
+
+                len += fmt_ulong_len(e->key.slen) + e->key.slen + 2 + item;
+            }
             break;
         case m2_type_list:
-            printf("[ ");
-
-            int i = 0;
-            for (i = 0; i < var->value.list->end; i++) {
-                if (first)
-                    printf(",\n");
-                first = 1;
-                m2_variant_dump_json(darray_get(var->value.list, i));
+            for (i = 0; i < (int)val->value.list->count; i++) {
+                item = tns_size(&val->value.list->items[i], depth + 1);
+                check(item, "Error sizing TNetstring");
+
+                len += item;
             }
             break;
-        case m2_type_null:
-            printf("null");
+        case m2_type_int_array:
+        case m2_type_float_array:
+            for (i = 0; i < (int)val->value.list->count; i++) {
+                variant_t value;
+                array_get(val, i, &value);
+                len += tns_size(&value, depth + 1);
+            }
             break;
+        default:
+            i = tns_format_scalar(val, buf);
+            check(i >= 0, "Invalid variant type");
+            len = i;
+    }
+
+    // The length prefix, ':' and the type marker
+    return fmt_ulong_len(len) + len + 2;
+
+error:
+    return 0;
+}
+
+size_t m2_variant_size_tns(const variant_t * val) {
+    return tns_size(val, 0);
+}
+
+/*
+ * Writes the \a len bytes at \a data so they end at \a end, without
+ * going before \a start.
+ *
+ * Returns the start of the bytes written, or NULL if there's no room.
+ */
+static inline char * tns_prepend(char * start, char * end, const void * data, size_t len) {
+    if ((size_t)(end - start) < len)
+        return NULL;
+
+    end -= len;
+    memcpy(end, data, len);
+
+    return end;
+}
+
+/*
+ * Prepends the length prefix for a payload of \a len bytes.
+ */
+static inline char * tns_prepend_length(char * start, char * end, size_t len) {
+    size_t digits = fmt_ulong_len(len);
+
+    if ((size_t)(end - start) < digits + 1)
+        return NULL;
+
+    *--end = ':';
+    end -= digits;
+    fmt_ulong(end, len);
+
+    return end;
+}
+
+/*
+ * Encodes \a val back to front, so that it ends at \a end. Each
+ * payload is written before its length prefix, so the lengths are
+ * known by the time they're needed and nothing has to be sized
+ * first.
+ *
+ * Returns the start of the encoding, or NULL if it doesn't fit after
+ * \a start.
+ */
+static char * tns_write(const variant_t * val, char * start, char * end, int depth) {
+    char buf[DOUBLE_MAX_LEN];
+    char tag = 0;
+    int i = 0;
+
+    check(val, "Invalid variant");
+    check(depth < TNS_MAX_DEPTH, "Variant is nested too deeply");
+
+    // Packed arrays are written as plain lists
+    tag = val->type == m2_type_int_array || val->type == m2_type_float_array
+        ? m2_type_list : val->type;
+    end = tns_prepend(start, end, &tag, 1);
+    check(end, "TNetstring buffer is too small");
+
+    char * payload_end = end;
+
+    switch (val->type) {
         case m2_type_string:
-            printf("\"%s\"", var->value.string->data);
+            end = tns_prepend(start, end, string_data(val), val->value.string.slen);
             break;
-        default:
+        case m2_type_null:
+            break;
+        case m2_type_dict:
+            // Backwards, so the items come out in the order they were added
+            for (i = (int)flatmap_count(val->value.dict) - 1; end && i >= 0; i--) {
+                flatmap_entry_t * e = flatmap_entry(val->value.dict, i);
+
+                end = tns_write(e->value, start, end, depth + 1);
+                if (end) end = tns_prepend(start, end, ",", 1);
+                if (end) end = tns_prepend(start, end, e->key.data, e->key.slen);
+                if (end) end = tns_prepend_length(start, end, e->key.slen);
+            }
+            break;
+        case m2_type_list:
+            for (i = (int)val->value.list->count - 1; end && i >= 0; i--) {
+                end = tns_write(&val->value.list->items[i], start, end, depth + 1);
+            }
+            break;
+        case m2_type_int_array:
+        case m2_type_float_array:
+            for (i = (int)val->value.list->count - 1; end && i >= 0; i--) {
+                variant_t value;
+                array_get(val, i, &value);
+                end = tns_write(&value, start, end, depth + 1);
+            }
             break;
+        default:
+            i = tns_format_scalar(val, buf);
+            check(i >= 0, "Invalid variant type");
+            end = tns_prepend(start, end, buf, i);
     }
+    check(end, "TNetstring buffer is too small");
+
+    end = tns_prepend_length(start, end, payload_end - end);
+    check(end, "TNetstring buffer is too small");
+
+    return end;
+
+error:
+    return NULL;
+}
+
+size_t m2_variant_write_tns(const variant_t * val, char * out, size_t len) {
+    check(out, "Invalid buffer");
+
+    char * start = tns_write(val, out, out + len, 0);
+    check(start, "Error writing TNetstring");
+
+    return out + len - start;
+
+error:
+    return 0;
 }
@@ -14,8 +14,11 @@
 #ifndef _VARIANT_H_DEF
 #define _VARIANT_H_DEF
 
+#include <stdint.h>
 #include <stdlib.h>
 #include "bstring.h"
+#include "writer.h"
+#include "arena.h"
 
 typedef enum {
     m2_type_string  = ',',
@@ -25,12 +28,16 @@ typedef enum {
     m2_type_null    = '~',
     m2_type_dict    = '}',
     m2_type_list    = ']',
+    /// A list of integers, packed into an array of int64_t
+    m2_type_int_array   = 'I',
+    /// A list of floats, packed into an array of double
+    m2_type_float_array = 'F',
     m2_type_invalid = 'Z',
 } m2_variant_tag;
 
 typedef struct variant_s variant_t;
 
-extern inline m2_variant_tag m2_variant_type(const variant_t * val);
+m2_variant_tag m2_variant_type(const variant_t * val);
 
 variant_t * m2_variant_string_new();
 variant_t * m2_variant_integer_new();
@@ -51,15 +58,32 @@ variant_t * m2_variant_list_new();
  *
  * If the variant is a compound type (dict or list) then
  * all of the items contained will also be freed.
+ *
+ * Does nothing for variants from an arena or items of a list,
+ * which are freed along with them.
  */
 void m2_variant_destroy(variant_t * value);
 
+/**
+ * Copies \a val and everything in it to the heap, so that the
+ * copy can outlive the arena \a val came from, or be changed.
+ *
+ * @returns A new variant, or NULL on error.
+ */
+variant_t * m2_variant_clone(const variant_t * val);
+
 /**
  * Gets the string for the variant \a value.
  *
+ * Short strings are stored in the variant itself. For variants on
+ * the heap, the first call gives them a copy of their own that can
+ * be changed with bstrlib. For variants from an arena, the bstring
+ * points into the variant and is read-only, like every string in
+ * an arena.
+ *
  * @param value     A string variant.
  *
- * @returns NULL if \a value is not a string type.
+ * @returns NULL if \a value is not a string type, or on error.
  */
 bstring m2_variant_get_string(variant_t * value);
 
@@ -81,9 +105,22 @@ int m2_variant_dict_set(variant_t * val, const_bstring key, variant_t * item);
  */
 variant_t * m2_variant_dict_get(const variant_t * dict, const_bstring key);
 
+/**
+ * Gets an item from a dictionary, ignoring the case of ASCII letters
+ * in \a key. If more than one key matches, the one added last wins.
+ *
+ * This checks every key, so it is slower than m2_variant_dict_get()
+ * on large dictionaries.
+ */
+variant_t * m2_variant_dict_get_caseless(const variant_t * dict, const_bstring key);
+
 /**
  * Appends \a item to \a list
  *
+ * Lists store their items one after another, so \a item is moved
+ * into the list and can't be used afterwards. Use
+ * m2_variant_list_get() to get at it.
+ *
  * @param list  The list to append to.
  * @param item  The item to append.
  *
@@ -91,6 +128,69 @@ variant_t * m2_variant_dict_get(const variant_t * dict, const_bstring key);
  */
 int m2_variant_list_append(variant_t * list, variant_t * item);
 
+/**
+ * Gets the number of items in \a list, which can also be a packed
+ * array.
+ *
+ * @returns The length, or 0 if \a list is not a list.
+ */
+size_t m2_variant_list_length(const variant_t * list);
+
+/**
+ * Gets the item at \a index in \a list.
+ *
+ * The item belongs to the list, and may move when anything else is
+ * appended to it.
+ *
+ * @returns The item, or NULL if \a list is not a list or \a index
+ *          is out of range. Packed arrays have no item variants, so
+ *          this also returns NULL for them.
+ */
+variant_t * m2_variant_list_get(const variant_t * list, size_t index);
+
+/**
+ * Packs the lists in \a val, and in everything it holds, that are
+ * all integers or all floats.
+ *
+ * Packed lists become arrays of type m2_type_int_array or
+ * m2_type_float_array, which keep the values one after another
+ * instead of a variant for each, and are read with
+ * m2_variant_get_int_array() and m2_variant_get_float_array().
+ * They can't be appended to or read with m2_variant_list_get(). Lists
+ * that mix integers and floats, or hold anything else, are left as
+ * they are.
+ *
+ * m2_parse_tns_packed() and m2_parse_json_packed() pack lists as they
+ * read them, without a variant for each value, so this is for values
+ * from elsewhere. Variants from an arena can be packed too, but their
+ * arrays keep their memory until the arena is reset.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_variant_pack(variant_t * val);
+
+/**
+ * Gets the values of a packed integer array.
+ *
+ * @param val   An integer array.
+ * @param len   Set to the number of values.
+ *
+ * @returns The values, or NULL if \a val is not an integer array.
+ *          They belong to \a val.
+ */
+const int64_t * m2_variant_get_int_array(const variant_t * val, size_t * len);
+
+/**
+ * Gets the values of a packed float array.
+ *
+ * @param val   A float array.
+ * @param len   Set to the number of values.
+ *
+ * @returns The values, or NULL if \a val is not a float array. They
+ *          belong to \a val.
+ */
+const double * m2_variant_get_float_array(const variant_t * val, size_t * len);
+
 // Parsing functions
 
 /**
@@ -106,9 +206,118 @@ int m2_variant_list_append(variant_t * list, variant_t * item);
  */
 variant_t * m2_parse_tns(const char * data, size_t len, char ** rest);
 
-variant_t * m2_parse_json(const char * data);
+/**
+ * Parses a TNetstring like m2_parse_tns(), but without copying
+ * any strings.
+ *
+ * The string values and dictionary keys are read-only bstrings
+ * that point into \a data, so \a data must not change or be freed
+ * until the returned variant has been destroyed. They are not
+ * NUL-terminated.
+ *
+ * @param       data      The data to parse
+ * @param       len       The length of the data to parse
+ * @param[out]  rest      A pointer to be filled with the location
+ *                        of the first character after the parsed
+ *                        range. Can be set to null to ignore.
+ */
+variant_t * m2_parse_tns_view(const char * data, size_t len, char ** rest);
+
+/**
+ * Parses a TNetstring like m2_parse_tns_view(), but allocates
+ * everything from \a arena.
+ *
+ * The result is freed when the arena is reset or destroyed. It
+ * can't be changed, and the containers in it can only hold
+ * variants from the same arena. Use m2_variant_clone() to get
+ * a copy that can.
+ */
+variant_t * m2_parse_tns_arena(m2_arena_t * arena, const char * data, size_t len, char ** rest);
+
+/**
+ * Parses a TNetstring like m2_parse_tns(), or m2_parse_tns_arena()
+ * if \a arena isn't NULL, but reads every non-empty list of nothing
+ * but integers, or nothing but floats, into a packed array as
+ * m2_variant_pack() would make. The values go straight into the
+ * array, and a list is only turned back into variants if an item
+ * that doesn't belong in the array follows them.
+ */
+variant_t * m2_parse_tns_packed(m2_arena_t * arena, const char * data, size_t len, char ** rest);
+
+/**
+ * Parses a JSON value and returns the variant value for it.
+ * Sets \a rest to the first character after the value and any
+ * whitespace following it. If \a rest is NULL, anything but
+ * whitespace after the value is an error.
+ *
+ * Only the \a len bytes at \a data are read, so the input does
+ * not need to be NUL-terminated. Strings are decoded into bstrings
+ * the variants own. Integers that don't fit in a long become floats.
+ *
+ * @param       data      The data to parse
+ * @param       len       The length of the data to parse
+ * @param[out]  rest      A pointer to be filled with the location
+ *                        of the first character after the parsed
+ *                        range. Can be set to null if the value
+ *                        should be all of \a data.
+ */
+variant_t * m2_parse_json(const char * data, size_t len, char ** rest);
+
+/**
+ * Parses a JSON value like m2_parse_json(), but allocates
+ * everything from \a arena, as m2_parse_tns_arena() does.
+ */
+variant_t * m2_parse_json_arena(m2_arena_t * arena, const char * data, size_t len, char ** rest);
+
+/**
+ * Parses a JSON value like m2_parse_json(), or m2_parse_json_arena()
+ * if \a arena isn't NULL, but packs lists of numbers as
+ * m2_parse_tns_packed() does.
+ */
+variant_t * m2_parse_json_packed(m2_arena_t * arena, const char * data, size_t len, char ** rest);
 
 // Dumping functions
+
+/**
+ * Writes \a val to \a w as JSON.
+ *
+ * Strings are escaped as needed, but are otherwise written as
+ * they are, so they should be UTF-8. Floats are written with the
+ * fewest digits that read back as the same value, and NaN and the
+ * infinities are written as null.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_variant_write_json(const variant_t * val, m2_writer_t * w);
+
+/**
+ * Gets the exact number of bytes \a val takes as a TNetstring.
+ *
+ * @returns The size, or 0 on error.
+ */
+size_t m2_variant_size_tns(const variant_t * val);
+
+/**
+ * Encodes \a val as a TNetstring that ends at \a out + \a len.
+ *
+ * The encoding is written back to front, so it fills \a out
+ * exactly when \a len is m2_variant_size_tns(). A larger buffer
+ * also works, and the encoding then starts at
+ * \a out + \a len - the returned size.
+ *
+ * @param val   The value to encode.
+ * @param out   The buffer to write to.
+ * @param len   The size of the buffer.
+ *
+ * @returns The number of bytes written, or 0 if \a val is
+ *          invalid or doesn't fit, in which case the contents
+ *          of \a out are undefined.
+ */
+size_t m2_variant_write_tns(const variant_t * val, char * out, size_t len);
+
+/**
+ * Writes \a val to stdout as JSON.
+ */
 void m2_variant_dump_json(variant_t * val);
 
 #endif//_VARIANT_H_DEF
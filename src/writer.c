@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <string.h>
+
+#include "mem/halloc.h"
+#include "err.h"
+
+#include "writer.h"
+
+#define WRITER_DEFAULT_SIZE 4096
+
+struct writer {
+    char * buf;
+    size_t len;
+    size_t max;
+    /// Where the output goes when the buffer fills, or NULL to grow it
+    m2_write_fn fn;
+    void * data;
+};
+
+m2_writer_t * m2_writer_new_sink(m2_write_fn fn, void * data, size_t size) {
+    m2_writer_t * w = h_malloc(sizeof(*w));
+    check_mem(w);
+
+    w->len = 0;
+    w->max = size ? size : WRITER_DEFAULT_SIZE;
+    w->fn = fn;
+    w->data = data;
+
+    w->buf = h_malloc(w->max);
+    check_mem(w->buf);
+    hattach(w->buf, w);
+
+    return w;
+
+error:
+    if (w) h_free(w);
+    return NULL;
+}
+
+m2_writer_t * m2_writer_new(size_t size) {
+    return m2_writer_new_sink(NULL, NULL, size);
+}
+
+void m2_writer_destroy(m2_writer_t * w) {
+    if (w) {
+        h_free(w);
+    }
+}
+
+int m2_writer_flush(m2_writer_t * w) {
+    check(w, "Invalid writer");
+
+    if (w->fn && w->len) {
+        check(w->fn(w->data, w->buf, w->len), "Error writing output");
+        w->len = 0;
+    }
+
+    return 1;
+
+error:
+    return 0;
+}
+
+/*
+ * Makes room for \a len bytes once the buffer is full.
+ */
+static char * writer_grow(m2_writer_t * w, size_t len) {
+    check(w, "Invalid writer");
+
+    // Sinks only grow when a single reservation doesn't fit
+    if (w->fn) {
+        check(m2_writer_flush(w), "Error flushing writer");
+        if (w->max >= len)
+            return w->buf;
+    }
+
+    size_t max = w->max * 2;
+    if (max - w->len < len)
+        max = w->len + len;
+
+    char * buf = h_realloc(w->buf, max);
+    check_mem(buf);
+
+    w->buf = buf;
+    w->max = max;
+
+    return w->buf + w->len;
+
+error:
+    return NULL;
+}
+
+char * m2_writer_reserve(m2_writer_t * w, size_t len) {
+    if (w && w->max - w->len >= len)
+        return w->buf + w->len;
+
+    return writer_grow(w, len);
+}
+
+void m2_writer_advance(m2_writer_t * w, size_t len) {
+    assert(w->max - w->len >= len);
+    w->len += len;
+}
+
+int m2_writer_write(m2_writer_t * w, const void * data, size_t len) {
+    const char * p = data;
+
+    if (w && w->max - w->len >= len) {
+        memcpy(w->buf + w->len, p, len);
+        w->len += len;
+        return 1;
+    }
+
+    check(w, "Invalid writer");
+
+    // Large writes to a sink go out through the buffer in pieces
+    // rather than growing it.
+    while (w->fn && len > w->max - w->len) {
+        size_t n = w->max - w->len;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+        check(m2_writer_flush(w), "Error flushing writer");
+    }
+
+    char * out = m2_writer_reserve(w, len);
+    check(out, "Error writing output");
+
+    memcpy(out, p, len);
+    w->len += len;
+
+    return 1;
+
+error:
+    return 0;
+}
+
+const char * m2_writer_data(const m2_writer_t * w, size_t * len) {
+    check(w, "Invalid writer");
+
+    *len = w->len;
+    return w->buf;
+
+error:
+    *len = 0;
+    return NULL;
+}
+
+void m2_writer_reset(m2_writer_t * w) {
+    if (w) {
+        w->len = 0;
+    }
+}
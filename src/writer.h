@@ -0,0 +1,100 @@
+/**
+ * @file writer.h
+ *
+ * Output buffers for the serializers.
+ *
+ * A writer either collects everything written to it in a growable
+ * buffer, or passes it on to a callback in large chunks.
+ */
+#ifndef _WRITER_H_DEF
+#define _WRITER_H_DEF
+
+#include <stddef.h>
+
+typedef struct writer m2_writer_t;
+
+/**
+ * Receives output from a writer.
+ *
+ * @param data  The data passed to m2_writer_new_sink().
+ * @param buf   The bytes written.
+ * @param len   The number of bytes written.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+typedef int (*m2_write_fn)(void * data, const char * buf, size_t len);
+
+/**
+ * Creates a writer that collects its output in a buffer, which
+ * grows as needed.
+ *
+ * @param size      The initial size of the buffer, or 0 for
+ *                  a default.
+ *
+ * @returns A new writer, or NULL on error.
+ */
+m2_writer_t * m2_writer_new(size_t size);
+
+/**
+ * Creates a writer that passes its output to \a fn whenever its
+ * buffer fills up, and when m2_writer_flush() is called.
+ *
+ * @param fn        The function to pass the output to.
+ * @param data      Passed to \a fn.
+ * @param size      The size of the buffer, or 0 for a default.
+ *
+ * @returns A new writer, or NULL on error.
+ */
+m2_writer_t * m2_writer_new_sink(m2_write_fn fn, void * data, size_t size);
+
+/**
+ * Frees a writer, without flushing it.
+ */
+void m2_writer_destroy(m2_writer_t * w);
+
+/**
+ * Writes \a len bytes from \a data.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_writer_write(m2_writer_t * w, const void * data, size_t len);
+
+/**
+ * Gets room to write at least \a len bytes directly into the
+ * buffer. Call m2_writer_advance() with the number actually
+ * written before using the writer again.
+ *
+ * @returns A pointer to the free space, or NULL on error.
+ */
+char * m2_writer_reserve(m2_writer_t * w, size_t len);
+
+/**
+ * Marks \a len bytes written after m2_writer_reserve().
+ */
+void m2_writer_advance(m2_writer_t * w, size_t len);
+
+/**
+ * Passes any buffered output to the callback of a sink writer.
+ * Does nothing for buffer writers.
+ *
+ * @returns 0 on error, non-zero on success.
+ */
+int m2_writer_flush(m2_writer_t * w);
+
+/**
+ * Gets the output collected so far. For sink writers this is
+ * only what hasn't been flushed yet.
+ *
+ * @param[out] len  Set to the number of bytes.
+ *
+ * @returns The output, which is not NUL-terminated. Only valid
+ *          until the writer is used again.
+ */
+const char * m2_writer_data(const m2_writer_t * w, size_t * len);
+
+/**
+ * Discards the output collected so far, keeping the buffer.
+ */
+void m2_writer_reset(m2_writer_t * w);
+
+#endif//_WRITER_H_DEF
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "err.h"
+#include "variant.h"
+
+#include "test.h"
+
+/*
+ * Fills \a len bytes with a pattern that starts from \a seed.
+ */
+static void fill(unsigned char * p, size_t len, unsigned char seed) {
+    size_t i = 0;
+
+    for (i = 0; i < len; i++)
+        p[i] = (unsigned char)(seed + i);
+}
+
+static int holds(const unsigned char * p, size_t len, unsigned char seed) {
+    size_t i = 0;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] != (unsigned char)(seed + i))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int test_alloc(void) {
+    unsigned char * blocks[200];
+    size_t sizes[200];
+    m2_arena_t * arena = m2_arena_new(0);
+    int i = 0;
+
+    test_check(arena);
+    test_check(m2_arena_used(arena) == 0);
+
+    // Sizes from 1 byte to past the default chunk size, so some get
+    // chunks of their own
+    for (i = 0; i < 200; i++) {
+        sizes[i] = (i * 37) % 5000 + 1;
+        blocks[i] = m2_arena_alloc(arena, sizes[i]);
+        test_check(blocks[i]);
+        test_check(((uintptr_t)blocks[i] & 7) == 0);
+        fill(blocks[i], sizes[i], (unsigned char)i);
+    }
+
+    // Nothing overlaps
+    for (i = 0; i < 200; i++)
+        test_check(holds(blocks[i], sizes[i], (unsigned char)i));
+
+    test_check(m2_arena_used(arena) >= 200);
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_reset(void) {
+    m2_arena_t * arena = m2_arena_new(64);
+    int round = 0;
+    int i = 0;
+
+    for (round = 0; round < 5; round++) {
+        for (i = 0; i < 1000; i++) {
+            unsigned char * p = m2_arena_alloc(arena, 24);
+            test_check(p);
+            fill(p, 24, (unsigned char)i);
+        }
+        test_check(m2_arena_used(arena) >= 24000);
+
+        m2_arena_reset(arena);
+        test_check(m2_arena_used(arena) == 0);
+    }
+
+    // Resetting an arena that was never used does nothing
+    m2_arena_t * empty = m2_arena_new(0);
+    m2_arena_reset(empty);
+    test_check(m2_arena_used(empty) == 0);
+    test_check(m2_arena_alloc(empty, 8));
+
+    // Resetting keeps an error set before it, for error paths that
+    // give back what they used
+    m2_set_errno(-1);
+    m2_arena_reset(arena);
+    test_check(m2_errno() == -1);
+
+    m2_arena_destroy(empty);
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_large_first(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+
+    // A large first allocation gets its own chunk, which is full
+    unsigned char * big = m2_arena_alloc(arena, 1 << 20);
+    test_check(big);
+    fill(big, 1 << 20, 5);
+
+    unsigned char * small = m2_arena_alloc(arena, 40);
+    test_check(small);
+    fill(small, 40, 9);
+    test_check(holds(big, 1 << 20, 5));
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_realloc_top(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+
+    // NULL allocates
+    unsigned char * p = m2_arena_realloc(arena, NULL, 0, 16);
+    test_check(p);
+    fill(p, 16, 1);
+
+    // The latest allocation grows and shrinks where it is
+    unsigned char * q = m2_arena_realloc(arena, p, 16, 64);
+    test_check(q == p && holds(q, 16, 1));
+    size_t used = m2_arena_used(arena);
+    q = m2_arena_realloc(arena, q, 64, 32);
+    test_check(q == p && m2_arena_used(arena) == used - 32);
+
+    // Once something follows it, shrinking keeps it where it is and
+    // growing moves it
+    test_check(m2_arena_alloc(arena, 8));
+    test_check(m2_arena_realloc(arena, q, 32, 16) == q);
+    fill(q, 32, 7);
+    unsigned char * moved = m2_arena_realloc(arena, q, 32, 100);
+    test_check(moved && moved != q && holds(moved, 32, 7));
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_realloc_grow(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+    size_t len = 8;
+    int i = 0;
+
+    // Doubling from 8 bytes to 8MB, past the chunk size into chunks of
+    // its own
+    unsigned char * p = m2_arena_alloc(arena, len);
+    fill(p, len, 3);
+    for (i = 0; i < 20; i++) {
+        unsigned char * q = m2_arena_realloc(arena, p, len, len * 2);
+        test_check(q && holds(q, len, 3));
+        p = q;
+        len *= 2;
+        fill(p, len, 3);
+    }
+
+    // Small allocations in between don't touch it
+    for (i = 0; i < 100; i++) {
+        void * x = m2_arena_alloc(arena, 24);
+        test_check(x);
+        memset(x, 0xAB, 24);
+    }
+    test_check(holds(p, len, 3));
+
+    unsigned char * q = m2_arena_realloc(arena, p, len, len / 4);
+    test_check(q && holds(q, len / 4, 3));
+
+    m2_arena_reset(arena);
+    test_check(m2_arena_used(arena) == 0);
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+/*
+ * A large allocation that is the arena's only chunk changes size
+ * with it.
+ */
+static int test_realloc_only_chunk(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+
+    unsigned char * p = m2_arena_alloc(arena, 1 << 20);
+    test_check(p);
+    fill(p, 1 << 20, 9);
+
+    p = m2_arena_realloc(arena, p, 1 << 20, 1 << 21);
+    test_check(p && holds(p, 1 << 20, 9));
+    p = m2_arena_realloc(arena, p, 1 << 21, 1 << 10);
+    test_check(p && holds(p, 1 << 10, 9));
+
+    void * x = m2_arena_alloc(arena, 40);
+    test_check(x);
+    memset(x, 1, 40);
+    test_check(holds(p, 1 << 10, 9));
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+/*
+ * Variants parsed into an arena are freed with it, over and over.
+ */
+static int test_parse(void) {
+    const char * in = "{\"a\":[1,2,{\"b\":\"a string too long to be short\"}],\"c\":null}";
+    m2_arena_t * arena = m2_arena_new(0);
+    struct tagbstring a = bsStatic("a");
+    int i = 0;
+
+    for (i = 0; i < 100; i++) {
+        variant_t * val = m2_parse_json_arena(arena, in, strlen(in), NULL);
+        test_check(val);
+        test_check(m2_variant_list_length(m2_variant_dict_get(val, &a)) == 3);
+        test_check(m2_arena_used(arena) > 0);
+
+        m2_arena_reset(arena);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+int main(void) {
+    test_run(test_alloc);
+    test_run(test_reset);
+    test_run(test_large_first);
+    test_run(test_realloc_top);
+    test_run(test_realloc_grow);
+    test_run(test_realloc_only_chunk);
+    test_run(test_parse);
+
+    return test_result();
+}
@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "flatmap.h"
+#include "variant.h"
+
+#include "test.h"
+
+#define MANY 10000
+
+static char keys[MANY][16];
+static size_t key_lens[MANY];
+
+static void make_keys(void) {
+    int i = 0;
+
+    for (i = 0; i < MANY; i++)
+        key_lens[i] = sprintf(keys[i], "key-%d", i);
+}
+
+static void * value_of(int i) {
+    return (void *)(uintptr_t)(i + 1);
+}
+
+/*
+ * Adds the first \a n keys to \a map, checking after each one that
+ * every key so far can be found, until the map is past the point
+ * where it builds its index.
+ */
+static int fill(flatmap_t * map, int n, int copy) {
+    void * old = NULL;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < n; i++) {
+        test_check(flatmap_set(map, keys[i], key_lens[i], value_of(i), copy, &old));
+        test_check(old == NULL);
+        test_check(flatmap_count(map) == (uint32_t)i + 1);
+
+        if (i <= FLATMAP_SCAN_MAX * 2) {
+            for (j = 0; j <= i; j++) {
+                flatmap_entry_t * e = flatmap_find(map, keys[j], key_lens[j]);
+                test_check(e && e->value == value_of(j));
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Checks that the first \a n keys are found with their values and in
+ * the order they were added, and that others aren't found.
+ */
+static int holds(const flatmap_t * map, int n) {
+    char missing[32];
+    int i = 0;
+
+    test_check(flatmap_count(map) == (uint32_t)n);
+
+    for (i = 0; i < n; i++) {
+        flatmap_entry_t * e = flatmap_find(map, keys[i], key_lens[i]);
+        test_check(e && e->value == value_of(i));
+        test_check(flatmap_entry(map, i) == e);
+        test_check((size_t)e->key.slen == key_lens[i] && memcmp(e->key.data, keys[i], key_lens[i]) == 0);
+    }
+
+    for (i = n; i < n + 100; i++) {
+        int len = sprintf(missing, "key-%d", i);
+        test_check(flatmap_find(map, missing, len) == NULL);
+    }
+
+    // Prefixes and extensions of keys that are there
+    test_check(flatmap_find(map, "key-", 4) == NULL);
+    test_check(flatmap_find(map, "key-0x", 6) == NULL);
+    test_check(flatmap_find(map, "", 0) == NULL);
+
+    return 1;
+}
+
+static int test_small(void) {
+    flatmap_t * map = flatmap_create(NULL, 0);
+
+    test_check(map);
+    test_check(flatmap_count(map) == 0);
+    test_check(flatmap_find(map, "key-0", 5) == NULL);
+
+    test_check(fill(map, FLATMAP_SCAN_MAX, 0));
+    test_check(holds(map, FLATMAP_SCAN_MAX));
+
+    flatmap_destroy(map);
+    return 1;
+}
+
+static int test_grow(void) {
+    int hints[] = { 0, 1, FLATMAP_SCAN_MAX, FLATMAP_SCAN_MAX + 1, MANY };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+        flatmap_t * map = flatmap_create(NULL, hints[i]);
+        test_check(map);
+
+        test_check(fill(map, MANY, 0));
+        test_check(holds(map, MANY));
+
+        flatmap_destroy(map);
+    }
+
+    return 1;
+}
+
+static int test_arena(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+    int round = 0;
+
+    for (round = 0; round < 3; round++) {
+        flatmap_t * map = flatmap_create(arena, 4);
+        test_check(map);
+
+        test_check(fill(map, MANY, round & 1));
+        test_check(holds(map, MANY));
+
+        // Does nothing for maps in an arena
+        flatmap_destroy(map);
+        m2_arena_reset(arena);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_overwrite(void) {
+    flatmap_t * map = flatmap_create(NULL, 0);
+    void * old = NULL;
+    int i = 0;
+
+    test_check(fill(map, 100, 0));
+
+    // Setting a key again replaces its value in place
+    for (i = 0; i < 100; i += 3) {
+        test_check(flatmap_set(map, keys[i], key_lens[i], value_of(i + 1000), 0, &old));
+        test_check(old == value_of(i));
+    }
+    test_check(flatmap_count(map) == 100);
+
+    for (i = 0; i < 100; i++) {
+        flatmap_entry_t * e = flatmap_find(map, keys[i], key_lens[i]);
+        test_check(e == flatmap_entry(map, i));
+        test_check(e->value == value_of(i % 3 ? i : i + 1000));
+    }
+
+    flatmap_destroy(map);
+    return 1;
+}
+
+static int test_copied_keys(void) {
+    flatmap_t * copied = flatmap_create(NULL, 0);
+    flatmap_t * shared = flatmap_create(NULL, 0);
+    char key[] = "changing";
+    void * old = NULL;
+
+    test_check(flatmap_set(copied, key, 8, value_of(1), 1, &old));
+    test_check(flatmap_set(shared, key, 8, value_of(1), 0, &old));
+
+    // A copied key doesn't see later changes to the bytes it came from
+    key[0] = 'C';
+    test_check(flatmap_find(copied, "changing", 8) != NULL);
+    test_check(flatmap_entry(shared, 0)->key.data[0] == 'C');
+
+    flatmap_destroy(copied);
+    flatmap_destroy(shared);
+    return 1;
+}
+
+static int test_binary_keys(void) {
+    flatmap_t * map = flatmap_create(NULL, 0);
+    const char key[] = { 'a', '\0', 'b' };
+    void * old = NULL;
+
+    test_check(flatmap_set(map, "", 0, value_of(0), 0, &old));
+    test_check(flatmap_set(map, key, 1, value_of(1), 0, &old));
+    test_check(flatmap_set(map, key, 3, value_of(3), 0, &old));
+
+    test_check(flatmap_find(map, "", 0)->value == value_of(0));
+    test_check(flatmap_find(map, key, 1)->value == value_of(1));
+    test_check(flatmap_find(map, key, 3)->value == value_of(3));
+    test_check(flatmap_find(map, key, 2) == NULL);
+
+    flatmap_destroy(map);
+    return 1;
+}
+
+/*
+ * Dicts are built on the map, and free the values they replace.
+ */
+static int test_dict(void) {
+    struct tagbstring name = bsStatic("Content-Type");
+    struct tagbstring lower = bsStatic("content-type");
+    variant_t * dict = m2_variant_dict_new();
+    char key[32];
+    int i = 0;
+
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "header-%d", i % 50);
+        variant_t * val = m2_parse_tns("25:a value that is not short,", 29, NULL);
+        test_check(m2_variant_dict_set(dict, bfromcstr(key), val));
+    }
+    test_check(m2_variant_dict_set(dict, bfromcstr("Content-Type"), m2_variant_null_new()));
+
+    test_check(m2_variant_dict_get(dict, &name) != NULL);
+    test_check(m2_variant_dict_get(dict, &lower) == NULL);
+    test_check(m2_variant_dict_get_caseless(dict, &lower) == m2_variant_dict_get(dict, &name));
+    test_check(m2_variant_size_tns(dict) > 50 * 29);
+
+    m2_variant_destroy(dict);
+    return 1;
+}
+
+int main(void) {
+    make_keys();
+
+    test_run(test_small);
+    test_run(test_grow);
+    test_run(test_arena);
+    test_run(test_overwrite);
+    test_run(test_copied_keys);
+    test_run(test_binary_keys);
+    test_run(test_dict);
+
+    return test_result();
+}
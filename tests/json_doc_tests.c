@@ -0,0 +1,200 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json_doc.h"
+
+#include "test.h"
+
+static m2_json_doc_t * doc_of(const char * data) {
+    return m2_json_doc(data, strlen(data));
+}
+
+static int test_fields(void) {
+    const char * in = "{\"a\": 1, \"b\": -2.5, \"c\": true, \"d\": \"x\\ny\","
+        " \"e\": null, \"f\": [], \"g\": {\"h\": 3}, \"a\": 9}";
+    struct tagbstring a = bsStatic("a");
+    struct tagbstring b = bsStatic("b");
+    struct tagbstring c = bsStatic("c");
+    struct tagbstring d = bsStatic("d");
+    struct tagbstring e = bsStatic("e");
+    struct tagbstring f = bsStatic("f");
+    struct tagbstring g = bsStatic("g");
+    struct tagbstring h = bsStatic("h");
+    struct tagbstring missing = bsStatic("missing");
+    m2_json_value_t val;
+    m2_json_value_t inner;
+    double num = 0;
+    long n = 0;
+    int flag = 0;
+
+    m2_json_doc_t * doc = doc_of(in);
+    test_check(doc);
+    m2_json_value_t root = m2_json_doc_root(doc);
+    test_check(m2_json_type(root) == m2_type_dict);
+
+    // The first of a repeated field is used
+    test_check(m2_json_find_field(root, &a, &val));
+    test_check(m2_json_type(val) == m2_type_integer);
+    test_check(m2_json_get_int(val, &n) && n == 1);
+
+    test_check(m2_json_find_field(root, &b, &val));
+    test_check(m2_json_type(val) == m2_type_float);
+    test_check(m2_json_get_double(val, &num) && num == -2.5);
+    test_check(!m2_json_get_int(val, &n));
+
+    test_check(m2_json_find_field(root, &c, &val));
+    test_check(m2_json_get_bool(val, &flag) && flag);
+
+    test_check(m2_json_find_field(root, &d, &val));
+    bstring str = m2_json_get_string(val);
+    test_check(str && biseqcstr(str, "x\ny") == 1);
+    bdestroy(str);
+
+    test_check(m2_json_find_field(root, &e, &val));
+    test_check(m2_json_type(val) == m2_type_null);
+
+    test_check(m2_json_find_field(root, &f, &val));
+    test_check(m2_json_type(val) == m2_type_list);
+    test_check(!m2_json_array_get(val, 0, &inner));
+
+    test_check(m2_json_find_field(root, &g, &val));
+    test_check(m2_json_find_field(val, &h, &inner));
+    test_check(m2_json_get_int(inner, &n) && n == 3);
+
+    test_check(!m2_json_find_field(root, &missing, &val));
+    test_check(!m2_json_find_field(inner, &a, &val));
+
+    m2_json_doc_destroy(doc);
+    return 1;
+}
+
+static int test_arrays(void) {
+    m2_json_value_t val;
+    long n = 0;
+    size_t i = 0;
+
+    m2_json_doc_t * doc = doc_of("[0, [1, 2], {\"k\": [3]}, 4]");
+    test_check(doc);
+    m2_json_value_t root = m2_json_doc_root(doc);
+
+    // Nested values are skipped over to reach later items
+    test_check(m2_json_array_get(root, 3, &val));
+    test_check(m2_json_get_int(val, &n) && n == 4);
+    test_check(!m2_json_array_get(root, 4, &val));
+
+    for (i = 0; i < 4; i++)
+        test_check(m2_json_array_get(root, i, &val));
+
+    m2_json_doc_destroy(doc);
+    return 1;
+}
+
+static int test_numbers(void) {
+    m2_json_value_t root;
+    double num = 0;
+    long n = 0;
+
+    m2_json_doc_t * doc = doc_of("-9223372036854775808");
+    root = m2_json_doc_root(doc);
+    test_check(m2_json_get_int(root, &n) && n == (-9223372036854775807L - 1));
+    m2_json_doc_destroy(doc);
+
+    // Too big for a long, but still a number
+    doc = doc_of("9223372036854775808");
+    root = m2_json_doc_root(doc);
+    test_check(!m2_json_get_int(root, &n));
+    test_check(m2_json_get_double(root, &num) && num == 9223372036854775808.0);
+    m2_json_doc_destroy(doc);
+
+    doc = doc_of("1e400");
+    root = m2_json_doc_root(doc);
+    test_check(m2_json_type(root) == m2_type_float);
+    test_check(m2_json_get_double(root, &num) && isinf(num));
+    m2_json_doc_destroy(doc);
+
+    return 1;
+}
+
+/*
+ * Scalars are only checked when they are read, so a document with
+ * a malformed one is still indexed.
+ */
+static int test_lazy_scalars(void) {
+    const char * in = "{\"a\": foo, \"b\": [01x, 2], \"c\": \"x\\qy\"}";
+    struct tagbstring a = bsStatic("a");
+    struct tagbstring b = bsStatic("b");
+    struct tagbstring c = bsStatic("c");
+    m2_json_value_t val;
+    m2_json_value_t item;
+    long n = 0;
+
+    m2_json_doc_t * doc = doc_of(in);
+    test_check(doc);
+    m2_json_value_t root = m2_json_doc_root(doc);
+
+    test_check(m2_json_find_field(root, &a, &val));
+    test_check(m2_json_type(val) == m2_type_invalid);
+    test_check(!m2_json_get_int(val, &n));
+
+    test_check(m2_json_find_field(root, &b, &val));
+    test_check(m2_json_array_get(val, 0, &item));
+    test_check(m2_json_type(item) == m2_type_invalid);
+    test_check(m2_json_array_get(val, 1, &item));
+    test_check(m2_json_get_int(item, &n) && n == 2);
+
+    test_check(m2_json_find_field(root, &c, &val));
+    test_check(m2_json_get_string(val) == NULL);
+
+    m2_json_doc_destroy(doc);
+    return 1;
+}
+
+static int test_invalid(void) {
+    test_check(doc_of("") == NULL);
+    test_check(doc_of("[1,]") == NULL);
+    test_check(doc_of("{\"a\" 1}") == NULL);
+    test_check(doc_of("{\"a\":1,}") == NULL);
+    test_check(doc_of("[1 2]") == NULL);
+    test_check(doc_of("[}") == NULL);
+    test_check(doc_of("[\"abc]") == NULL);
+    test_check(doc_of("[1] [2]") == NULL);
+
+    return 1;
+}
+
+static int test_large(void) {
+    static char in[1 << 20];
+    struct tagbstring k = bsStatic("k");
+    m2_json_value_t item;
+    m2_json_value_t val;
+    char * p = in;
+    long n = 0;
+    int i = 0;
+
+    *p++ = '[';
+    for (i = 0; i < 50000; i++)
+        p += sprintf(p, "%s{\"k\":%d}", i ? "," : "", i);
+    *p++ = ']';
+
+    m2_json_doc_t * doc = m2_json_doc(in, p - in);
+    test_check(doc);
+    test_check(m2_json_array_get(m2_json_doc_root(doc), 49999, &item));
+    test_check(m2_json_find_field(item, &k, &val));
+    test_check(m2_json_get_int(val, &n) && n == 49999);
+    test_check(!m2_json_array_get(m2_json_doc_root(doc), 50000, &item));
+
+    m2_json_doc_destroy(doc);
+    return 1;
+}
+
+int main(void) {
+    test_run(test_fields);
+    test_run(test_arrays);
+    test_run(test_numbers);
+    test_run(test_lazy_scalars);
+    test_run(test_invalid);
+    test_run(test_large);
+
+    return test_result();
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "variant.h"
+#include "writer.h"
+
+#include "test.h"
+
+/*
+ * Checks that \a in parses with both parsers, using all of it, and
+ * is written back as \a out.
+ */
+static int writes_as(const char * in, const char * out) {
+    size_t len = strlen(in);
+    int arena_mode = 0;
+
+    for (arena_mode = 0; arena_mode < 2; arena_mode++) {
+        m2_arena_t * arena = m2_arena_new(0);
+        m2_writer_t * w = m2_writer_new(0);
+        char * rest = NULL;
+        size_t out_len = 0;
+
+        variant_t * val = arena_mode
+            ? m2_parse_json_arena(arena, in, len, &rest)
+            : m2_parse_json(in, len, &rest);
+        test_check(val);
+        test_check(rest == in + len);
+
+        test_check(m2_variant_write_json(val, w));
+        const char * data = m2_writer_data(w, &out_len);
+        if (out_len != strlen(out) || memcmp(data, out, out_len) != 0) {
+            fprintf(stderr, "wrote %.*s, expected %s\n", (int)out_len, data, out);
+            test_check(0);
+        }
+
+        m2_writer_destroy(w);
+        if (!arena_mode) m2_variant_destroy(val);
+        m2_arena_destroy(arena);
+    }
+
+    return 1;
+}
+
+/*
+ * Checks that \a in is written back exactly as it is.
+ */
+static int round_trip(const char * in) {
+    return writes_as(in, in);
+}
+
+static int rejected(const char * in) {
+    m2_arena_t * arena = m2_arena_new(0);
+
+    test_check(m2_parse_json(in, strlen(in), NULL) == NULL);
+    test_check(m2_parse_json_arena(arena, in, strlen(in), NULL) == NULL);
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int test_scalars(void) {
+    test_check(round_trip("\"\""));
+    test_check(round_trip("\"hello\""));
+    test_check(round_trip("0"));
+    test_check(round_trip("42"));
+    test_check(round_trip("-42"));
+    test_check(round_trip("9223372036854775807"));
+    test_check(round_trip("-9223372036854775808"));
+    test_check(round_trip("true"));
+    test_check(round_trip("false"));
+    test_check(round_trip("null"));
+    test_check(round_trip("1.5"));
+    test_check(round_trip("-0.25"));
+
+    return 1;
+}
+
+static int test_containers(void) {
+    test_check(round_trip("[]"));
+    test_check(round_trip("{}"));
+    test_check(round_trip("[1,\"a\",true,null,[],{}]"));
+    test_check(round_trip("{\"a\":{\"b\":[1,[2,[3]]]}}"));
+    test_check(writes_as(" [ 1 ,\n\t2 ] ", "[1,2]"));
+    test_check(writes_as("{ \"a\" : [ ] }", "{\"a\":[]}"));
+
+    return 1;
+}
+
+static int test_numbers(void) {
+    test_check(writes_as("1e5", "100000.0"));
+    test_check(writes_as("1.50", "1.5"));
+    test_check(writes_as("0.1", "0.1"));
+    test_check(writes_as("-0", "0"));
+    // Integers that don't fit in a long become floats
+    test_check(writes_as("9223372036854775808", "9.223372036854776e+18"));
+    // Infinities can't be written as JSON
+    test_check(writes_as("1e400", "null"));
+
+    variant_t * val = m2_parse_json("99999999999999999999", 20, NULL);
+    test_check(m2_variant_type(val) == m2_type_float);
+    m2_variant_destroy(val);
+
+    return 1;
+}
+
+static int test_strings(void) {
+    test_check(round_trip("\"a\\\"b\\\\c\""));
+    test_check(round_trip("\"\\n\\r\\t\\b\\f\""));
+    test_check(round_trip("\"\\u0001\\u001f\""));
+    test_check(writes_as("\"\\/\"", "\"/\""));
+    test_check(writes_as("\"\\u00e9\"", "\"\xc3\xa9\""));
+    test_check(writes_as("\"\\ud83d\\ude00\"", "\"\xf0\x9f\x98\x80\""));
+    test_check(round_trip("\"\xc3\xa9\""));
+
+    variant_t * val = m2_parse_json("\"x\\n\\u00e9\"", 11, NULL);
+    test_check(biseqcstr(m2_variant_get_string(val), "x\n\xc3\xa9") == 1);
+    m2_variant_destroy(val);
+
+    return 1;
+}
+
+static int test_keys(void) {
+    const char * in = "{\"k\\\"ey\":1,\"a\":[2]}";
+    struct tagbstring key = bsStatic("k\"ey");
+    struct tagbstring a = bsStatic("a");
+
+    variant_t * val = m2_parse_json(in, strlen(in), NULL);
+    test_check(val && m2_variant_type(val) == m2_type_dict);
+    test_check(m2_variant_type(m2_variant_dict_get(val, &key)) == m2_type_integer);
+    test_check(m2_variant_list_length(m2_variant_dict_get(val, &a)) == 1);
+    m2_variant_destroy(val);
+
+    // The last of a repeated key wins
+    test_check(writes_as("{\"a\":1,\"a\":2}", "{\"a\":2}"));
+
+    return 1;
+}
+
+/*
+ * A value read as JSON, written as a TNetstring and read back
+ * should write the same JSON.
+ */
+static int test_through_tns(void) {
+    const char * in = "{\"a\":[1,-2,3.5,true,false,null,\"x\"],\"b\":{}}";
+    m2_writer_t * first = m2_writer_new(0);
+    m2_writer_t * second = m2_writer_new(0);
+    size_t first_len = 0;
+    size_t second_len = 0;
+
+    variant_t * val = m2_parse_json(in, strlen(in), NULL);
+    test_check(val);
+    test_check(m2_variant_write_json(val, first));
+
+    size_t size = m2_variant_size_tns(val);
+    char * tns = malloc(size);
+    test_check(m2_variant_write_tns(val, tns, size) == size);
+
+    variant_t * copy = m2_parse_tns(tns, size, NULL);
+    test_check(copy);
+    test_check(m2_variant_write_json(copy, second));
+
+    const char * a = m2_writer_data(first, &first_len);
+    const char * b = m2_writer_data(second, &second_len);
+    test_check(first_len == second_len && memcmp(a, b, first_len) == 0);
+
+    free(tns);
+    m2_variant_destroy(val);
+    m2_variant_destroy(copy);
+    m2_writer_destroy(first);
+    m2_writer_destroy(second);
+
+    return 1;
+}
+
+static int test_rest(void) {
+    const char * in = "[1,2] garbage";
+    char * rest = NULL;
+
+    variant_t * val = m2_parse_json(in, strlen(in), &rest);
+    test_check(val && rest == in + 6);
+    m2_variant_destroy(val);
+
+    // Without rest, the value has to be all of the data
+    test_check(rejected("[1,2] garbage"));
+    test_check(writes_as("[1,2] \n", "[1,2]"));
+
+    // Only len bytes are read
+    m2_writer_t * w = m2_writer_new(0);
+    size_t len = 0;
+    val = m2_parse_json("12345", 2, NULL);
+    test_check(val && m2_variant_write_json(val, w));
+    test_check(memcmp(m2_writer_data(w, &len), "12", 2) == 0 && len == 2);
+    m2_variant_destroy(val);
+    m2_writer_destroy(w);
+
+    return 1;
+}
+
+static int test_invalid(void) {
+    test_check(rejected(""));
+    test_check(rejected("   "));
+    test_check(rejected("{"));
+    test_check(rejected("[1,]"));
+    test_check(rejected("[1 2]"));
+    test_check(rejected("{\"a\"}"));
+    test_check(rejected("{\"a\":}"));
+    test_check(rejected("{\"a\":1,}"));
+    test_check(rejected("{a:1}"));
+    test_check(rejected("[}"));
+    test_check(rejected("{]"));
+    test_check(rejected("\"abc"));
+    test_check(rejected("\"\\x\""));
+    test_check(rejected("\"\\u12\""));
+    test_check(rejected("\"\\ud83d\""));
+    test_check(rejected("\"a\x01\""));
+    test_check(rejected("tru"));
+    test_check(rejected("nul"));
+    test_check(rejected("01"));
+    test_check(rejected("-"));
+    test_check(rejected("1."));
+    test_check(rejected("1e"));
+    test_check(rejected(".5"));
+    test_check(rejected("+1"));
+
+    return 1;
+}
+
+/*
+ * Makes \a depth nested empty lists.
+ */
+static const char * nested(int depth) {
+    static char buf[256];
+
+    memset(buf, '[', depth);
+    memset(buf + depth, ']', depth);
+    buf[depth * 2] = '\0';
+
+    return buf;
+}
+
+static int test_nesting_limit(void) {
+    test_check(round_trip(nested(64)));
+    test_check(rejected(nested(65)));
+    test_check(rejected(nested(100)));
+
+    return 1;
+}
+
+static int test_long_list(void) {
+    static char in[20000];
+    char * p = in;
+    int i = 0;
+
+    *p++ = '[';
+    for (i = 0; i < 2000; i++)
+        p += sprintf(p, "%s%d", i ? "," : "", i);
+    *p++ = ']';
+    *p = '\0';
+
+    test_check(round_trip(in));
+
+    return 1;
+}
+
+int main(void) {
+    test_run(test_scalars);
+    test_run(test_containers);
+    test_run(test_numbers);
+    test_run(test_strings);
+    test_run(test_keys);
+    test_run(test_through_tns);
+    test_run(test_rest);
+    test_run(test_invalid);
+    test_run(test_nesting_limit);
+    test_run(test_long_list);
+
+    return test_result();
+}
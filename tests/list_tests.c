@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "variant.h"
+#include "writer.h"
+
+#include "test.h"
+
+/*
+ * Makes a list of \a n items that cycles through a long string, an
+ * integer and a list holding one short string.
+ */
+static variant_t * make_list(int n) {
+    variant_t * list = m2_variant_list_new();
+    char tns[40];
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        variant_t * item = NULL;
+
+        if (i % 3 == 0) {
+            item = m2_parse_tns("25:a string that isn't short,", 29, NULL);
+        } else if (i % 3 == 1) {
+            int len = sprintf(tns, "%d", i);
+            len = sprintf(tns, "%d:%d#", len, i);
+            item = m2_parse_tns(tns, len, NULL);
+        } else {
+            item = m2_variant_list_new();
+            m2_variant_list_append(item, m2_parse_json("\"x\"", 3, NULL));
+        }
+
+        if (!item || !m2_variant_list_append(list, item)) {
+            m2_variant_destroy(list);
+            return NULL;
+        }
+    }
+
+    return list;
+}
+
+/*
+ * Checks the items of a list from make_list().
+ */
+static int holds(const variant_t * list, int n) {
+    char tns[40];
+    int i = 0;
+
+    test_check(m2_variant_list_length(list) == (size_t)n);
+    test_check(m2_variant_list_get(list, n) == NULL);
+
+    for (i = 0; i < n; i++) {
+        variant_t * item = m2_variant_list_get(list, i);
+        test_check(item);
+
+        if (i % 3 == 0) {
+            test_check(biseqcstr(m2_variant_get_string(item), "a string that isn't short") == 1);
+        } else if (i % 3 == 1) {
+            size_t len = m2_variant_size_tns(item);
+            test_check(len < sizeof(tns) && m2_variant_write_tns(item, tns, len) == len);
+            test_check(atoi(strchr(tns, ':') + 1) == i);
+        } else {
+            test_check(m2_variant_type(item) == m2_type_list);
+            test_check(m2_variant_list_length(item) == 1);
+            test_check(biseqcstr(m2_variant_get_string(m2_variant_list_get(item, 0)), "x") == 1);
+        }
+    }
+
+    return 1;
+}
+
+static int test_append(void) {
+    int sizes[] = { 0, 1, 4, 5, 8, 9, 1000 };
+    size_t i = 0;
+
+    // Around the items kept inside the list and each doubling
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        variant_t * list = make_list(sizes[i]);
+        test_check(list);
+        test_check(holds(list, sizes[i]));
+        m2_variant_destroy(list);
+    }
+
+    return 1;
+}
+
+static int test_items(void) {
+    variant_t * list = make_list(10);
+    test_check(list);
+
+    // Heap strings in a list can be changed with bstrlib
+    bstring str = m2_variant_get_string(m2_variant_list_get(list, 0));
+    test_check(bcatcstr(str, "!") == BSTR_OK);
+    test_check(biseqcstr(m2_variant_get_string(m2_variant_list_get(list, 0)),
+                "a string that isn't short!") == 1);
+
+    // Items belong to their list
+    m2_variant_destroy(m2_variant_list_get(list, 3));
+    test_check(m2_variant_list_length(list) == 10);
+    test_check(!m2_variant_list_append(list, m2_variant_list_get(list, 1)));
+
+    // Items already appended keep their values as the list grows
+    variant_t * nested = m2_variant_list_get(list, 2);
+    test_check(m2_variant_list_append(nested, m2_variant_null_new()));
+    test_check(m2_variant_list_length(m2_variant_list_get(list, 2)) == 2);
+
+    // Things that aren't lists have no items
+    test_check(m2_variant_list_length(m2_variant_list_get(list, 0)) == 0);
+    test_check(m2_variant_list_get(m2_variant_list_get(list, 0), 0) == NULL);
+
+    m2_variant_destroy(list);
+    return 1;
+}
+
+static int test_clone(void) {
+    variant_t * list = make_list(100);
+    test_check(list);
+
+    variant_t * copy = m2_variant_clone(list);
+    m2_variant_destroy(list);
+    test_check(copy);
+    test_check(holds(copy, 100));
+    m2_variant_destroy(copy);
+
+    // Lists from an arena can be cloned to outlive it
+    m2_arena_t * arena = m2_arena_new(0);
+    const char * in = "[\"a string that isn't short\",1,[\"x\"]]";
+    list = m2_parse_json_arena(arena, in, strlen(in), NULL);
+    test_check(list);
+    copy = m2_variant_clone(list);
+    m2_arena_destroy(arena);
+    test_check(holds(copy, 3));
+    m2_variant_destroy(copy);
+
+    return 1;
+}
+
+/*
+ * Lists nested five deep, each holding five of the one inside, with
+ * 100 integers in the innermost.
+ */
+static int test_nested_parse(void) {
+    static char body[1 << 20];
+    static char prev[sizeof(body) + 32];
+    static char cur[sizeof(body) + 32];
+    char * p = body;
+    int depth = 0;
+    int i = 0;
+
+    for (i = 0; i < 100; i++)
+        p += sprintf(p, "%d:%d#", i < 10 ? 1 : 2, i);
+    sprintf(prev, "%zu:%s]", strlen(body), body);
+
+    for (depth = 1; depth < 5; depth++) {
+        body[0] = '\0';
+        for (i = 0; i < 5; i++)
+            strcat(body, prev);
+        sprintf(cur, "%zu:%s]", strlen(body), body);
+        strcpy(prev, cur);
+    }
+
+    size_t len = strlen(prev);
+    m2_arena_t * arena = m2_arena_new(0);
+    int mode = 0;
+
+    for (mode = 0; mode < 3; mode++) {
+        variant_t * val = mode == 0 ? m2_parse_tns(prev, len, NULL)
+            : mode == 1 ? m2_parse_tns_view(prev, len, NULL)
+            : m2_parse_tns_arena(arena, prev, len, NULL);
+        test_check(val);
+
+        variant_t * inner = val;
+        for (depth = 1; depth < 5; depth++) {
+            test_check(m2_variant_list_length(inner) == 5);
+            inner = m2_variant_list_get(inner, 4);
+        }
+        test_check(m2_variant_list_length(inner) == 100);
+
+        test_check(m2_variant_size_tns(val) == len);
+        test_check(m2_variant_write_tns(val, cur, len) == len);
+        test_check(memcmp(cur, prev, len) == 0);
+
+        if (mode != 2) m2_variant_destroy(val);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+static int writes_json(const variant_t * val, const char * expected) {
+    m2_writer_t * w = m2_writer_new(0);
+    size_t len = 0;
+
+    test_check(m2_variant_write_json(val, w));
+    const char * data = m2_writer_data(w, &len);
+    test_check(len == strlen(expected) && memcmp(data, expected, len) == 0);
+
+    m2_writer_destroy(w);
+    return 1;
+}
+
+static int test_pack(void) {
+    const char * in = "{\"i\":[1,2,3,4,5,-6],\"f\":[0.5,2.0],\"m\":[1,2.5],"
+        "\"n\":[[1],[2.5],[\"x\"]],\"e\":[]}";
+    struct tagbstring i = bsStatic("i");
+    struct tagbstring f = bsStatic("f");
+    struct tagbstring m = bsStatic("m");
+    struct tagbstring n = bsStatic("n");
+    struct tagbstring e = bsStatic("e");
+    int arena_mode = 0;
+    size_t len = 0;
+
+    test_check(m2_variant_pack(NULL) == 0);
+
+    for (arena_mode = 0; arena_mode < 2; arena_mode++) {
+        m2_arena_t * arena = m2_arena_new(0);
+        variant_t * val = arena_mode
+            ? m2_parse_json_arena(arena, in, strlen(in), NULL)
+            : m2_parse_json(in, strlen(in), NULL);
+        test_check(val);
+
+        // The parsers leave lists as they are
+        test_check(m2_variant_type(m2_variant_dict_get(val, &i)) == m2_type_list);
+        test_check(m2_variant_list_get(m2_variant_dict_get(val, &i), 5));
+
+        test_check(m2_variant_pack(val));
+
+        const int64_t * ints = m2_variant_get_int_array(m2_variant_dict_get(val, &i), &len);
+        test_check(ints && len == 6 && ints[0] == 1 && ints[5] == -6);
+        test_check(m2_variant_list_length(m2_variant_dict_get(val, &i)) == 6);
+        test_check(m2_variant_list_get(m2_variant_dict_get(val, &i), 0) == NULL);
+
+        const double * floats = m2_variant_get_float_array(m2_variant_dict_get(val, &f), &len);
+        test_check(floats && len == 2 && floats[0] == 0.5 && floats[1] == 2.0);
+        test_check(m2_variant_get_int_array(m2_variant_dict_get(val, &f), &len) == NULL);
+
+        // Mixed and empty lists aren't packed
+        test_check(m2_variant_type(m2_variant_dict_get(val, &m)) == m2_type_list);
+        test_check(m2_variant_type(m2_variant_dict_get(val, &e)) == m2_type_list);
+
+        // Lists in lists are packed too
+        variant_t * nested = m2_variant_dict_get(val, &n);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 0)) == m2_type_int_array);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 1)) == m2_type_float_array);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 2)) == m2_type_list);
+
+        // Packed arrays read back as the lists they were
+        test_check(writes_json(val, in));
+
+        variant_t * copy = m2_variant_clone(val);
+        test_check(copy);
+        test_check(m2_variant_type(m2_variant_dict_get(copy, &i)) == m2_type_int_array);
+        test_check(writes_json(copy, in));
+
+        size_t size = m2_variant_size_tns(val);
+        char * tns = malloc(size);
+        test_check(m2_variant_write_tns(val, tns, size) == size);
+        variant_t * back = m2_parse_tns(tns, size, NULL);
+        test_check(back);
+        test_check(m2_variant_type(m2_variant_dict_get(back, &i)) == m2_type_list);
+        test_check(writes_json(back, in));
+
+        free(tns);
+        m2_variant_destroy(back);
+        m2_variant_destroy(copy);
+        if (!arena_mode) m2_variant_destroy(val);
+        m2_arena_destroy(arena);
+    }
+
+    return 1;
+}
+
+static int test_pack_large(void) {
+    static char in[1 << 20];
+    m2_arena_t * arena = m2_arena_new(0);
+    char * p = in;
+    size_t len = 0;
+    int round = 0;
+    int i = 0;
+
+    *p++ = '[';
+    for (i = 0; i < 20000; i++)
+        p += sprintf(p, "%s%d.5", i ? "," : "", i);
+    *p++ = ']';
+
+    for (round = 0; round < 3; round++) {
+        variant_t * val = round
+            ? m2_parse_json_arena(arena, in, p - in, NULL)
+            : m2_parse_json(in, p - in, NULL);
+        test_check(val && m2_variant_pack(val));
+
+        const double * floats = m2_variant_get_float_array(val, &len);
+        test_check(floats && len == 20000);
+        for (i = 0; i < 20000; i++)
+            test_check(floats[i] == i + 0.5);
+
+        if (!round) m2_variant_destroy(val);
+        m2_arena_reset(arena);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+enum { PACKED_JSON, PACKED_JSON_ARENA, PACKED_TNS, PACKED_TNS_ARENA, PACKED_MODES };
+
+/*
+ * Parses the JSON \a in with a packed parser, going through the
+ * TNetstring for it in the TNS modes.
+ */
+static variant_t * parse_packed(int mode, m2_arena_t * arena, const char * in, size_t len) {
+    static char tns[1 << 20];
+
+    if (mode == PACKED_JSON || mode == PACKED_JSON_ARENA)
+        return m2_parse_json_packed(mode == PACKED_JSON ? NULL : arena, in, len, NULL);
+
+    variant_t * val = m2_parse_json(in, len, NULL);
+    size_t size = m2_variant_size_tns(val);
+    if (!val || size > sizeof(tns) || m2_variant_write_tns(val, tns, size) != size)
+        return NULL;
+    m2_variant_destroy(val);
+
+    return m2_parse_tns_packed(mode == PACKED_TNS ? NULL : arena, tns, size, NULL);
+}
+
+static int test_parse_packed(void) {
+    const char * in = "{\"i\":[1,2,3,4,5,-6],\"f\":[0.5,2.0],\"m\":[1,2.5],"
+        "\"n\":[[1],[2.5],[\"x\"]],\"e\":[]}";
+    struct tagbstring i = bsStatic("i");
+    struct tagbstring f = bsStatic("f");
+    struct tagbstring m = bsStatic("m");
+    struct tagbstring n = bsStatic("n");
+    struct tagbstring e = bsStatic("e");
+    m2_arena_t * arena = m2_arena_new(0);
+    size_t len = 0;
+    int mode = 0;
+
+    for (mode = 0; mode < PACKED_MODES; mode++) {
+        variant_t * val = parse_packed(mode, arena, in, strlen(in));
+        test_check(val);
+
+        const int64_t * ints = m2_variant_get_int_array(m2_variant_dict_get(val, &i), &len);
+        test_check(ints && len == 6 && ints[0] == 1 && ints[5] == -6);
+
+        const double * floats = m2_variant_get_float_array(m2_variant_dict_get(val, &f), &len);
+        test_check(floats && len == 2 && floats[0] == 0.5 && floats[1] == 2.0);
+
+        // Mixed and empty lists stay lists
+        variant_t * mixed = m2_variant_dict_get(val, &m);
+        test_check(m2_variant_type(mixed) == m2_type_list);
+        test_check(m2_variant_type(m2_variant_list_get(mixed, 0)) == m2_type_integer);
+        test_check(m2_variant_type(m2_variant_list_get(mixed, 1)) == m2_type_float);
+        test_check(m2_variant_type(m2_variant_dict_get(val, &e)) == m2_type_list);
+
+        variant_t * nested = m2_variant_dict_get(val, &n);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 0)) == m2_type_int_array);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 1)) == m2_type_float_array);
+        test_check(m2_variant_type(m2_variant_list_get(nested, 2)) == m2_type_list);
+
+        test_check(writes_json(val, in));
+
+        if (mode == PACKED_JSON || mode == PACKED_TNS) m2_variant_destroy(val);
+        m2_arena_reset(arena);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+/*
+ * Lists of around the inline sizes and larger, packed and then with
+ * a string after the numbers, which turns them back into variants.
+ */
+static int test_parse_unpack(void) {
+    static char in[1 << 18];
+    int sizes[] = { 0, 1, 3, 4, 5, 15, 16, 17, 20000 };
+    m2_arena_t * arena = m2_arena_new(0);
+    size_t s = 0;
+    int mode = 0;
+    int tail = 0;
+    int i = 0;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (tail = 0; tail < 2; tail++) {
+            char * p = in;
+
+            *p++ = '[';
+            for (i = 0; i < sizes[s]; i++)
+                p += sprintf(p, "%s%d", i ? "," : "", i * 7 - 1000);
+            if (tail)
+                p += sprintf(p, "%s\"a string that isn't short\"", sizes[s] ? "," : "");
+            *p++ = ']';
+            *p = '\0';
+
+            for (mode = 0; mode < PACKED_MODES; mode++) {
+                variant_t * val = parse_packed(mode, arena, in, p - in);
+                test_check(val);
+                test_check(m2_variant_list_length(val) == (size_t)(sizes[s] + tail));
+
+                if (tail || !sizes[s]) {
+                    test_check(m2_variant_type(val) == m2_type_list);
+                } else {
+                    size_t len = 0;
+                    const int64_t * ints = m2_variant_get_int_array(val, &len);
+                    test_check(ints && len == (size_t)sizes[s]);
+                    for (i = 0; i < sizes[s]; i++)
+                        test_check(ints[i] == i * 7 - 1000);
+                }
+
+                test_check(writes_json(val, in));
+
+                if (mode == PACKED_JSON || mode == PACKED_TNS) m2_variant_destroy(val);
+                m2_arena_reset(arena);
+            }
+        }
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+int main(void) {
+    test_run(test_append);
+    test_run(test_items);
+    test_run(test_clone);
+    test_run(test_nested_parse);
+    test_run(test_pack);
+    test_run(test_pack_large);
+    test_run(test_parse_packed);
+    test_run(test_parse_unpack);
+
+    return test_result();
+}
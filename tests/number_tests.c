@@ -0,0 +1,248 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+#include "test.h"
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+/*
+ * A fixed xorshift sequence, so failures can be reproduced.
+ */
+static uint64_t next_rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/*
+ * Checks that \a str scans to its end and converts to exactly the
+ * double strtod() gives.
+ */
+static int same_as_strtod(const char * str) {
+    size_t len = strlen(str);
+    number_t num;
+
+    // Scanned from a copy of exactly the right size, so reading past
+    // the end would be caught by a memory checker
+    char * copy = malloc(len ? len : 1);
+    test_check(copy);
+    memcpy(copy, str, len);
+
+    const char * end = number_scan(copy, copy + len, &num);
+    if (end != copy + len) {
+        fprintf(stderr, "didn't scan all of %s\n", str);
+        free(copy);
+        return 0;
+    }
+
+    double got = number_to_double(&num);
+    double expected = strtod(str, NULL);
+    free(copy);
+
+    if (memcmp(&got, &expected, sizeof(got)) != 0) {
+        fprintf(stderr, "%s: got %.17g, expected %.17g\n", str, got, expected);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int test_edge_doubles(void) {
+    const char * edges[] = {
+        "0", "-0", "0.0", "0.1", "1e23", "9007199254740993",
+        "1e-400", "1e400", "-1e400",
+        "4.9406564584124654e-324", "2.4703282292062327e-324",
+        "2.4703282292062328e-324",
+        "2.2250738585072011e-308", "2.2250738585072012e-308",
+        "1.7976931348623157e308", "1.7976931348623158e308",
+        "1.7976931348623159e308", "8.98846567431158e307",
+        "123456789012345678901234567890",
+        "0.000000000000000000000000000000000000000001",
+        "00000000000000000000000042.5",
+    };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+        test_check(same_as_strtod(edges[i]));
+
+    return 1;
+}
+
+static int test_random_doubles(void) {
+    char buf[64];
+    int i = 0;
+
+    for (i = 0; i < 200000; i++) {
+        uint64_t bits = next_rand();
+        double d = 0;
+        memcpy(&d, &bits, sizeof(d));
+        if (!isfinite(d))
+            continue;
+
+        snprintf(buf, sizeof(buf), "%.*g", (int)(next_rand() % 17) + 1, d);
+        test_check(same_as_strtod(buf));
+        snprintf(buf, sizeof(buf), "%.17e", d);
+        test_check(same_as_strtod(buf));
+    }
+
+    return 1;
+}
+
+/*
+ * Exact midpoints between neighbouring doubles, which need more
+ * digits than fit in the mantissa to round correctly.
+ */
+static int test_halfway(void) {
+    char buf[128];
+    int i = 0;
+
+    for (i = 0; i < 20000; i++) {
+        uint64_t bits = next_rand() & 0x7FEFFFFFFFFFFFFFULL;
+        double d = 0;
+        memcpy(&d, &bits, sizeof(d));
+
+        long double mid = ((long double)d + (long double)nextafter(d, INFINITY)) / 2;
+        snprintf(buf, sizeof(buf), "%.40Le", mid);
+        test_check(same_as_strtod(buf));
+    }
+
+    return 1;
+}
+
+static int test_random_digits(void) {
+    static char buf[2048];
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < 50000; i++) {
+        int digits = next_rand() % 60 + 1;
+        int k = 0;
+
+        if (next_rand() & 1)
+            buf[k++] = '-';
+        for (j = 0; j < digits; j++)
+            buf[k++] = '0' + next_rand() % 10;
+        if (next_rand() & 1) {
+            int fraction = next_rand() % 40 + 1;
+            buf[k++] = '.';
+            for (j = 0; j < fraction; j++)
+                buf[k++] = '0' + next_rand() % 10;
+        }
+        if (next_rand() & 1)
+            k += sprintf(buf + k, "e%d", (int)(next_rand() % 700) - 350);
+        buf[k] = '\0';
+
+        test_check(same_as_strtod(buf));
+    }
+
+    // Far more digits than are significant
+    for (i = 0; i < 200; i++) {
+        int k = 0;
+
+        buf[k++] = '0';
+        buf[k++] = '.';
+        for (j = 0; j < 1500; j++)
+            buf[k++] = '0' + next_rand() % 10;
+        sprintf(buf + k, "e-%d", (int)(next_rand() % 320));
+
+        test_check(same_as_strtod(buf));
+    }
+
+    return 1;
+}
+
+static int test_longs(void) {
+    struct {
+        const char * str;
+        int ok;
+        long value;
+    } cases[] = {
+        { "0", 1, 0 },
+        { "-0", 1, 0 },
+        { "12345678", 1, 12345678 },
+        { "00000000000000000000000042", 1, 42 },
+        { "9223372036854775807", 1, LONG_MAX },
+        { "-9223372036854775808", 1, LONG_MIN },
+        { "9223372036854775808", 0, 0 },
+        { "-9223372036854775809", 0, 0 },
+        { "10000000000000000000", 0, 0 },
+        { "1.0", 0, 0 },
+        { "1e2", 0, 0 },
+    };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char * str = cases[i].str;
+        number_t num;
+        long value = 0;
+
+        test_check(number_scan(str, str + strlen(str), &num) == str + strlen(str));
+        test_check(number_to_long(&num, &value) == cases[i].ok);
+        test_check(!cases[i].ok || value == cases[i].value);
+    }
+
+    // Random values compared with strtol()
+    for (i = 0; i < 100000; i++) {
+        char buf[32];
+        number_t num;
+        long value = 0;
+
+        snprintf(buf, sizeof(buf), "%ld", (long)next_rand() >> (next_rand() % 64));
+        test_check(number_scan(buf, buf + strlen(buf), &num) == buf + strlen(buf));
+        test_check(number_to_long(&num, &value) && value == strtol(buf, NULL, 10));
+    }
+
+    return 1;
+}
+
+static int test_bounds(void) {
+    const char * str = "12345e5";
+    number_t num;
+    long value = 0;
+
+    // Only the bytes before the end are read
+    test_check(number_scan(str, str + 3, &num) == str + 3);
+    test_check(number_to_long(&num, &value) && value == 123);
+
+    // The number ends at the first byte that can't continue it
+    str = "42,";
+    test_check(number_scan(str, str + 3, &num) == str + 2);
+    str = "1.5]";
+    test_check(number_scan(str, str + 4, &num) == str + 3);
+
+    return 1;
+}
+
+static int test_invalid(void) {
+    const char * bad[] = { "", "-", "1.", ".5", "1e", "1e+", "--1", "+1", "-.5", "1.e5" };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        const char * str = bad[i];
+        number_t num;
+
+        const char * end = number_scan(str, str + strlen(str), &num);
+        test_check(end != str + strlen(str) || strlen(str) == 0);
+        test_check(end == NULL || end < str + strlen(str));
+    }
+
+    return 1;
+}
+
+int main(void) {
+    test_run(test_edge_doubles);
+    test_run(test_random_doubles);
+    test_run(test_halfway);
+    test_run(test_random_digits);
+    test_run(test_longs);
+    test_run(test_bounds);
+    test_run(test_invalid);
+
+    return test_result();
+}
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <string.h>
+
+#include "err.h"
+#include "mongrel2.h"
+
+#include "test.h"
+#include "zmq_stub.h"
+
+static struct tagbstring uuid = bsStatic("test-handler");
+static struct tagbstring recv_addr = bsStatic("tcp://127.0.0.1:9997");
+static struct tagbstring send_addr = bsStatic("tcp://127.0.0.1:9996");
+
+static void * ctx = NULL;
+static void * conn = NULL;
+
+static void push(const char * msg) {
+    zmq_stub_push(msg, strlen(msg));
+}
+
+static int test_parse(void) {
+    struct tagbstring host = bsStatic("Host");
+
+    push("54c6755b-9628-40a4-9a2d-cc82a816345e 7 /handler "
+            "44:4:PATH,8:/handler,6:METHOD,3:GET,4:Host,1:x,}0:,");
+
+    m2_request_t * req = m2_recv_nonblock(conn);
+    test_check(req);
+    test_check(biseqcstr(req->uuid, "54c6755b-9628-40a4-9a2d-cc82a816345e") == 1);
+    test_check(biseqcstr(req->conn_id, "7") == 1);
+    test_check(biseqcstr(req->path, "/handler") == 1);
+    test_check(req->kind == M2_MESSAGE_HTTP);
+    test_check(biseqcstr(m2_variant_get_string(m2_request_get_header(req, &host)), "x") == 1);
+    m2_request_free(req);
+
+    return 1;
+}
+
+/*
+ * Messages that end before the headers are rejected without reading
+ * past the end of the message.
+ */
+static int test_truncated(void) {
+    const char * messages[] = {
+        "", " ", "uuid", "uuid ", "uuid 7", "uuid 7 ", "uuid 7 /path", "uuid 7 /path ",
+        "  ", "   ",
+    };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+        push(messages[i]);
+        test_check(m2_recv_nonblock(conn) == NULL);
+        test_check(m2_errno() != 0);
+    }
+    test_check(zmq_stub_pending() == 0);
+
+    // The connection still works afterwards
+    push("uuid 7 /path 0:}0:,");
+    m2_request_t * req = m2_recv_nonblock(conn);
+    test_check(req && biseqcstr(req->path, "/path") == 1);
+    m2_request_free(req);
+
+    return 1;
+}
+
+/*
+ * A failed receive gives NULL and leaves the next message queued.
+ */
+static int test_recv_error(void) {
+    zmq_stub_push_error(EINTR);
+    push("uuid 7 /path 0:}0:,");
+
+    test_check(m2_recv(conn) == NULL);
+    test_check(m2_errno() != 0);
+    test_check(zmq_stub_pending() == 1);
+
+    m2_request_t * req = m2_recv(conn);
+    test_check(req && biseqcstr(req->path, "/path") == 1);
+    m2_request_free(req);
+
+    return 1;
+}
+
+/*
+ * A receive that fails partway through a batch ends the batch, but
+ * keeps the requests received before it.
+ */
+static int test_recv_many_error(void) {
+    m2_request_t * out[8];
+    int i = 0;
+
+    push("uuid 7 /one 0:}0:,");
+    push("uuid 7 /two 0:}0:,");
+    zmq_stub_push_error(EINTR);
+    push("uuid 7 /three 0:}0:,");
+
+    test_check(m2_recv_many(conn, out, 8, -1) == 2);
+    test_check(biseqcstr(out[0]->path, "/one") == 1);
+    test_check(biseqcstr(out[1]->path, "/two") == 1);
+    for (i = 0; i < 2; i++)
+        m2_request_free(out[i]);
+
+    test_check(m2_recv_many(conn, out, 8, -1) == 1);
+    test_check(biseqcstr(out[0]->path, "/three") == 1);
+    m2_request_free(out[0]);
+
+    // With nothing received there is nothing to return
+    zmq_stub_push_error(EINTR);
+    test_check(m2_recv_many(conn, out, 8, -1) == -1);
+    test_check(zmq_stub_pending() == 0);
+
+    return 1;
+}
+
+/*
+ * JSON bodies only have their lists of numbers packed if the
+ * connection asks for it.
+ */
+static int test_pack_arrays(void) {
+    int pack = 0;
+
+    for (pack = 0; pack < 2; pack++) {
+        test_check(m2_connection_setopt(conn, M2_PACK_ARRAYS, pack));
+        push("uuid 7 @* 16:6:METHOD,4:JSON,}7:[1,2,3],");
+
+        m2_request_t * req = m2_recv_nonblock(conn);
+        test_check(req && req->kind == M2_MESSAGE_JSON);
+
+        variant_t * body = m2_request_get_json(req);
+        test_check(m2_variant_type(body) == (pack ? m2_type_int_array : m2_type_list));
+        test_check(m2_variant_list_length(body) == 3);
+        m2_request_free(req);
+    }
+
+    test_check(m2_connection_setopt(conn, M2_PACK_ARRAYS, 0));
+    return 1;
+}
+
+int main(void) {
+    ctx = m2_ctx_new();
+    conn = m2_connection_open(ctx, &uuid, &recv_addr, &send_addr);
+    if (!conn) {
+        printf("FAIL opening connection\n");
+        return 1;
+    }
+
+    test_run(test_parse);
+    test_run(test_truncated);
+    test_run(test_recv_error);
+    test_run(test_recv_many_error);
+    test_run(test_pack_arrays);
+
+    m2_connection_close(conn);
+    m2_ctx_destroy(ctx);
+
+    return test_result();
+}
@@ -0,0 +1,155 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "strhash.h"
+
+#include "test.h"
+
+/*
+ * Longer than the 48-byte blocks, so every path through the hash is
+ * taken by some prefix of it.
+ */
+#define MAX_LEN 200
+
+static unsigned char text[MAX_LEN];
+
+static void make_text(void) {
+    int i = 0;
+
+    for (i = 0; i < MAX_LEN; i++)
+        text[i] = "Content-Type: Application/JSON; Charset=UTF-8 "[i % 46];
+}
+
+static int test_stable(void) {
+    unsigned char copy[MAX_LEN + 8];
+    size_t len = 0;
+    size_t offset = 0;
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        uint64_t hash = strhash(text, len);
+        test_check(strhash(text, len) == hash);
+
+        // The same bytes hash the same wherever they are
+        for (offset = 1; offset < 8; offset++) {
+            memcpy(copy + offset, text, len);
+            test_check(strhash(copy + offset, len) == hash);
+            test_check(strhash_caseless(copy + offset, len) == strhash_caseless(text, len));
+        }
+    }
+
+    return 1;
+}
+
+static int test_length(void) {
+    unsigned char zeros[MAX_LEN];
+    size_t len = 0;
+
+    memset(zeros, 0, sizeof(zeros));
+
+    // Keys that differ only in trailing zero bytes don't collide
+    for (len = 0; len < MAX_LEN; len++) {
+        test_check(strhash(zeros, len) != strhash(zeros, len + 1));
+        test_check(strhash(text, len) != strhash(text, len + 1));
+        test_check(strhash_caseless(zeros, len) != strhash_caseless(zeros, len + 1));
+    }
+
+    return 1;
+}
+
+/*
+ * Flipping any one bit of a key changes its hash.
+ */
+static int test_bit_flips(void) {
+    unsigned char key[MAX_LEN];
+    size_t len = 0;
+    size_t bit = 0;
+
+    for (len = 1; len <= 100; len++) {
+        memcpy(key, text, len);
+        uint64_t hash = strhash(key, len);
+
+        for (bit = 0; bit < len * 8; bit++) {
+            key[bit / 8] ^= 1 << (bit % 8);
+            test_check(strhash(key, len) != hash);
+            key[bit / 8] ^= 1 << (bit % 8);
+        }
+    }
+
+    return 1;
+}
+
+static int test_caseless(void) {
+    unsigned char upper[MAX_LEN];
+    unsigned char lower[MAX_LEN];
+    size_t len = 0;
+    size_t i = 0;
+
+    for (i = 0; i < MAX_LEN; i++) {
+        upper[i] = toupper(text[i]);
+        lower[i] = tolower(text[i]);
+    }
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        uint64_t hash = strhash_caseless(text, len);
+        test_check(strhash_caseless(upper, len) == hash);
+        test_check(strhash_caseless(lower, len) == hash);
+    }
+
+    // Only ASCII letters are folded, not the bytes 32 away from them
+    // or letters with the high bit set
+    const char * pairs[][2] = {
+        { "@", "`" }, { "[", "{" }, { "]", "}" }, { "^", "~" },
+        { "\xc9", "\xe9" }, { "\xc1", "a" }, { "a", "b" },
+    };
+    for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        char a[40];
+        char b[40];
+        for (len = 1; len <= sizeof(a); len++) {
+            memset(a, 'x', sizeof(a));
+            memset(b, 'x', sizeof(b));
+            a[len - 1] = pairs[i][0][0];
+            b[len - 1] = pairs[i][1][0];
+            test_check(strhash_caseless(a, len) != strhash_caseless(b, len));
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Header-like keys spread evenly over the low bits, which are what
+ * the dict index uses.
+ */
+static int test_spread(void) {
+    static unsigned counts[4096];
+    unsigned max = 0;
+    char key[32];
+    int i = 0;
+
+    for (i = 0; i < 4096 * 16; i++) {
+        int len = sprintf(key, "X-Header-%d", i);
+        unsigned bucket = strhash(key, len) & 4095;
+        if (++counts[bucket] > max)
+            max = counts[bucket];
+    }
+
+    // 16 keys a bucket on average; a good hash stays well under 48
+    test_check(max < 48);
+
+    return 1;
+}
+
+int main(void) {
+    strhash_init();
+    make_text();
+
+    test_run(test_stable);
+    test_run(test_length);
+    test_run(test_bit_flips);
+    test_run(test_caseless);
+    test_run(test_spread);
+
+    return test_result();
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "variant.h"
+
+#include "test.h"
+
+/*
+ * Around the longest string kept inside a variant, which is 12 bytes.
+ */
+static const size_t lengths[] = { 0, 1, 3, 8, 11, 12, 13, 14, 40 };
+#define LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static char text[64];
+
+static void make_text(void) {
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(text) - 1; i++)
+        text[i] = 'a' + i % 26;
+}
+
+enum { PARSE_TNS, PARSE_TNS_VIEW, PARSE_TNS_ARENA, PARSE_JSON, PARSE_JSON_ARENA, PARSE_MODES };
+
+/*
+ * Parses a string of \a len bytes from text in the given way.
+ */
+static variant_t * parse_string(int mode, m2_arena_t * arena, size_t len) {
+    static char in[128];
+    int n = 0;
+
+    if (mode >= PARSE_JSON) {
+        n = sprintf(in, "\"%.*s\"", (int)len, text);
+        return mode == PARSE_JSON ? m2_parse_json(in, n, NULL)
+            : m2_parse_json_arena(arena, in, n, NULL);
+    }
+
+    n = sprintf(in, "%zu:%.*s,", len, (int)len, text);
+    switch (mode) {
+        case PARSE_TNS:
+            return m2_parse_tns(in, n, NULL);
+        case PARSE_TNS_VIEW:
+            return m2_parse_tns_view(in, n, NULL);
+        default:
+            return m2_parse_tns_arena(arena, in, n, NULL);
+    }
+}
+
+static int is_text(bstring str, size_t len) {
+    return str && (size_t)str->slen == len && memcmp(str->data, text, len) == 0;
+}
+
+static int test_lengths(void) {
+    char out[128];
+    size_t i = 0;
+    int mode = 0;
+
+    for (mode = 0; mode < PARSE_MODES; mode++) {
+        for (i = 0; i < LENGTHS; i++) {
+            m2_arena_t * arena = m2_arena_new(0);
+            size_t len = lengths[i];
+
+            variant_t * val = parse_string(mode, arena, len);
+            test_check(val && m2_variant_type(val) == m2_type_string);
+
+            size_t size = m2_variant_size_tns(val);
+            test_check(m2_variant_write_tns(val, out, size) == size);
+            test_check(memcmp(out + size - len - 1, text, len) == 0);
+
+            test_check(is_text(m2_variant_get_string(val), len));
+            // A second call gives the same bytes
+            test_check(is_text(m2_variant_get_string(val), len));
+
+            if (mode != PARSE_TNS_ARENA && mode != PARSE_JSON_ARENA)
+                m2_variant_destroy(val);
+            m2_arena_destroy(arena);
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Strings on the heap can be changed with bstrlib, whatever their
+ * length. Strings in an arena are read-only.
+ */
+static int test_writable(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+    size_t i = 0;
+
+    for (i = 0; i < LENGTHS; i++) {
+        variant_t * val = m2_parse_json("\"\"", 2, NULL);
+        bstring str = m2_variant_get_string(val);
+        test_check(bcatblk(str, text, lengths[i]) == BSTR_OK);
+        test_check(bcatcstr(m2_variant_get_string(val), "!") == BSTR_OK);
+        test_check(m2_variant_get_string(val)->slen == (int)lengths[i] + 1);
+        test_check(memcmp(m2_variant_get_string(val)->data, text, lengths[i]) == 0);
+        m2_variant_destroy(val);
+
+        val = parse_string(PARSE_TNS_ARENA, arena, lengths[i]);
+        test_check(bcatcstr(m2_variant_get_string(val), "!") == BSTR_ERR);
+        test_check(is_text(m2_variant_get_string(val), lengths[i]));
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+/*
+ * Escapes make the JSON longer than the string it decodes to, so
+ * these only fit in the variant once decoded.
+ */
+static int test_json_escapes(void) {
+    struct {
+        const char * in;
+        const char * out;
+    } cases[] = {
+        { "\"\\u00e9\\u00e9\\u00e9\\u00e9\\u00e9\\u00e9\"", "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9" },
+        { "\"\\ud83d\\ude00\\ud83d\\ude00\\ud83d\\ude00\"", "\xf0\x9f\x98\x80\xf0\x9f\x98\x80\xf0\x9f\x98\x80" },
+        { "\"\\n\\t\\\"\\\\\\/abcdefg\"", "\n\t\"\\/abcdefg" },
+        { "\"\\n\\t\\\"\\\\\\/abcdefgh\"", "\n\t\"\\/abcdefgh" },
+    };
+    m2_arena_t * arena = m2_arena_new(0);
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char * in = cases[i].in;
+
+        variant_t * val = m2_parse_json(in, strlen(in), NULL);
+        test_check(val && biseqcstr(m2_variant_get_string(val), cases[i].out) == 1);
+        m2_variant_destroy(val);
+
+        val = m2_parse_json_arena(arena, in, strlen(in), NULL);
+        test_check(val && biseqcstr(m2_variant_get_string(val), cases[i].out) == 1);
+    }
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+/*
+ * Short strings held in a list move with the list's items as it
+ * grows, and still read back the same.
+ */
+static int test_moving(void) {
+    m2_arena_t * arena = m2_arena_new(0);
+    char json[4096];
+    char * p = json;
+    size_t i = 0;
+    int arena_mode = 0;
+
+    *p++ = '[';
+    for (i = 0; i < 100; i++)
+        p += sprintf(p, "%s\"%.*s\"", i ? "," : "", (int)lengths[i % LENGTHS], text);
+    *p++ = ']';
+
+    for (arena_mode = 0; arena_mode < 2; arena_mode++) {
+        variant_t * list = arena_mode
+            ? m2_parse_json_arena(arena, json, p - json, NULL)
+            : m2_parse_json(json, p - json, NULL);
+        test_check(list && m2_variant_list_length(list) == 100);
+
+        for (i = 0; i < 100; i++)
+            test_check(is_text(m2_variant_get_string(m2_variant_list_get(list, i)), lengths[i % LENGTHS]));
+
+        variant_t * copy = m2_variant_clone(list);
+        test_check(copy);
+        for (i = 0; i < 100; i++)
+            test_check(is_text(m2_variant_get_string(m2_variant_list_get(copy, i)), lengths[i % LENGTHS]));
+        m2_variant_destroy(copy);
+
+        if (!arena_mode) m2_variant_destroy(list);
+    }
+
+    // Appending moves the items of a heap list
+    variant_t * list = m2_variant_list_new();
+    for (i = 0; i < 100; i++) {
+        test_check(m2_variant_list_append(list, parse_string(PARSE_TNS, NULL, lengths[i % LENGTHS])));
+        test_check(is_text(m2_variant_get_string(m2_variant_list_get(list, 0)), 0));
+    }
+    for (i = 0; i < 100; i++)
+        test_check(is_text(m2_variant_get_string(m2_variant_list_get(list, i)), lengths[i % LENGTHS]));
+    m2_variant_destroy(list);
+
+    m2_arena_destroy(arena);
+    return 1;
+}
+
+int main(void) {
+    make_text();
+
+    test_run(test_lengths);
+    test_run(test_writable);
+    test_run(test_json_escapes);
+    test_run(test_moving);
+
+    return test_result();
+}
@@ -0,0 +1,34 @@
+/**
+ * @file test.h
+ *
+ * A minimal harness for the tests in this directory.
+ *
+ * Each test is a function that returns 1 if it passed. test_check()
+ * makes it return 0 at the first check that fails, after printing
+ * where that was. main() runs each test with test_run() and returns
+ * test_result().
+ */
+#ifndef _TEST_H_DEF
+#define _TEST_H_DEF
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define test_check(A) if (!(A)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #A); \
+    return 0; \
+}
+
+#define test_run(T) do { \
+    if (T()) { \
+        printf("ok   %s\n", #T); \
+    } else { \
+        printf("FAIL %s\n", #T); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define test_result() (test_failures ? 1 : 0)
+
+#endif//_TEST_H_DEF
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "variant.h"
+
+#include "test.h"
+
+/*
+ * The ways a TNetstring can be parsed, which should all agree.
+ */
+enum { PARSE_COPY, PARSE_VIEW, PARSE_ARENA, PARSE_MODES };
+
+static variant_t * parse(int mode, m2_arena_t * arena, const char * data, size_t len, char ** rest) {
+    switch (mode) {
+        case PARSE_COPY:
+            return m2_parse_tns(data, len, rest);
+        case PARSE_VIEW:
+            return m2_parse_tns_view(data, len, rest);
+        default:
+            return m2_parse_tns_arena(arena, data, len, rest);
+    }
+}
+
+/*
+ * Checks that \a in parses in every mode, using all of it, and is
+ * written back as exactly the same bytes.
+ */
+static int round_trip(const char * in) {
+    size_t len = strlen(in);
+    int mode = 0;
+
+    for (mode = 0; mode < PARSE_MODES; mode++) {
+        m2_arena_t * arena = m2_arena_new(0);
+        char * rest = NULL;
+
+        variant_t * val = parse(mode, arena, in, len, &rest);
+        test_check(val);
+        test_check(rest == in + len);
+
+        size_t size = m2_variant_size_tns(val);
+        test_check(size == len);
+
+        char * out = malloc(size + 8);
+        test_check(out);
+
+        // The output is written back to front, to the end of the buffer
+        test_check(m2_variant_write_tns(val, out, size - 1) == 0);
+        test_check(m2_variant_write_tns(val, out, size + 8) == size);
+        test_check(memcmp(out + 8, in, len) == 0);
+        test_check(m2_variant_write_tns(val, out, size) == size);
+        test_check(memcmp(out, in, len) == 0);
+
+        free(out);
+        if (mode != PARSE_ARENA) m2_variant_destroy(val);
+        m2_arena_destroy(arena);
+    }
+
+    return 1;
+}
+
+/*
+ * Checks that \a in is rejected in every mode.
+ */
+static int rejected(const char * in) {
+    int mode = 0;
+
+    for (mode = 0; mode < PARSE_MODES; mode++) {
+        m2_arena_t * arena = m2_arena_new(0);
+        test_check(parse(mode, arena, in, strlen(in), NULL) == NULL);
+        m2_arena_destroy(arena);
+    }
+
+    return 1;
+}
+
+static int test_scalars(void) {
+    test_check(round_trip("0:,"));
+    test_check(round_trip("5:hello,"));
+    test_check(round_trip("2:42#"));
+    test_check(round_trip("3:-42#"));
+    test_check(round_trip("19:9223372036854775807#"));
+    test_check(round_trip("20:-9223372036854775808#"));
+    test_check(round_trip("4:true!"));
+    test_check(round_trip("5:false!"));
+    test_check(round_trip("0:~"));
+    test_check(round_trip("3:1.5^"));
+    test_check(round_trip("4:-0.5^"));
+
+    return 1;
+}
+
+static int test_containers(void) {
+    test_check(round_trip("0:}"));
+    test_check(round_trip("0:]"));
+    test_check(round_trip("29:5:hello,2:42#4:true!0:~0:]0:}]"));
+    test_check(round_trip("22:1:a,1:1#1:b,7:1:c,0:]}}"));
+    test_check(round_trip("27:1:a,1:1#1:b,11:1:c,4:1:x,]}}"));
+    test_check(round_trip("14:1:a,1:b,0:]0:}]"));
+
+    return 1;
+}
+
+static int test_dict_values(void) {
+    const char * in = "27:1:a,1:1#1:b,11:1:c,4:1:x,]}}";
+    struct tagbstring a = bsStatic("a");
+    struct tagbstring b = bsStatic("b");
+    struct tagbstring c = bsStatic("c");
+
+    variant_t * val = m2_parse_tns(in, strlen(in), NULL);
+    test_check(val && m2_variant_type(val) == m2_type_dict);
+    test_check(m2_variant_type(m2_variant_dict_get(val, &a)) == m2_type_integer);
+
+    variant_t * inner = m2_variant_dict_get(val, &b);
+    test_check(m2_variant_type(inner) == m2_type_dict);
+
+    variant_t * list = m2_variant_dict_get(inner, &c);
+    test_check(m2_variant_list_length(list) == 1);
+    test_check(biseqcstr(m2_variant_get_string(m2_variant_list_get(list, 0)), "x") == 1);
+
+    m2_variant_destroy(val);
+    return 1;
+}
+
+static int test_long_list(void) {
+    static char body[8000];
+    static char in[8100];
+    char * p = body;
+    int i = 0;
+
+    for (i = 0; i < 1000; i++)
+        p += sprintf(p, "%d:%d#", i < 10 ? 1 : i < 100 ? 2 : 3, i);
+    sprintf(in, "%d:%s]", (int)(p - body), body);
+
+    test_check(round_trip(in));
+
+    variant_t * val = m2_parse_tns(in, strlen(in), NULL);
+    test_check(m2_variant_list_length(val) == 1000);
+    m2_variant_destroy(val);
+
+    return 1;
+}
+
+static int test_rest(void) {
+    const char * in = "1:a,XYZ";
+    char * rest = NULL;
+
+    variant_t * val = m2_parse_tns(in, strlen(in), &rest);
+    test_check(val && rest == in + 4);
+    m2_variant_destroy(val);
+
+    return 1;
+}
+
+static int test_invalid(void) {
+    test_check(rejected(""));
+    test_check(rejected("5:hello"));
+    test_check(rejected("5:hello;"));
+    test_check(rejected("5:hellos"));
+    test_check(rejected("x:a,"));
+    test_check(rejected(":a,"));
+    test_check(rejected("1234567890:a,"));
+    test_check(rejected("1:x~"));
+    test_check(rejected("3:tru!"));
+    test_check(rejected("3:abc#"));
+    test_check(rejected("3:1.x^"));
+    test_check(rejected("10:1:a,1:b,}"));
+    test_check(rejected("4:1:a,}"));
+    test_check(rejected("8:1:a,1:b!}"));
+    test_check(rejected("7:1:a,2:bb#}"));
+    // An item running past the end of its list
+    test_check(rejected("5:3:abc]"));
+
+    return 1;
+}
+
+/*
+ * Makes \a depth nested empty lists.
+ */
+static const char * nested(int depth) {
+    static char cur[4096];
+    static char next[sizeof(cur) + 16];
+    int i = 0;
+
+    strcpy(cur, "0:]");
+    for (i = 1; i < depth; i++) {
+        snprintf(next, sizeof(next), "%d:%s]", (int)strlen(cur), cur);
+        strcpy(cur, next);
+    }
+
+    return cur;
+}
+
+static int test_nesting_limit(void) {
+    test_check(round_trip(nested(64)));
+    test_check(rejected(nested(65)));
+    test_check(rejected(nested(100)));
+
+    return 1;
+}
+
+/*
+ * Checks that \a val encodes as \a expected.
+ */
+static int encodes_as(const variant_t * val, const char * expected) {
+    char out[256];
+    size_t size = m2_variant_size_tns(val);
+
+    test_check(size == strlen(expected) && size <= sizeof(out));
+    test_check(m2_variant_write_tns(val, out, size) == size);
+    test_check(memcmp(out, expected, size) == 0);
+
+    return 1;
+}
+
+static int test_built_values(void) {
+    struct tagbstring key = bsStatic("key");
+    variant_t * dict = m2_variant_dict_new();
+    variant_t * list = m2_variant_list_new();
+    variant_t * empty = m2_variant_string_new();
+
+    test_check(encodes_as(dict, "0:}"));
+    test_check(encodes_as(list, "0:]"));
+    test_check(encodes_as(empty, "0:,"));
+    m2_variant_destroy(empty);
+
+    // Strings on the heap can be changed through their bstring
+    variant_t * str = m2_parse_tns("3:val,", 6, NULL);
+    test_check(bcatcstr(m2_variant_get_string(str), "ue") == BSTR_OK);
+    test_check(encodes_as(str, "5:value,"));
+
+    test_check(m2_variant_list_append(list, str));
+    test_check(m2_variant_list_append(list, m2_variant_null_new()));
+    test_check(encodes_as(list, "11:5:value,0:~]"));
+
+    test_check(m2_variant_dict_set(dict, bfromcstr("key"), list));
+    test_check(encodes_as(dict, "21:3:key,11:5:value,0:~]}"));
+
+    variant_t * copy = m2_variant_clone(dict);
+    m2_variant_destroy(dict);
+    test_check(encodes_as(copy, "21:3:key,11:5:value,0:~]}"));
+    test_check(m2_variant_list_length(m2_variant_dict_get(copy, &key)) == 2);
+    m2_variant_destroy(copy);
+
+    return 1;
+}
+
+static int test_special_floats(void) {
+    variant_t * val = m2_parse_json("[1e400,-1e400]", 14, NULL);
+    test_check(val);
+    test_check(encodes_as(val, "13:3:inf^4:-inf^]"));
+    m2_variant_destroy(val);
+
+    return 1;
+}
+
+int main(void) {
+    test_run(test_scalars);
+    test_run(test_containers);
+    test_run(test_dict_values);
+    test_run(test_long_list);
+    test_run(test_rest);
+    test_run(test_invalid);
+    test_run(test_nesting_limit);
+    test_run(test_built_values);
+    test_run(test_special_floats);
+
+    return test_result();
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "variant.h"
+#include "writer.h"
+
+#include "test.h"
+
+typedef struct sink {
+    char buf[65536];
+    size_t len;
+    int calls;
+    int fail;
+} sink_t;
+
+static int sink_write(void * data, const char * buf, size_t len) {
+    sink_t * sink = data;
+
+    if (sink->fail || sink->len + len > sizeof(sink->buf))
+        return 0;
+
+    memcpy(sink->buf + sink->len, buf, len);
+    sink->len += len;
+    sink->calls++;
+
+    return 1;
+}
+
+static int test_grow(void) {
+    m2_writer_t * w = m2_writer_new(1);
+    char expected[1000];
+    size_t len = 0;
+    int i = 0;
+
+    for (i = 0; i < 1000; i++) {
+        expected[i] = 'a' + i % 26;
+        test_check(m2_writer_write(w, &expected[i], 1));
+    }
+
+    const char * data = m2_writer_data(w, &len);
+    test_check(len == 1000 && memcmp(data, expected, len) == 0);
+
+    // Reserving more than is left grows the buffer
+    char * out = m2_writer_reserve(w, 5000);
+    test_check(out);
+    memset(out, 'x', 5000);
+    m2_writer_advance(w, 5000);
+    data = m2_writer_data(w, &len);
+    test_check(len == 6000 && memcmp(data, expected, 1000) == 0 && data[5999] == 'x');
+
+    m2_writer_reset(w);
+    m2_writer_data(w, &len);
+    test_check(len == 0);
+
+    m2_writer_destroy(w);
+    return 1;
+}
+
+static int test_sink(void) {
+    static sink_t sink;
+    char big[100];
+    size_t len = 0;
+
+    m2_writer_t * w = m2_writer_new_sink(sink_write, &sink, 16);
+    test_check(w);
+
+    test_check(m2_writer_write(w, "hello", 5));
+    test_check(sink.calls == 0);
+
+    // Larger than the buffer, so it goes out in pieces
+    memset(big, 'b', sizeof(big));
+    test_check(m2_writer_write(w, big, sizeof(big)));
+    test_check(sink.calls > 0);
+
+    // A reservation larger than the buffer flushes and grows it
+    char * out = m2_writer_reserve(w, 40);
+    test_check(out);
+    memset(out, 'r', 40);
+    m2_writer_advance(w, 40);
+
+    test_check(m2_writer_flush(w));
+    m2_writer_data(w, &len);
+    test_check(len == 0);
+
+    test_check(sink.len == 145);
+    test_check(memcmp(sink.buf, "hello", 5) == 0);
+    test_check(memcmp(sink.buf + 5, big, sizeof(big)) == 0);
+    test_check(sink.buf[105] == 'r' && sink.buf[144] == 'r');
+
+    sink.fail = 1;
+    test_check(m2_writer_write(w, "x", 1));
+    test_check(!m2_writer_flush(w));
+
+    m2_writer_destroy(w);
+    return 1;
+}
+
+/*
+ * A value written to a sink with a small buffer should come out the
+ * same as when it is collected in one buffer.
+ */
+static int test_json_to_sink(void) {
+    static char in[40000];
+    static sink_t sink;
+    char * p = in;
+    size_t len = 0;
+    int i = 0;
+
+    p += sprintf(p, "{\"list\":[");
+    for (i = 0; i < 1000; i++)
+        p += sprintf(p, "%s{\"n\":%d,\"s\":\"a\\\"b\"}", i ? "," : "", i);
+    p += sprintf(p, "]}");
+
+    variant_t * val = m2_parse_json(in, p - in, NULL);
+    test_check(val);
+
+    m2_writer_t * w = m2_writer_new(0);
+    m2_writer_t * s = m2_writer_new_sink(sink_write, &sink, 64);
+    test_check(m2_variant_write_json(val, w));
+    test_check(m2_variant_write_json(val, s));
+    test_check(m2_writer_flush(s));
+
+    const char * data = m2_writer_data(w, &len);
+    test_check(len == (size_t)(p - in) && memcmp(data, in, len) == 0);
+    test_check(sink.len == len && memcmp(sink.buf, in, len) == 0);
+
+    m2_writer_destroy(w);
+    m2_writer_destroy(s);
+    m2_variant_destroy(val);
+    return 1;
+}
+
+int main(void) {
+    test_run(test_grow);
+    test_run(test_sink);
+    test_run(test_json_to_sink);
+
+    return test_result();
+}
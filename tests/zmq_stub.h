@@ -0,0 +1,39 @@
+/**
+ * @file zmq_stub.h
+ *
+ * A stand-in for the parts of 0MQ the library uses, so the tests can
+ * feed it messages without a Mongrel2 instance.
+ *
+ * Every receive takes the next entry queued with zmq_stub_push() or
+ * zmq_stub_push_error(), whichever socket it is on. A blocking receive
+ * with nothing queued fails with ETERM, as it would once the context
+ * is terminated. Sent messages are counted and dropped. None of it is
+ * thread-safe.
+ */
+#ifndef _ZMQ_STUB_H_DEF
+#define _ZMQ_STUB_H_DEF
+
+#include <stddef.h>
+
+/*
+ * Queues a message of the \a len bytes at \a data. Each message is
+ * received into a buffer of exactly its size.
+ */
+void zmq_stub_push(const void * data, size_t len);
+
+/*
+ * Queues a receive that fails with \a err.
+ */
+void zmq_stub_push_error(int err);
+
+/*
+ * Gets the number of entries still queued.
+ */
+int zmq_stub_pending(void);
+
+/*
+ * Gets the number of messages sent so far.
+ */
+int zmq_stub_sent(void);
+
+#endif//_ZMQ_STUB_H_DEF